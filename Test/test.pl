@@ -44,12 +44,21 @@
 :- asserta(user:file_search_path(foreign, '..')).
 :- use_module(library(sgml)).
 :- use_module(library(pretty_print)).
+:- use_module(library(filesex)).
+:- use_module(library(charsio)).
 
 :- dynamic failed/1.
 
 test :-
 	testdir(.),
-	test_callback.
+	test_callback,
+	test_dtd_image,
+	test_shared_dtd,
+	test_default_attributes,
+	test_block_parse,
+	test_nested_parse,
+	test_reuse_parser,
+	test_events.
 
 testdir(Dir) :-
 	retractall(failed(_)),
@@ -229,3 +238,476 @@ on_begin(name, _Attr, Parser) :-
 	assertz(content(Content)).
 
 on_end(_Tag, _Parser).
+
+
+		 /*******************************
+		 *	     DTD IMAGES		*
+		 *******************************/
+
+%	test_dtd_image
+%
+%	Save a DTD using save_dtd/2 and load it back using
+%	load_dtd_image/2.  Damaged images must be rejected and
+%	load_dtd_file/3 must ignore an image that is older than the DTD.
+
+test_dtd_image :-
+	tmp_file(dtd, Base),
+	file_name_extension(Base, dtd, DtdFile),
+	file_name_extension(Base, dtdc, ImageFile),
+	call_cleanup(test_dtd_image(DtdFile, ImageFile),
+		     ( delete_if_exists(DtdFile),
+		       delete_if_exists(ImageFile)
+		     )).
+
+test_dtd_image(DtdFile, ImageFile) :-
+	image_dtd(Lines),
+	write_lines(DtdFile, Lines),
+	new_dtd(doc, DTD),
+	load_dtd(DTD, DtdFile),
+	save_dtd(DTD, ImageFile),
+	new_dtd(doc, Copy),
+	load_dtd_image(Copy, ImageFile),
+	dtd_summary(DTD, Summary),
+	dtd_summary(Copy, Summary),
+	free_dtd(DTD),
+	free_dtd(Copy),
+	read_file_to_codes(ImageFile, Image, [type(binary)]),
+	forall(append(Prefix, [_|_], Image),
+	       image_rejected(Prefix)),
+	Image = [M0,M1,M2,M3,_,_,_,_|Rest],
+	image_rejected([0'X,0'X,0'X,0'X,0,0,0,0|Rest]),
+	image_rejected([M0,M1,M2,M3,255,255,255,255|Rest]),
+	append(Lines, ['<!ELEMENT extra - - EMPTY>'], NewLines),
+	write_lines(DtdFile, NewLines),
+	time_file(ImageFile, ImageTime),
+	DtdTime is ImageTime+10,
+	set_time_file(DtdFile, [], [modified(DtdTime)]),
+	sgml:load_dtd_file(doc, DtdFile, Stale),
+	dtd_property(Stale, elements(StaleElements)),
+	free_dtd(Stale),
+	memberchk(extra, StaleElements),
+	NewImageTime is DtdTime+10,
+	set_time_file(ImageFile, [], [modified(NewImageTime)]),
+	sgml:load_dtd_file(doc, DtdFile, Fresh),
+	dtd_property(Fresh, elements(FreshElements)),
+	free_dtd(Fresh),
+	\+ memberchk(extra, FreshElements).
+
+image_dtd([ '<!ENTITY % text "#PCDATA|em">',
+	    '<!ENTITY copy CDATA "&#169;">',
+	    '<!ENTITY logo SYSTEM "logo.gif" NDATA gif>',
+	    '<!NOTATION gif SYSTEM "image/gif">',
+	    '<!ELEMENT doc - - (title, (p|img)*) +(em)>',
+	    '<!ELEMENT title - O (%text;)*>',
+	    '<!ELEMENT p - O (%text;)*>',
+	    '<!ELEMENT em - - (#PCDATA)>',
+	    '<!ELEMENT img - O EMPTY>',
+	    '<!ATTLIST img src CDATA #REQUIRED type NOTATION (gif) gif>',
+	    '<!ATTLIST p align (left|right) left id ID #IMPLIED>'
+	  ]).
+
+dtd_summary(DTD, Summary) :-
+	findall(Prop, summary_property(DTD, Prop), Summary).
+
+summary_property(DTD, Prop) :-
+	member(Prop, [ doctype(_),
+		       elements(_),
+		       entities(_),
+		       notations(_),
+		       element(_,_,_),
+		       attributes(_,_),
+		       attribute(_,_,_,_),
+		       entity(_,_)
+		     ]),
+	dtd_property(DTD, Prop).
+
+image_rejected(Codes) :-
+	tmp_file(dtdc, File),
+	setup_call_cleanup(
+	    open(File, write, Out, [type(binary)]),
+	    format(Out, '~s', [Codes]),
+	    close(Out)),
+	new_dtd(doc, DTD),
+	catch(load_dtd_image(DTD, File), E, true),
+	free_dtd(DTD),
+	delete_file(File),
+	subsumes_term(error(miscellaneous(dtd_image), _), E).
+
+write_lines(File, Lines) :-
+	setup_call_cleanup(
+	    open(File, write, Out),
+	    forall(member(Line, Lines), format(Out, '~w~n', [Line])),
+	    close(Out)).
+
+delete_if_exists(File) :-
+	(   exists_file(File)
+	->  delete_file(File)
+	;   true
+	).
+
+
+		 /*******************************
+		 *	     SHARED DTDS		*
+		 *******************************/
+
+%	test_shared_dtd
+%
+%	Parse documents using a frozen DTD.  The DTD has a wide & group,
+%	of which freeze_dtd/1 does not create all states.  Parsers that
+%	modify the DTD must use a private copy and leave the frozen DTD
+%	unchanged.
+
+test_shared_dtd :-
+	numlist(0, 17, Ns),
+	maplist(member_name, Ns, Names),
+	new_dtd(doc, DTD),
+	atomic_list_concat(Names, '&', And),
+	atomic_list_concat(Names, '|', Or),
+	setup_call_cleanup(
+	    open_dtd(DTD, [], Out),
+	    format(Out, '<!ELEMENT doc - - (~w)>~n\c
+			 <!ELEMENT (~w) - - (#PCDATA)>~n', [And, Or]),
+	    close(Out)),
+	freeze_dtd(DTD),
+	reverse(Names, Reversed),
+	findall(Name, ( member(N, Ns),
+			0 =:= N mod 2,
+			member_name(N, Name)
+		      ), Even),
+	subtract(Names, Even, Odd),
+	append(Even, Odd, Mixed),
+	forall(member(Order, [Names, Reversed, Mixed]),
+	       shared_parse(DTD, Order, [], [])),
+	Mixed = [_|Incomplete],
+	shared_parse(DTD, Incomplete, [], [_]),
+	shared_parse(DTD, Mixed, [entity(e, 'an entity')], []),
+	dtd_property(DTD, entities(Entities)),
+	\+ memberchk(e, Entities),
+	new_sgml_parser(P1, [dtd(DTD)]),
+	new_sgml_parser(P2, [dtd(DTD)]),
+	set_sgml_parser(P1, dialect(xml)),
+	get_sgml_parser(P1, dialect(xml)),
+	get_sgml_parser(P2, dialect(sgml)),
+	get_sgml_parser(P2, dtd(DTD)),
+	set_sgml_parser(P2, shared_dtd(false)),
+	get_sgml_parser(P2, dtd(Copy)),
+	Copy \== DTD,
+	setup_call_cleanup(
+	    open_dtd(Copy, [], CopyOut),
+	    format(CopyOut, '<!ELEMENT extra - - EMPTY>~n', []),
+	    close(CopyOut)),
+	dtd_property(Copy, elements(CopyElements)),
+	memberchk(extra, CopyElements),
+	free_sgml_parser(P1),
+	free_sgml_parser(P2),
+	dtd_property(DTD, elements(Elements)),
+	\+ memberchk(extra, Elements),
+	catch(open_dtd(DTD, [], _), E, true),
+	subsumes_term(error(miscellaneous(sgml), _), E),
+	free_dtd(DTD).
+
+member_name(N, Name) :-
+	atom_concat(m, N, Name).
+
+%	shared_parse(+DTD, +Order, +Options, -Errors)
+%
+%	Parse <doc> holding the elements in Order, where m0 holds &e;
+%	if Options defines the entity e.
+
+shared_parse(DTD, Order, Options, Errors) :-
+	(   memberchk(entity(e, Value), Options)
+	->  Text = '&e;', Content = [Value]
+	;   Text = '', Content = []
+	),
+	findall(Codes,
+		( member(Name, Order),
+		  (   Name == m0
+		  ->  format(codes(Codes), '<~w>~w</~w>', [Name, Text, Name])
+		  ;   format(codes(Codes), '<~w></~w>', [Name, Name])
+		  )
+		), Parts),
+	append(Parts, Body),
+	format(codes(Doc), '<doc>~s</doc>~n', [Body]),
+	findall(element(Name, [], C),
+		( member(Name, Order),
+		  (   Name == m0
+		  ->  C = Content
+		  ;   C = []
+		  )
+		), Elements),
+	retractall(error(_,_,_)),
+	setup_call_cleanup(
+	    open_chars_stream(Doc, In),
+	    load_structure(stream(In), DOM, [dtd(DTD)|Options]),
+	    close(In)),
+	error_terms(Errors),
+	DOM = [element(doc, [], Elements)].
+
+
+		 /*******************************
+		 *	  DEFAULT ATTRIBUTES	*
+		 *******************************/
+
+%	test_default_attributes
+%
+%	Default attribute values are shared by all elements.  Check the
+%	values with number(integer), which translates the NUMBER default.
+%	See also defatt.sgml.  The defaults of a frozen DTD are created
+%	when it is frozen and shared by the parsers that use it.
+
+test_default_attributes :-
+	load_structure('defatt.sgml', DOM,
+		       [ dialect(sgml),
+			 number(integer)
+		       ]),
+	DOM = [ element(doc, [],
+			[ element(p, A1, _),
+			  element(p, A2, _),
+			  element(p, A3, _)
+			])
+	      ],
+	compare_attributes(A1, [c='a default', n=nm, num=12, e=left, f=fixed]),
+	compare_attributes(A2, [c=other, n=me, num=3, e=left, f=fixed]),
+	compare_attributes(A3, A1),
+	new_dtd(doc, DTD),
+	setup_call_cleanup(
+	    open_dtd(DTD, [], Out),
+	    format(Out, '<!ELEMENT doc - - ((p|q)+)>~n\c
+			 <!ELEMENT (p|q) - O (#PCDATA)>~n\c
+			 <!ATTLIST (p|q) c CDATA "a default" \c
+					 e (left|right) left>~n', []),
+	    close(Out)),
+	freeze_dtd(DTD),
+	forall(between(1, 2, _),
+	       ( frozen_defaults(DTD, '<doc><p>one<q c=other>two</doc>', DOM2),
+		 DOM2 = [ element(doc, [],
+				  [ element(p, B1, _),
+				    element(q, B2, _)
+				  ])
+			],
+		 compare_attributes(B1, [c='a default', e=left]),
+		 compare_attributes(B2, [c=other, e=left])
+	       )),
+	free_dtd(DTD).
+
+frozen_defaults(DTD, Doc, DOM) :-
+	setup_call_cleanup(
+	    open_chars_stream(Doc, In),
+	    load_structure(stream(In), DOM, [dtd(DTD)]),
+	    close(In)).
+
+
+		 /*******************************
+		 *	    BINARY INPUT		*
+		 *******************************/
+
+%	test_block_parse
+%
+%	sgml_parse/2 processes binary streams a buffer at a time.  Check
+%	that content_length(N), parse(element) and parse(content) stop
+%	at the right place and leave the stream just after the parsed
+%	input, and that a UTF-8 character may be split over two buffers.
+
+test_block_parse :-
+	tmp_file(xml, File),
+	call_cleanup(test_block_parse(File),
+		     delete_if_exists(File)).
+
+test_block_parse(File) :-
+	write_binary(File, '<a>x</a><b>y</b>rest'),
+	block_parse(File, [content_length(8)], [[element(a, [], [x])]], 8),
+	write_binary(File, '<a><b>x</b></a><c>rest</c>'),
+	block_parse(File, [parse(element)],
+		    [ [element(a, [], [element(b, [], [x])])],
+		      [element(c, [], [rest])]
+		    ], 26),
+	write_binary(File, '<a><b>x</b>text</a><c>rest</c>'),
+	block_parse(File, [parse(content)],
+		    [ [ element(a, [], [element(b, [], [x]), text]),
+			element(c, [], [rest])
+		      ]
+		    ], 30),
+	length(Units, 1000),
+	maplist(=([0xe9, 0x20ac]), Units),
+	append(Units, Codes),
+	setup_call_cleanup(
+	    open(File, write, Out, [encoding(utf8)]),
+	    format(Out, '<a>~s</a>', [Codes]),
+	    close(Out)),
+	load_structure(File, DOM, [dialect(xml)]),
+	atom_codes(Text, Codes),
+	DOM == [element(a, [], [Text])].
+
+%	block_parse(+File, +Options, +DOMs, +Pos)
+%
+%	Parse File once for each element of DOMs using Options and
+%	verify that the stream is at byte Pos afterwards.
+
+block_parse(File, Options, DOMs, Pos) :-
+	setup_call_cleanup(
+	    open(File, read, In, [type(binary)]),
+	    ( forall(member(DOM, DOMs),
+		     ( new_sgml_parser(Parser, []),
+		       set_sgml_parser(Parser, dialect(xml)),
+		       sgml_parse(Parser,
+				  [ source(In),
+				    document(DOM0)
+				  | Options
+				  ]),
+		       free_sgml_parser(Parser),
+		       DOM0 == DOM
+		     )),
+	      byte_count(In, Pos)
+	    ),
+	    close(In)).
+
+write_binary(File, Atom) :-
+	setup_call_cleanup(
+	    open(File, write, Out, [type(binary)]),
+	    format(Out, '~w', [Atom]),
+	    close(Out)).
+
+
+		 /*******************************
+		 *	    NESTED PARSING		*
+		 *******************************/
+
+:- thread_local nested_dom/1.
+
+%	test_nested_parse
+%
+%	Call sgml_parse/2 from a begin callback.  The document(DOM) of
+%	the nested call ends with the element that was open when it was
+%	called, both for parse(element) and parse(content).  Also check
+%	parse(element) on omitend.sgml, which omits end tags.
+
+test_nested_parse :-
+	forall(member(Mode, [element, content]),
+	       ( nested_parse(Mode, Sub),
+		 Sub == [element(c, [], ['1']), element(d, [], []), '2']
+	       )),
+	load_structure('omitend.sgml', DOM,
+		       [ dialect(sgml),
+			 parse(element)
+		       ]),
+	load_prolog_file('ok/omitend.ok', OkDOM, _),
+	compare_dom(DOM, OkDOM).
+
+nested_parse(Mode, DOM) :-
+	retractall(nested_dom(_)),
+	atom_codes('<top><a>x</a><sub><c>1</c><d/>2</sub><z>after</z></top>',
+		   Codes),
+	setup_call_cleanup(
+	    open_chars_stream(Codes, In),
+	    ( new_sgml_parser(Parser, []),
+	      set_sgml_parser(Parser, dialect(xml)),
+	      sgml_parse(Parser,
+			 [ source(In),
+			   call(begin, nested_begin(Mode))
+			 ]),
+	      free_sgml_parser(Parser)
+	    ),
+	    close(In)),
+	nested_dom(DOM).
+
+nested_begin(Mode, sub, _Attr, Parser) :- !,
+	sgml_parse(Parser,
+		   [ document(DOM),
+		     parse(Mode)
+		   ]),
+	assertz(nested_dom(DOM)).
+nested_begin(_, _, _, _).
+
+%	test_reuse_parser
+%
+%	sgml_parse/2 fails if the document(DOM) argument does not unify.
+%	After that, the parser can be used for the next document.
+
+test_reuse_parser :-
+	setup_call_cleanup(
+	    new_sgml_parser(Parser, []),
+	    ( set_sgml_parser(Parser, dialect(xml)),
+	      \+ parse_codes(Parser, '<a><b>x</b></a>',
+			      [element(a, [], [wrong])]),
+	      parse_codes(Parser, '<c>y</c>', DOM)
+	    ),
+	    free_sgml_parser(Parser)),
+	DOM == [element(c, [], [y])].
+
+parse_codes(Parser, Doc, DOM) :-
+	atom_codes(Doc, Codes),
+	setup_call_cleanup(
+	    open_chars_stream(Codes, In),
+	    sgml_parse(Parser,
+		       [ source(In),
+			 document(DOM)
+		       ]),
+	    close(In)).
+
+
+		 /*******************************
+		 *	       EVENTS		*
+		 *******************************/
+
+:- thread_local seen_batch/1.
+
+%	test_events
+%
+%	Check call(events, Handler) with batches of 1, 2 and more events
+%	than the document holds.  A failing handler is ignored, while an
+%	exception from the handler stops the parse.
+
+test_events :-
+	Doc = '<a x="1"><b>t1</b>t2<c/></a>',
+	Events = [ begin(a, [x='1']), begin(b, []), text(t1), end(b),
+		   text(t2), begin(c, []), end(c), end(a)
+		 ],
+	forall(member(N, [1, 2, 100]),
+	       ( event_parse(Doc, [ event_batch(N),
+				    call(events, save_events),
+				    document(DOM)
+				  ], Batches),
+		 append(Batches, Events),
+		 forall(append(_, [B,_|_], Batches), length(B, N)),
+		 DOM == [ element(a, [x='1'],
+				  [ element(b, [], [t1]), t2, element(c, [], [])
+				  ])
+			]
+	       )),
+	event_parse(Doc, [event_batch(2), call(events, fail_events)], Failed),
+	append(Failed, Events),
+	forall(member(N-Seen, [2-[[begin(a, [x='1']), begin(b, [])]],
+			       100-[Events]]),
+	       ( catch(event_parse(Doc, [ event_batch(N),
+					  call(events, throw_events),
+					  document(_)
+					], _),
+		       E, true),
+		 E == stop_events,
+		 findall(B, seen_batch(B), Seen)
+	       )).
+
+event_parse(Doc, Options, Batches) :-
+	retractall(seen_batch(_)),
+	atom_codes(Doc, Codes),
+	setup_call_cleanup(
+	    open_chars_stream(Codes, In),
+	    setup_call_cleanup(
+		new_sgml_parser(Parser, []),
+		( set_sgml_parser(Parser, dialect(xml)),
+		  sgml_parse(Parser, [source(In)|Options])
+		),
+		free_sgml_parser(Parser)),
+	    close(In)),
+	findall(B, seen_batch(B), Batches).
+
+save_events(Events, _Parser) :-
+	assertz(seen_batch(Events)).
+
+fail_events(Events, _Parser) :-
+	assertz(seen_batch(Events)),
+	fail.
+
+throw_events(Events, _Parser) :-
+	assertz(seen_batch(Events)),
+	throw(stop_events).
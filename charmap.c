@@ -64,6 +64,40 @@ new_charclass()
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Compute the characters that  end  a  run   of  plain  PCDATA  for  the
+block scanner in parser.c. Characters  that   only  matter in a specific
+context (] in marked sections, / waiting  for a NET) are not included;
+the parser does not use the scanner in these contexts.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+add_pcdata_stop(dtd_charfunc *f, int chr)
+{ if ( chr < 0x80 && !f->pcdata_stop[chr] )
+  { f->pcdata_stop[chr] = TRUE;
+    f->pcdata_stop_chars[f->pcdata_nstop++] = (unsigned char)chr;
+  }
+}
+
+
+static void
+init_pcdata_stop(dtd_charfunc *f)
+{ const ichar *cf = f->func;
+  int i;
+
+  for(i=0x80; i<INPUT_CHARSET_SIZE; i++)
+    f->pcdata_stop[i] = TRUE;		/* UTF-8 or blank test needed */
+
+  add_pcdata_stop(f, cf[CF_MDO1]);
+  add_pcdata_stop(f, cf[CF_ERO]);
+  add_pcdata_stop(f, cf[CF_PERO]);
+  add_pcdata_stop(f, cf[CF_RS]);
+  add_pcdata_stop(f, cf[CF_RE]);
+  add_pcdata_stop(f, '\n');
+  add_pcdata_stop(f, '\r');
+}
+
+
 dtd_charfunc *
 new_charfunc()
 { dtd_charfunc *f = sgml_calloc(1, sizeof(*f));
@@ -100,5 +134,7 @@ new_charfunc()
   cf[CF_RE]	= '\r';
   cf[CF_CMT]	= '-';
 
+  init_pcdata_stop(f);
+
   return f;
 }
@@ -24,6 +24,7 @@
 #ifndef DTD_H_INCLUDED
 #define DTD_H_INCLUDED
 #include "sgmldefs.h"
+#include "util.h"
 
 #define CH_WHITE	0x0001
 #define CH_LCLETTER	0x0002
@@ -269,11 +270,20 @@ typedef struct _dtd_srcloc
     const ichar *entity;		/* name of entity */
   } name;
   int	      line;			/* 1-based Line no */
-  int	      linepos;			/* 1-based char  */
+  long	      lineoff;			/* charpos - linepos */
   long	      charpos;			/* 0-based file char  */
   struct _dtd_srcloc *parent;		/* parent location */
 } dtd_srcloc;
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The column is not maintained for  each   character.  Instead,  lineoff is
+updated at the end of each line (and for multi-byte characters), and
+the column is computed from the byte position when it is needed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define sgml_linepos(l) ((int)((l)->charpos - (l)->lineoff))
+#define sgml_set_linepos(l, lp) ((l)->lineoff = (l)->charpos - (lp))
+
 
 typedef struct _dtd_error
 { dtd_error_id id;			/* ERC_* identifier */
@@ -293,15 +303,22 @@ typedef struct _dtd_error
 
 typedef struct _dtd_symbol
 { const ichar *name;			/* name of the atom */
-  struct _dtd_symbol *next;		/* next in atom list */
   struct _dtd_element *element;		/* connected element (if any) */
   struct _dtd_entity  *entity;		/* connected entity (if any) */
+  uintptr_t	handle;			/* client handle for the name */
+  uintptr_t	local_handle;		/* client handle for the local name */
 } dtd_symbol;
 
 
+typedef struct _dtd_symbol_slot
+{ unsigned int	hash;			/* istrfoldhash() of the name */
+  dtd_symbol   *symbol;			/* the symbol (NULL: free) */
+} dtd_symbol_slot;
+
 typedef struct _dtd_symbol_table
-{ int		size;			/* Allocated size */
-  dtd_symbol  **entries;		/* Entries */
+{ int		size;			/* Allocated size (power of 2) */
+  int		count;			/* # symbols */
+  dtd_symbol_slot *entries;		/* Entries */
 } dtd_symbol_table;
 
 
@@ -354,7 +371,7 @@ typedef struct _dtd_attr
     dtd_symbol *name;			/* AT_NAME or AT_NAMEOF */
     long number;			/* AT_NUMBER */
   } att_def;
-  int references;			/* reference count */
+  uintptr_t	handle;			/* client handle for the default */
 } dtd_attr;
 
 
@@ -364,6 +381,18 @@ typedef struct _dtd_attr_list
 } dtd_attr_list;
 
 
+typedef struct _dtd_attr_index		/* fast access to attributes */
+{ int		size;			/* # slots (power of 2) */
+  int		count;			/* # attributes */
+  dtd_attr    **table;			/* name --> attribute */
+  dtd_attr_list *defaults;		/* FIXED and DEFAULT attributes */
+  dtd_attr_list **defaults_tail;	/* end of defaults */
+  int		ndefaults;		/* # default values */
+  struct _sgml_attribute *default_values; /* values of defaults */
+  dtd_number_mode number_mode;		/* number_mode of default_values */
+} dtd_attr_index;
+
+
 typedef struct _dtd_model
 { modeltype type;			/* MT_* */
   modelcard cardinality;		/* MC_* */
@@ -384,8 +413,7 @@ typedef struct _dtd_edef
   dtd_element_list *included;		/* +(namegroup) */
   dtd_element_list *excluded;		/* -(namegroup) */
   struct _dtd_state *initial_state;	/* Initial state in state engine */
-  struct _dtd_state *final_state;	/* Final state in state engine */
-  int		references;		/* #elements using this def */
+  struct _and_memo *and_memo;		/* Expanded (a&b&...) states */
 } dtd_edef;
 
 
@@ -410,6 +438,7 @@ typedef struct _dtd_element
 { dtd_symbol	*name;			/* its name */
   dtd_edef	*structure;		/* content structure of the element */
   dtd_attr_list *attributes;		/* defined attributes */
+  dtd_attr_index *attr_index;		/* index on attributes (lazy) */
   dtd_space_mode space_mode;		/* How to handle white-space (SP_*) */
   dtd_shortref	*map;			/* SHORTREF map */
   int		undefined;		/* Only implicitely defined */
@@ -422,8 +451,23 @@ typedef struct _dtd_charclass
 } dtd_charclass;
 
 
+#define MAXPCDATASTOP 8			/* max chars ending a PCDATA run */
+
+#define TOK_NSTATES 32			/* >= # tokenizer states */
+#define TOK_NCLASSES 24			/* max # tokenizer char classes */
+
+typedef struct _dtd_transition
+{ unsigned char action;			/* TA_* (see parser.c) */
+  unsigned char state;			/* next tokenizer state */
+} dtd_transition;
+
 typedef struct _dtd_charfunc
 { ichar func[(int)CF_ENDTABLE];		/* CF_ --> ichar */
+  int	pcdata_nstop;			/* # entries in pcdata_stop_chars */
+  unsigned char pcdata_stop_chars[MAXPCDATASTOP]; /* chars ending PCDATA */
+  char	pcdata_stop[INPUT_CHARSET_SIZE]; /* same, as a table (+ >= 0x80) */
+  unsigned char tok_class[INPUT_CHARSET_SIZE]; /* char --> tokenizer class */
+  dtd_transition tok_table[TOK_NSTATES][TOK_NCLASSES]; /* [state][class] */
 } dtd_charfunc;
 
 
@@ -451,13 +495,24 @@ typedef struct _dtd
   int			shorttag;	/* support SHORTTAG */
   int			system_entities; /* expand SYSTEM entities */
   int			references;	/* destruction reference count */
+  int			frozen;		/* shared and read-only */
+  sgml_arena		arena;		/* symbols, elements, models, ... */
 } dtd;
 
 extern dtd_charfunc *new_charfunc(void);   /* default classification */
 extern dtd_charclass *new_charclass(void); /* default classification */
 
+typedef void (*dtd_release_symbol_f)(dtd_symbol *s);
+
+extern dtd_release_symbol_f dtd_release_symbol; /* frees symbol handles */
+
+typedef void (*dtd_release_attr_f)(dtd_attr *a);
+
+extern dtd_release_attr_f dtd_release_attr; /* frees attribute handles */
+
 extern dtd_symbol*	dtd_find_symbol(dtd *dtd, const ichar *name);
 extern dtd_symbol*	dtd_add_symbol(dtd *dtd, const ichar *name);
+extern dtd_attr_list*	dtd_default_attributes(dtd *dtd, dtd_element *e);
 
 
 		 /*******************************
@@ -476,12 +531,22 @@ dtd_parser *	new_dtd_parser(dtd *dtd);
 void		free_dtd_parser(dtd_parser *p);
 
 void		free_dtd(dtd *dtd);
+int		freeze_dtd(dtd *dtd);
+dtd *		clone_dtd(dtd *dtd);
+int		unshare_dtd_parser(dtd_parser *p);
+dtd_symbol *	add_symbol_dtd_parser(dtd_parser *p, const ichar *name);
+dtd_symbol *	add_nsymbol_dtd_parser(dtd_parser *p,
+				       const ichar *name, size_t len);
 int		load_dtd_from_file(dtd_parser *p, const ichar *file);
+int		save_dtd_image(dtd *dtd, const ichar *file);
+int		load_dtd_image(dtd *dtd, const ichar *file);
 dtd *		new_dtd(const ichar *doctype);
 int		set_dialect_dtd(dtd *dtd, dtd_dialect dialect);
 int		set_option_dtd(dtd *dtd, dtd_option option, int set);
 
 int		putchar_dtd_parser(dtd_parser *p, int chr);
+size_t		process_buffer_dtd_parser(dtd_parser *p,
+					  const char *buf, size_t len);
 int		begin_document_dtd_parser(dtd_parser *p);
 int		end_document_dtd_parser(dtd_parser *p);
 void		reset_document_dtd_parser(dtd_parser *p);
@@ -36,12 +36,13 @@ char *program;
 
 static void
 usage()
-{ fprintf(stderr, "Usage: %s [-xml|sgml] file.dtd\n", program);
+{ fprintf(stderr, "Usage: %s [-xml|sgml] [-image out] file.dtd\n", program);
 }
 
 int
 main(int argc, char **argv)
 { dtd_dialect dialect = DL_SGML;
+  char *image = NULL;
 
   init_ring();
 
@@ -58,6 +59,10 @@ main(int argc, char **argv)
     { dialect = DL_SGML;
       argc--;
       argv++;
+    } else if ( streq(argv[0], "-image") && argc > 1 )
+    { image = argv[1];
+      argc -= 2;
+      argv += 2;
     } else
     { usage();
       exit(1);
@@ -75,7 +80,18 @@ main(int argc, char **argv)
       dtd = file_to_dtd(ws, L"test", dialect);
 
       if ( dtd )
-      { prolog_print_dtd(dtd, PL_PRINT_ALL & ~PL_PRINT_PENTITIES);
+      { if ( image )
+	{ size_t il = strlen(image);
+	  wchar_t *wimage = malloc((il+1)*sizeof(wchar_t));
+
+	  mbstowcs(wimage, image, il+1);
+	  if ( !save_dtd_image(dtd, wimage) )
+	  { perror(image);
+	    exit(1);
+	  }
+	} else
+	{ prolog_print_dtd(dtd, PL_PRINT_ALL & ~PL_PRINT_PENTITIES);
+	}
 	return 0;
       }
     } else
@@ -0,0 +1,1028 @@
+/*  Part of SWI-Prolog
+
+    WWW:           http://www.swi-prolog.org
+    Copyright (C): 2026, University of Amsterdam
+			 VU University Amsterdam
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "dtd.h"
+#include "util.h"
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+This module saves a compiled DTD as  a   binary  image and loads it back
+without tokenising or parsing the DTD text.   The image is a sequence of
+32-bit words in native byte order. It  contains no pointers: objects are
+referenced by their index in the   preceding  tables, which makes it
+position independent. Loading maps the  file   into  memory and rebuilds
+the DTD in a single pass, allocating most objects in the DTD's arena.
+
+The image holds
+
+    - header (magic, version) and the DTD settings
+    - symbols
+    - notations, parameter entities and entities
+    - SHORTREF maps
+    - elements, attribute definitions, element definitions (including
+      the content models) and finally the links between them
+    - trailer (magic)
+
+A string is stored as its length followed by one word per character. A
+symbol, element definition, attribute or map is referenced by its index
+plus one; 0 is NULL. State engines are not saved; they are created from
+the content models when needed, as for a DTD loaded from text.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define DTD_IMAGE_MAGIC		0x44544453 /* "SDTD" */
+#define DTD_IMAGE_VERSION	1
+#define NO_STRING		0xffffffff
+#define EMPTY_MAP		0xffffffff /* the anonymous #EMPTY map */
+#define MAX_MODEL_DEPTH		1000
+
+typedef uint32_t word;
+
+typedef enum
+{ AD_NONE = 0,				/* no default value */
+  AD_STRING,				/* att_def.cdata or att_def.list */
+  AD_NAME,				/* att_def.name */
+  AD_NUMBER				/* att_def.number */
+} attdef_kind;
+
+
+		 /*******************************
+		 *	   POINTER TABLE	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+While saving, objects are numbered in the order they are written. A small
+open hash table maps their address to this number.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct
+{ const void *key;			/* address of the object */
+  int	      index;			/* 0-based index in the image */
+} ptr_slot;
+
+typedef struct
+{ int	      size;			/* # slots (power of 2) */
+  int	      count;			/* # objects */
+  ptr_slot   *slots;			/* the table */
+} ptr_table;
+
+
+static void
+init_ptr_table(ptr_table *t)
+{ t->size  = 64;
+  t->count = 0;
+  t->slots = sgml_calloc(t->size, sizeof(ptr_slot));
+}
+
+
+static unsigned int
+ptr_hash(const void *key)
+{ uintptr_t k = (uintptr_t)key;
+
+  return (unsigned int)((k>>4) ^ (k>>16));
+}
+
+
+static int
+ptr_index(ptr_table *t, const void *key)
+{ unsigned int mask = t->size-1;
+  unsigned int i;
+
+  for(i=ptr_hash(key)&mask; t->slots[i].key; i=(i+1)&mask)
+  { if ( t->slots[i].key == key )
+      return t->slots[i].index;
+  }
+
+  return -1;
+}
+
+
+static void
+ptr_insert(ptr_slot *slots, int size, const void *key, int index)
+{ unsigned int mask = size-1;
+  unsigned int i;
+
+  for(i=ptr_hash(key)&mask; slots[i].key; i=(i+1)&mask)
+    ;
+  slots[i].key   = key;
+  slots[i].index = index;
+}
+
+
+static int
+ptr_add(ptr_table *t, const void *key)
+{ int i;
+
+  if ( (i=ptr_index(t, key)) >= 0 )
+    return i;
+
+  if ( (t->count+1)*4 > t->size*3 )
+  { int newsize = t->size*2;
+    ptr_slot *new = sgml_calloc(newsize, sizeof(ptr_slot));
+
+    for(i=0; i<t->size; i++)
+    { if ( t->slots[i].key )
+	ptr_insert(new, newsize, t->slots[i].key, t->slots[i].index);
+    }
+    sgml_free(t->slots);
+    t->slots = new;
+    t->size  = newsize;
+  }
+
+  ptr_insert(t->slots, t->size, key, t->count);
+
+  return t->count++;
+}
+
+
+static void
+free_ptr_table(ptr_table *t)
+{ sgml_free(t->slots);
+}
+
+
+		 /*******************************
+		 *	       SAVE		*
+		 *******************************/
+
+typedef struct
+{ word	     *data;			/* image being built */
+  size_t      size;			/* # words used */
+  size_t      allocated;		/* # words allocated */
+  ptr_table   symbols;			/* dtd_symbol --> index */
+  ptr_table   attrs;			/* dtd_attr --> index */
+  ptr_table   edefs;			/* dtd_edef --> index */
+  ptr_table   maps;			/* dtd_shortref --> index */
+} image_out;
+
+
+static void
+put_word(image_out *out, word w)
+{ if ( out->size == out->allocated )
+  { out->allocated = (out->allocated ? out->allocated*2 : 4096);
+    out->data = sgml_realloc(out->data, out->allocated*sizeof(word));
+  }
+
+  out->data[out->size++] = w;
+}
+
+
+static void
+put_nstring(image_out *out, const ichar *s, size_t len)
+{ if ( !s )
+  { put_word(out, NO_STRING);
+  } else
+  { put_word(out, (word)len);
+    while(len-- > 0)
+      put_word(out, (word)*s++);
+  }
+}
+
+
+static void
+put_string(image_out *out, const ichar *s)
+{ put_nstring(out, s, s ? istrlen(s) : 0);
+}
+
+
+static void
+put_ref(ptr_table *t, image_out *out, const void *obj)
+{ put_word(out, obj ? (word)ptr_index(t, obj)+1 : 0);
+}
+
+#define put_symbol(out, s) put_ref(&(out)->symbols, out, s)
+
+
+static void
+put_entities(image_out *out, dtd *dtd, dtd_entity *list)
+{ dtd_entity *e;
+  word n = 0;
+
+  for(e=list; e; e=e->next)
+    n++;
+  put_word(out, n);
+
+  for(e=list; e; e=e->next)
+  { put_symbol(out, e->name);
+    put_word(out, e->type);
+    put_word(out, e->content);
+    put_word(out, e->catalog_location);
+    put_word(out, e == dtd->default_entity);
+    put_nstring(out, e->value, e->value ? e->length : 0);
+    put_string(out, e->extid);
+    put_string(out, e->exturl);
+    put_string(out, e->baseurl);
+  }
+}
+
+
+static void
+put_model(image_out *out, dtd_model *m)
+{ put_word(out, m->type);
+  put_word(out, m->cardinality);
+
+  switch(m->type)
+  { case MT_ELEMENT:
+      put_symbol(out, m->content.element->name);
+      break;
+    case MT_SEQ:
+    case MT_AND:
+    case MT_OR:
+    { dtd_model *sub;
+      word n = 0;
+
+      for(sub=m->content.group; sub; sub=sub->next)
+	n++;
+      put_word(out, n);
+      for(sub=m->content.group; sub; sub=sub->next)
+	put_model(out, sub);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+
+static void
+put_element_list(image_out *out, dtd_element_list *l)
+{ dtd_element_list *el;
+  word n = 0;
+
+  for(el=l; el; el=el->next)
+    n++;
+  put_word(out, n);
+  for(el=l; el; el=el->next)
+    put_symbol(out, el->value->name);
+}
+
+
+static void
+put_attribute(image_out *out, dtd *dtd, dtd_attr *a)
+{ dtd_name_list *nl;
+  word n = 0;
+
+  put_symbol(out, a->name);
+  put_word(out, a->type);
+  put_word(out, a->def);
+  put_word(out, a->islist);
+
+  if ( a->type == AT_NAMEOF || a->type == AT_NOTATION )
+  { for(nl=a->typeex.nameof; nl; nl=nl->next)
+      n++;
+  }
+  put_word(out, n);
+  if ( n > 0 )
+  { for(nl=a->typeex.nameof; nl; nl=nl->next)
+      put_symbol(out, nl->value);
+  }
+
+  if ( a->def == AT_FIXED || a->def == AT_DEFAULT )
+  { if ( a->islist )
+    { put_word(out, AD_STRING);
+      put_string(out, a->att_def.list);
+    } else if ( a->type == AT_CDATA )
+    { put_word(out, AD_STRING);
+      put_string(out, a->att_def.cdata);
+    } else if ( a->type == AT_NUMBER && dtd->number_mode == NU_INTEGER )
+    { put_word(out, AD_NUMBER);
+      put_word(out, (word)a->att_def.number);
+    } else
+    { put_word(out, AD_NAME);
+      put_symbol(out, a->att_def.name);
+    }
+  } else
+  { put_word(out, AD_NONE);
+  }
+}
+
+
+static int
+write_image(image_out *out, const ichar *file)
+{ FILE *fd;
+  size_t n;
+
+  if ( !(fd = wfopen(file, "wb")) )
+    return FALSE;
+
+  n = fwrite(out->data, sizeof(word), out->size, fd);
+  if ( fclose(fd) != 0 || n != out->size )
+    return FALSE;
+
+  return TRUE;
+}
+
+
+static void
+free_image_out(image_out *out)
+{ free_ptr_table(&out->symbols);
+  free_ptr_table(&out->attrs);
+  free_ptr_table(&out->edefs);
+  free_ptr_table(&out->maps);
+  if ( out->data )
+    sgml_free(out->data);
+}
+
+
+/* put_dtd() builds the image of dtd in out */
+
+static void
+put_dtd(image_out *out, dtd *dtd)
+{ dtd_symbol_table *st = dtd->symbols;
+  dtd_notation *not;
+  dtd_shortref *sr;
+  dtd_element *e;
+  word n;
+  int i;
+
+  memset(out, 0, sizeof(*out));
+  init_ptr_table(&out->symbols);
+  init_ptr_table(&out->attrs);
+  init_ptr_table(&out->edefs);
+  init_ptr_table(&out->maps);
+
+  put_word(out, DTD_IMAGE_MAGIC);
+  put_word(out, DTD_IMAGE_VERSION);
+					/* settings */
+  put_word(out, dtd->dialect);
+  put_word(out, dtd->case_sensitive);
+  put_word(out, dtd->ent_case_sensitive);
+  put_word(out, dtd->att_case_sensitive);
+  put_word(out, dtd->att_case_preserving);
+  put_word(out, dtd->encoding);
+  put_word(out, dtd->space_mode);
+  put_word(out, dtd->number_mode);
+  put_word(out, dtd->shorttag);
+  put_word(out, dtd->system_entities);
+  put_string(out, dtd->doctype);
+					/* symbols */
+  put_word(out, st->count);
+  for(i=0; i<st->size; i++)
+  { dtd_symbol *s;
+
+    if ( (s=st->entries[i].symbol) )
+    { ptr_add(&out->symbols, s);
+      put_string(out, s->name);
+    }
+  }
+					/* notations */
+  for(n=0, not=dtd->notations; not; not=not->next)
+    n++;
+  put_word(out, n);
+  for(not=dtd->notations; not; not=not->next)
+  { put_symbol(out, not->name);
+    put_word(out, not->type);
+    put_string(out, not->public);
+    put_string(out, not->system);
+  }
+					/* entities */
+  put_entities(out, dtd, dtd->pentities);
+  put_entities(out, dtd, dtd->entities);
+					/* SHORTREF maps */
+  for(n=0, sr=dtd->shortrefs; sr; sr=sr->next)
+    n++;
+  put_word(out, n);
+  for(sr=dtd->shortrefs; sr; sr=sr->next)
+  { dtd_map *m;
+
+    ptr_add(&out->maps, sr);
+    put_symbol(out, sr->name);
+    put_word(out, sr->defined);
+    for(i=0; i<SHORTMAP_SIZE; i += 4)
+      put_word(out, ((word)(unsigned char)sr->ends[i]) |
+		     ((word)(unsigned char)sr->ends[i+1] << 8) |
+		     ((word)(unsigned char)sr->ends[i+2] << 16) |
+		     ((word)(unsigned char)sr->ends[i+3] << 24));
+    for(n=0, m=sr->map; m; m=m->next)
+      n++;
+    put_word(out, n);
+    for(m=sr->map; m; m=m->next)
+    { put_nstring(out, m->from, m->len);
+      put_symbol(out, m->to);
+    }
+  }
+					/* elements */
+  for(n=0, e=dtd->elements; e; e=e->next)
+    n++;
+  put_word(out, n);
+  for(e=dtd->elements; e; e=e->next)
+  { put_symbol(out, e->name);
+    put_word(out, e->undefined);
+    put_word(out, e->space_mode);
+  }
+					/* attribute definitions */
+  for(e=dtd->elements; e; e=e->next)
+  { dtd_attr_list *al;
+
+    for(al=e->attributes; al; al=al->next)
+      ptr_add(&out->attrs, al->attribute);
+  }
+  put_word(out, out->attrs.count);
+  { dtd_attr **attrs = sgml_calloc(out->attrs.count+1, sizeof(dtd_attr*));
+
+    for(i=0; i<out->attrs.size; i++)
+    { if ( out->attrs.slots[i].key )
+	attrs[out->attrs.slots[i].index] = (dtd_attr*)out->attrs.slots[i].key;
+    }
+    for(i=0; i<out->attrs.count; i++)
+      put_attribute(out, dtd, attrs[i]);
+    sgml_free(attrs);
+  }
+					/* element definitions */
+  for(e=dtd->elements; e; e=e->next)
+  { if ( e->structure )
+      ptr_add(&out->edefs, e->structure);
+  }
+  put_word(out, out->edefs.count);
+  for(n=0, e=dtd->elements; e; e=e->next)
+  { dtd_edef *def = e->structure;
+
+    if ( def && ptr_index(&out->edefs, def) == (int)n )
+    { put_word(out, def->type);
+      put_word(out, def->omit_open);
+      put_word(out, def->omit_close);
+      if ( def->content )
+      { put_word(out, TRUE);
+	put_model(out, def->content);
+      } else
+	put_word(out, FALSE);
+      put_element_list(out, def->included);
+      put_element_list(out, def->excluded);
+      n++;
+    }
+  }
+					/* link elements */
+  for(e=dtd->elements; e; e=e->next)
+  { dtd_attr_list *al;
+
+    put_ref(&out->edefs, out, e->structure);
+    if ( e->map && ptr_index(&out->maps, e->map) < 0 )
+      put_word(out, EMPTY_MAP);
+    else
+      put_ref(&out->maps, out, e->map);
+
+    for(n=0, al=e->attributes; al; al=al->next)
+      n++;
+    put_word(out, n);
+    for(al=e->attributes; al; al=al->next)
+      put_ref(&out->attrs, out, al->attribute);
+  }
+
+  put_word(out, DTD_IMAGE_MAGIC);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+save_dtd_image() writes dtd to file.   Returns  FALSE,  leaving errno set,
+if the file cannot be written.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+int
+save_dtd_image(dtd *dtd, const ichar *file)
+{ image_out out;
+  int rc;
+
+  put_dtd(&out, dtd);
+  rc = write_image(&out, file);
+  free_image_out(&out);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	       LOAD		*
+		 *******************************/
+
+typedef struct
+{ const word *here;			/* read pointer */
+  const word *end;			/* end of the image */
+  int	      error;			/* image is corrupt */
+  dtd	     *dtd;			/* DTD we are filling */
+  ichar	     *buf;			/* scratch buffer for strings */
+  size_t      bufsize;			/* # ichars in buf */
+  dtd_symbol **symbols;			/* index --> symbol */
+  word	      nsymbols;
+  dtd_attr  **attrs;			/* index --> attribute */
+  word	      nattrs;
+  dtd_edef  **edefs;			/* index --> element definition */
+  word	      nedefs;
+  dtd_shortref **maps;			/* index --> SHORTREF map */
+  word	      nmaps;
+  dtd_shortref *empty_map;		/* the #EMPTY map */
+} image_in;
+
+
+static word
+get_word(image_in *in)
+{ if ( in->here < in->end )
+    return *in->here++;
+
+  in->error = TRUE;
+  return 0;
+}
+
+
+/* get_enum() reads a value of an enumerated type whose last member is max
+*/
+
+static word
+get_enum(image_in *in, word max)
+{ word w = get_word(in);
+
+  if ( w > max )
+  { in->error = TRUE;
+    return 0;
+  }
+
+  return w;
+}
+
+
+/* get_count() reads the length of a table.  As each entry takes at least
+   one word, a count that exceeds the remaining image is an error.
+*/
+
+static word
+get_count(image_in *in)
+{ word n = get_word(in);
+
+  if ( n > (word)(in->end - in->here) )
+  { in->error = TRUE;
+    return 0;
+  }
+
+  return n;
+}
+
+
+/* get_string() reads a string into in->buf.  Returns NULL for a NULL
+   string or an error and the length in *lenp.
+*/
+
+static ichar *
+get_string(image_in *in, size_t *lenp)
+{ word len = get_word(in);
+  word i;
+
+  *lenp = 0;
+  if ( len == NO_STRING || in->error )
+    return NULL;
+  if ( len > (word)(in->end - in->here) )
+  { in->error = TRUE;
+    return NULL;
+  }
+
+  if ( len+1 > in->bufsize )
+  { in->bufsize = len+1;
+    in->buf = sgml_realloc(in->buf, in->bufsize*sizeof(ichar));
+  }
+  for(i=0; i<len; i++)
+    in->buf[i] = (ichar)*in->here++;
+  in->buf[len] = 0;
+  *lenp = len;
+
+  return in->buf;
+}
+
+
+static ichar *
+get_malloc_string(image_in *in, int *lenp)
+{ size_t len;
+  ichar *s = get_string(in, &len);
+
+  if ( lenp )
+    *lenp = (int)len;
+
+  return s ? istrndup(s, (int)len) : NULL;
+}
+
+
+static ichar *
+get_arena_string(image_in *in)
+{ size_t len;
+  ichar *s = get_string(in, &len);
+
+  return s ? arena_istrndup(&in->dtd->arena, s, len) : NULL;
+}
+
+
+static void *
+get_ref(image_in *in, void **table, word size)
+{ word i = get_word(in);
+
+  if ( i == 0 )
+    return NULL;
+  if ( i > size )
+  { in->error = TRUE;
+    return NULL;
+  }
+
+  return table[i-1];
+}
+
+#define get_symbol(in) \
+	((dtd_symbol*)get_ref(in, (void**)(in)->symbols, (in)->nsymbols))
+
+
+static dtd_element *
+get_element(image_in *in)
+{ dtd_symbol *s = get_symbol(in);
+
+  if ( !s || !s->element )
+  { in->error = TRUE;
+    return NULL;
+  }
+
+  return s->element;
+}
+
+
+static void
+get_entities(image_in *in, dtd_entity **list)
+{ word i, n = get_count(in);
+
+  for(i=0; i<n && !in->error; i++)
+  { dtd_entity *e = sgml_calloc(1, sizeof(*e));
+
+    *list = e;				/* keep the order */
+    list = &e->next;
+
+    if ( !(e->name = get_symbol(in)) )
+      in->error = TRUE;
+    e->type		= get_enum(in, ET_LITERAL);
+    e->content		= get_enum(in, EC_PI);
+    e->catalog_location = get_word(in);
+    if ( get_word(in) )
+      in->dtd->default_entity = e;
+    e->value   = get_malloc_string(in, &e->length);
+    e->extid   = get_malloc_string(in, NULL);
+    e->exturl  = get_malloc_string(in, NULL);
+    e->baseurl = get_malloc_string(in, NULL);
+  }
+}
+
+
+static dtd_model *
+get_model(image_in *in, int depth)
+{ dtd_model *m = arena_calloc(&in->dtd->arena, sizeof(*m));
+
+  if ( depth > MAX_MODEL_DEPTH )
+  { in->error = TRUE;
+    return m;
+  }
+
+  m->type	 = get_word(in);
+  m->cardinality = get_enum(in, MC_PLUS);
+
+  switch(m->type)
+  { case MT_ELEMENT:
+      m->content.element = get_element(in);
+      break;
+    case MT_SEQ:
+    case MT_AND:
+    case MT_OR:
+    { dtd_model **sub = &m->content.group;
+      word i, n = get_count(in);
+
+      for(i=0; i<n && !in->error; i++)
+      { *sub = get_model(in, depth+1);
+	sub = &(*sub)->next;
+      }
+      break;
+    }
+    case MT_PCDATA:
+    case MT_UNDEF:
+      break;
+    default:
+      in->error = TRUE;
+  }
+
+  return m;
+}
+
+
+static dtd_element_list *
+get_element_list(image_in *in)
+{ dtd_element_list *l = NULL, **tail = &l;
+  word i, n = get_count(in);
+
+  for(i=0; i<n && !in->error; i++)
+  { dtd_element_list *el = arena_calloc(&in->dtd->arena, sizeof(*el));
+
+    el->value = get_element(in);
+    *tail = el;
+    tail = &el->next;
+  }
+
+  return l;
+}
+
+
+static dtd_attr *
+get_attribute(image_in *in)
+{ dtd_attr *a = arena_calloc(&in->dtd->arena, sizeof(*a));
+  dtd_name_list **nl = &a->typeex.nameof;
+  word i, n;
+
+  if ( !(a->name = get_symbol(in)) )
+    in->error = TRUE;
+  a->type   = get_enum(in, AT_NUTOKENS);
+  a->def    = get_enum(in, AT_DEFAULT);
+  a->islist = get_word(in);
+
+  n = get_count(in);
+  for(i=0; i<n && !in->error; i++)
+  { *nl = arena_calloc(&in->dtd->arena, sizeof(**nl));
+    (*nl)->value = get_symbol(in);
+    nl = &(*nl)->next;
+  }
+
+  switch(get_word(in))
+  { case AD_NONE:
+      break;
+    case AD_STRING:
+      a->att_def.cdata = get_arena_string(in);
+      break;
+    case AD_NAME:
+      a->att_def.name = get_symbol(in);
+      break;
+    case AD_NUMBER:
+      a->att_def.number = (long)(int32_t)get_word(in);
+      break;
+    default:
+      in->error = TRUE;
+  }
+
+  return a;
+}
+
+
+static int
+load_image(image_in *in)
+{ dtd *dtd = in->dtd;
+  dtd_element **etail = &dtd->elements;
+  dtd_notation **ntail = &dtd->notations;
+  dtd_shortref **stail = &dtd->shortrefs;
+  dtd_element *e;
+  word i, n;
+
+  if ( get_word(in) != DTD_IMAGE_MAGIC ||
+       get_word(in) != DTD_IMAGE_VERSION )
+    return FALSE;
+					/* settings */
+  dtd->dialect		   = get_word(in);
+  dtd->case_sensitive	   = get_word(in);
+  dtd->ent_case_sensitive  = get_word(in);
+  dtd->att_case_sensitive  = get_word(in);
+  dtd->att_case_preserving = get_word(in);
+  dtd->encoding		   = get_word(in);
+  dtd->space_mode	   = get_word(in);
+  dtd->number_mode	   = get_word(in);
+  dtd->shorttag		   = get_word(in);
+  dtd->system_entities	   = get_word(in);
+  { ichar *doctype = get_malloc_string(in, NULL);
+
+    if ( doctype && !dtd->doctype )
+      dtd->doctype = doctype;
+    else if ( doctype )
+      sgml_free(doctype);
+  }
+					/* symbols */
+  in->nsymbols = get_count(in);
+  in->symbols = sgml_calloc(in->nsymbols+1, sizeof(dtd_symbol*));
+  for(i=0; i<in->nsymbols && !in->error; i++)
+  { size_t len;
+    ichar *name = get_string(in, &len);
+
+    if ( name )
+      in->symbols[i] = dtd_add_symbol(dtd, name);
+    else
+      in->error = TRUE;
+  }
+					/* notations */
+  n = get_count(in);
+  for(i=0; i<n && !in->error; i++)
+  { dtd_notation *not = sgml_calloc(1, sizeof(*not));
+
+    *ntail = not;
+    ntail = &not->next;
+    not->name   = get_symbol(in);
+    not->type   = get_enum(in, ET_LITERAL);
+    not->public = get_malloc_string(in, NULL);
+    not->system = get_malloc_string(in, NULL);
+  }
+					/* entities */
+  get_entities(in, &dtd->pentities);
+  get_entities(in, &dtd->entities);
+  if ( !in->error )
+  { dtd_entity *ent;
+
+    for(ent=dtd->entities; ent; ent=ent->next)
+      ent->name->entity = ent;
+  }
+					/* SHORTREF maps */
+  in->nmaps = get_count(in);
+  in->maps = sgml_calloc(in->nmaps+1, sizeof(dtd_shortref*));
+  for(i=0; i<in->nmaps && !in->error; i++)
+  { dtd_shortref *sr = sgml_calloc(1, sizeof(*sr));
+    dtd_map **mtail = &sr->map;
+    word j, nm;
+
+    *stail = sr;
+    stail = &sr->next;
+    in->maps[i] = sr;
+    sr->name    = get_symbol(in);
+    sr->defined = get_word(in);
+    for(j=0; j<SHORTMAP_SIZE; j += 4)
+    { word w = get_word(in);
+
+      sr->ends[j]   = (char)(w & 0xff);
+      sr->ends[j+1] = (char)((w>>8) & 0xff);
+      sr->ends[j+2] = (char)((w>>16) & 0xff);
+      sr->ends[j+3] = (char)((w>>24) & 0xff);
+    }
+    nm = get_count(in);
+    for(j=0; j<nm && !in->error; j++)
+    { dtd_map *m = sgml_calloc(1, sizeof(*m));
+
+      *mtail = m;
+      mtail = &m->next;
+      m->from = get_malloc_string(in, &m->len);
+      m->to   = get_symbol(in);
+      if ( !m->from )
+	in->error = TRUE;
+    }
+  }
+					/* elements */
+  n = get_count(in);
+  for(i=0; i<n && !in->error; i++)
+  { dtd_symbol *id = get_symbol(in);
+
+    if ( !id || id->element )
+    { in->error = TRUE;
+      break;
+    }
+    e = arena_calloc(&dtd->arena, sizeof(*e));
+    e->name	  = id;
+    e->undefined  = get_word(in);
+    e->space_mode = get_word(in);
+    id->element = e;
+    *etail = e;
+    etail = &e->next;
+  }
+					/* attribute definitions */
+  in->nattrs = get_count(in);
+  in->attrs = sgml_calloc(in->nattrs+1, sizeof(dtd_attr*));
+  for(i=0; i<in->nattrs && !in->error; i++)
+    in->attrs[i] = get_attribute(in);
+					/* element definitions */
+  in->nedefs = get_count(in);
+  in->edefs = sgml_calloc(in->nedefs+1, sizeof(dtd_edef*));
+  for(i=0; i<in->nedefs && !in->error; i++)
+  { dtd_edef *def = arena_calloc(&dtd->arena, sizeof(*def));
+
+    in->edefs[i]    = def;
+    def->type       = get_enum(in, C_ANY);
+    def->omit_open  = get_word(in);
+    def->omit_close = get_word(in);
+    if ( get_word(in) )
+      def->content = get_model(in, 0);
+    def->included = get_element_list(in);
+    def->excluded = get_element_list(in);
+  }
+					/* link elements */
+  for(e=dtd->elements; e && !in->error; e=e->next)
+  { dtd_attr_list **atail = &e->attributes;
+    word j, na;
+
+    e->structure = get_ref(in, (void**)in->edefs, in->nedefs);
+    if ( in->here < in->end && *in->here == EMPTY_MAP )
+    { in->here++;
+      if ( !in->empty_map )
+      { in->empty_map = arena_calloc(&dtd->arena, sizeof(*in->empty_map));
+	in->empty_map->name    = dtd_add_symbol(dtd, L"#EMPTY");
+	in->empty_map->defined = TRUE;
+      }
+      e->map = in->empty_map;
+    } else
+      e->map = get_ref(in, (void**)in->maps, in->nmaps);
+
+    na = get_count(in);
+    for(j=0; j<na && !in->error; j++)
+    { dtd_attr_list *al = arena_calloc(&dtd->arena, sizeof(*al));
+
+      if ( !(al->attribute = get_ref(in, (void**)in->attrs, in->nattrs)) )
+	in->error = TRUE;
+      *atail = al;
+      atail = &al->next;
+    }
+  }
+
+  if ( get_word(in) != DTD_IMAGE_MAGIC || in->here != in->end )
+    in->error = TRUE;
+
+  return !in->error;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+load_dtd_image() loads an image written by save_dtd_image() into dtd,
+which must be empty. Returns FALSE with   errno set if the file cannot
+be read (EINVAL if it is not a valid image). The DTD may be partially
+filled after a failure and should be discarded.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+load_image_data(dtd *dtd, const void *data, size_t size)
+{ image_in in;
+  int rc;
+
+  memset(&in, 0, sizeof(in));
+  in.dtd  = dtd;
+  in.here = (const word*)data;
+  in.end  = in.here + size/sizeof(word);
+
+  if ( size % sizeof(word) == 0 && (rc = load_image(&in)) )
+  { dtd->implicit = FALSE;
+  } else
+  { rc = FALSE;
+    errno = EINVAL;
+  }
+
+  if ( in.buf )     sgml_free(in.buf);
+  if ( in.symbols ) sgml_free(in.symbols);
+  if ( in.attrs )   sgml_free(in.attrs);
+  if ( in.edefs )   sgml_free(in.edefs);
+  if ( in.maps )    sgml_free(in.maps);
+
+  return rc;
+}
+
+
+int
+load_dtd_image(dtd *dtd, const ichar *file)
+{ file_buffer fb;
+  int rc;
+
+  if ( dtd->elements || dtd->entities || dtd->pentities ||
+       dtd->notations || dtd->shortrefs )
+  { errno = EINVAL;
+    return FALSE;
+  }
+
+  if ( !open_file_buffer(file, &fb) )
+    return FALSE;
+
+  rc = load_image_data(dtd, fb.data, fb.size);
+  close_file_buffer(&fb);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+clone_dtd() returns a private, writable copy   of  dtd by passing it
+through an in-memory image. This is  used   to  give a parser its own
+copy of a frozen DTD (see unshare_dtd_parser()). Returns NULL if the
+copy could not be made.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+dtd *
+clone_dtd(dtd *org)
+{ image_out out;
+  dtd *dtd = new_dtd(org->doctype);
+
+  put_dtd(&out, org);
+  if ( load_image_data(dtd, out.data, out.size*sizeof(word)) )
+  { dtd->implicit = org->implicit;
+  } else
+  { dtd->references = 1;		/* free_dtd() decrements */
+    free_dtd(dtd);
+    dtd = NULL;
+  }
+  free_image_out(&out);
+
+  return dtd;
+}
@@ -24,12 +24,44 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <stdint.h>
 #include "dtd.h"
 #include "model.h"
+#include "util.h"
 
-#define MAX_VISITED 256
-#define MAX_ALLOWED 64
+#ifdef __WINDOWS__
+#define inline __inline
+#endif
+
+/* Without _REENTRANT there is no  locking  and   a  frozen DTD may only
+   be used from one thread (see freeze_dtd()).
+*/
+
+#ifdef _REENTRANT
+#include <pthread.h>
+
+static pthread_mutex_t model_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK() pthread_mutex_lock(&model_mutex)
+#define UNLOCK() pthread_mutex_unlock(&model_mutex)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+#if defined(_REENTRANT) && defined(__GNUC__)
+#define LOAD_PTR(p)	  __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE_PTR(p, v)	  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#elif defined(_REENTRANT)		/* MSVC: volatile is acquire/release */
+#define LOAD_PTR(p)	  (*(void * volatile *)&(p))
+#define STORE_PTR(p, v)	  (*(void * volatile *)&(p) = (v))
+#else
+#define LOAD_PTR(p)	  (p)
+#define STORE_PTR(p, v)	  ((p) = (v))
+#endif
+
+#define MAXFROZENSTATES 1024		/* see complete_state_engine() */
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 This module implements a finite state  engine for validating the content
@@ -38,22 +70,34 @@ realising an event-driven SGML parser.
 
 The public functions are:
 
-dtd_state *new_dtd_state(void)
-    Create an anonymous new state.  Normally an element creates two of
-    these for it ->initial_state and ->final_state attributes.
-
-dtd_state *make_state_engine(dtd_element *e)
+dtd_state *make_state_engine(dtd *dtd, dtd_element *e)
     Associate a state engine to this element and return the initial
     state of the engine.  If the element has an engine, simply return
-    the initial state.
+    the initial state.  The engine is allocated in the arena of the
+    DTD and is released with it.
 
 dtd_state *make_dtd_transition(dtd_state *here, dtd_element *e)
     Given the current state, see whether we can accept e and return
     the resulting state.  If no transition is possible return NULL.
 
-int same_state(dtd_state *final, dtd_state *here)
-    See whether two states are the same, or the final state can be
-    reached only traversing equivalence links.
+int state_is_final(dtd_state *here)
+    See whether the content model may end in this state.
+
+int find_omitted_path(dtd *dtd, dtd_state *state, dtd_element *e,
+		      dtd_element **path)
+    Find the elements whose open tag may be omitted to accept e in
+    state.  Fills path and returns its length or -1 if there is no
+    such path.  Results are cached in the automaton of state.
+
+The model is first translated into  a non-deterministic automaton (NFA)
+with epsilon (NULL) transitions. The engine   seen  by the parser is the
+equivalent deterministic automaton (DFA), built  from the NFA using the
+subset construction. The DFA is   built  lazily: the transitions of a
+DFA state are computed the first time  the   state  is  used. The input
+alphabet of the engine consists of the   elements that appear in the
+model. Each element has a column,  found   through  a small hash table,
+and each DFA state has a  dense  row   that  maps  a  column to the next
+state. A transition is thus a hash lookup and an array index.
 
 The A&B&... model
 
@@ -61,110 +105,231 @@ Models of the type a&b&c are hard   to translate, as the resulting state
 machine is of size order N! In practice   only  a little of this will be
 used however and we `fix' this problem using a `lazy state-engine', that
 expands to the next level  only  after   reaching  some  level.  See the
-function state_transitions(). The design takes more lazy generation into
-consideration.
+function state_transitions(). States that   still  have to see the same
+members of the group are shared (see   and_state()), so the expansion is
+bounded by the number of subsets of the group.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+#define PTR_HASH(p) ((unsigned int)(((uintptr_t)(p) >> 3) * 2654435761U))
+
+typedef struct _nfa_state
+{ struct _state_transition *transitions;
+  struct _state_expander *expander;
+} nfa_state;
+
 typedef struct _state_transition
 { dtd_element	     *element;		/* element on transition */
-  dtd_state	     *state;		/* state to go to */
+  nfa_state	     *state;		/* state to go to */
   struct _state_transition *next;	/* next possible transition */
 } transition;
 
-typedef struct _dtd_model_list		/* list (set) of models */
-{ dtd_model *model;
-  struct _dtd_model_list *next;
-} dtd_model_list;
-
 typedef enum
 { EX_AND				/* expand (a&b&...) */
 } expand_type;
 
 typedef struct _state_expander
-{ dtd_state	       *target;		/* Target state to expand to */
+{ nfa_state	       *state;		/* State we expand */
+  nfa_state	       *target;		/* Target state to expand to */
+  struct _and_memo     *memo;		/* Memo of the element */
   expand_type		type;		/* EX_* */
   union
   { struct
-    { dtd_model_list *set;		/* Models we should still see */
+    { dtd_model	       *group;		/* The (a&b&...) model */
+      int		members;	/* # sub-models of group */
+      unsigned int     *left;		/* Bitmask of models to see */
+      unsigned int	hash;		/* Hash of group, target and left */
     } and;				/* Expand (a&b&...) */
   } kind;
+  struct _state_expander *next;		/* Next in hash bucket */
 } expander;
 
-typedef struct _visited
-{ int	size;				/* set-size */
-  dtd_state *states[MAX_VISITED];	/* The set */
-} visited;
-
+typedef struct _and_memo		/* (a&b&...) states of an element */
+{ sgml_arena   *arena;			/* Arena of the DTD */
+  int		size;			/* # buckets (power of 2) */
+  int		count;			/* # expanders */
+  expander    **table;			/* (group,target,left) --> expander */
+} and_memo;
+
+typedef struct _automaton
+{ sgml_arena   *arena;			/* Arena of the DTD */
+  nfa_state    *final;			/* Final state of the NFA */
+  int		nsymbols;		/* # columns */
+  dtd_element **symbols;		/* column --> element */
+  int		isize;			/* # slots in index (power of 2) */
+  int	       *index;			/* element hash --> column+1 */
+  int		ssize;			/* # buckets in states (power of 2) */
+  int		nstates;		/* # DFA states */
+  dtd_state   **states;			/* hash table of DFA states */
+  struct _omit_table *omitted;		/* cached omitted paths */
+  int		shared;			/* rows are made under model_mutex */
+} automaton;
+
+typedef struct _omitted_path
+{ dtd_state    *state;			/* state we are in */
+  dtd_element  *element;		/* element we want to open */
+  int		length;			/* length of path; -1: none */
+  dtd_element **path;			/* elements to open */
+  struct _omitted_path *next;		/* next in hash bucket */
+} omitted_path;
+
+typedef struct _omit_table		/* (state,element) --> omitted path */
+{ int		size;			/* # buckets (power of 2) */
+  int		count;			/* # paths */
+  omitted_path *buckets[1];		/* the hash table */
+} omit_table;
+
+struct _dtd_state			/* a DFA state */
+{ automaton    *automaton;		/* automaton we belong to */
+  int		final;			/* set holds the final NFA state */
+  int		size;			/* # NFA states */
+  nfa_state   **set;			/* NFA states, ordered by address */
+  unsigned int	hash;			/* hash of the set */
+  dtd_state   **row;			/* column --> state (lazy) */
+  dtd_state    *next;			/* next in hash bucket */
+};
+
+typedef struct
+{ int	      size;			/* # slots (power of 2) */
+  int	      count;			/* # members */
+  void	    **slots;			/* the table */
+} ptr_set;
+
+
+static void	translate_model(and_memo *memo, dtd_model *m,
+				nfa_state *from, nfa_state *to);
+static transition *state_transitions(nfa_state *state);
+static dtd_state **state_row(dtd_state *state);
+static dtd_state **make_state_row(dtd_state *state);
 
-static void	translate_model(dtd_model *m, dtd_state *from, dtd_state *to);
-static transition *state_transitions(dtd_state *state);
 
 static int
-visit(dtd_state *state, visited *visited)
-{ int i;
-
-  for(i=0; i<visited->size; i++)
-  { if ( visited->states[i] == state )
-      return FALSE;
+add_ptr_set(ptr_set *set, void *p)
+{ unsigned int k;
+
+  if ( set->count*2 >= set->size )
+  { int osize = set->size;
+    void **old = set->slots;
+    int i;
+
+    set->size = (osize ? osize*2 : 64);
+    set->slots = sgml_calloc(set->size, sizeof(void*));
+    set->count = 0;
+    for(i=0; i<osize; i++)
+    { if ( old[i] )
+	add_ptr_set(set, old[i]);
+    }
+    if ( old )
+      sgml_free(old);
   }
 
-  if ( visited->size >= MAX_VISITED )
-  { fprintf(stderr, "Reached MAX_VISITED!\n");
-    return FALSE;
+  k = PTR_HASH(p) & (set->size-1);
+  for(;;)
+  { if ( !set->slots[k] )
+    { set->slots[k] = p;
+      set->count++;
+      return TRUE;
+    }
+    if ( set->slots[k] == p )
+      return FALSE;
+    k = (k+1) & (set->size-1);
   }
-
-  visited->states[visited->size++] = state;
-
-  return TRUE;
 }
 
 
-static dtd_state *
-do_make_dtd_transition(dtd_state *here, dtd_element *e, visited *visited)
-{ transition *tset = state_transitions(here);
-  transition *t;
+static inline int
+symbol_column(automaton *a, dtd_element *e)
+{ unsigned int k = PTR_HASH(e) & (a->isize-1);
+  int i;
 
-  for(t=tset; t; t=t->next)
-  { if ( t->element == e )
-      return t->state;
-  }
-
-  for(t=tset; t; t=t->next)
-  { if ( t->element == NULL && visit(t->state, visited) )
-    { dtd_state *new;
-
-      if ( (new=do_make_dtd_transition(t->state, e, visited)) )
-	return new;
-    }
+  while( (i=a->index[k]) )
+  { if ( a->symbols[i-1] == e )
+      return i-1;
+    k = (k+1) & (a->isize-1);
   }
 
-  return NULL;
+  return -1;
 }
 
 
 dtd_state *
 make_dtd_transition(dtd_state *here, dtd_element *e)
-{ visited visited;
-  visited.size = 0;
+{ dtd_state **row;
+  int c;
 
   if ( !here )				/* from nowhere to nowhere */
     return NULL;
+  if ( (c=symbol_column(here->automaton, e)) < 0 )
+    return NULL;
+  if ( !(row=LOAD_PTR(here->row)) )
+    row = state_row(here);
+
+  return row[c];
+}
+
+
+int
+state_is_final(dtd_state *here)
+{ return !here || here->final;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+state_allows_for(dtd_state *state, dtd_element **allow, int *n)
+    See what elements are allowed if we are in this state.  On entry,
+    *n is the size of allow.  This is currently not used, but might
+    prove handly for error messages or syntax-directed editors.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  return do_make_dtd_transition(here, e, &visited);
+void
+state_allows_for(dtd_state *state, dtd_element **allow, int *n)
+{ int max = *n;
+
+  *n = 0;
+  if ( state )
+  { automaton *a = state->automaton;
+    dtd_state **row = state_row(state);
+    int c;
+
+    for(c=0; c<a->nsymbols && *n < max; c++)
+    { if ( row[c] )
+	allow[(*n)++] = a->symbols[c];
+    }
+  }
 }
 
 
 static int
-find_same_state(dtd_state *final, dtd_state *here, visited *visited)
-{ transition *t;
+do_find_omitted_path(dtd *dtd, dtd_state *state, dtd_element *e,
+		     dtd_element **path, int *pl,
+		     ptr_set *visited)
+{ automaton *a = state->automaton;
+  dtd_state **row;
+  int pathlen = *pl;
+  int c;
 
-  if ( final == here )
+  if ( make_dtd_transition(state, e) )
     return TRUE;
+  if ( pathlen >= MAXOMITTED )
+    return FALSE;
 
-  for(t=state_transitions(here); t; t=t->next)
-  { if ( t->element == NULL && visit(t->state, visited) )
-    { if ( find_same_state(final, t->state, visited) )
-	return TRUE;
+  row = state_row(state);
+  for(c=0; c<a->nsymbols; c++)
+  { dtd_element *oe = a->symbols[c];
+
+    if ( row[c] &&
+	 oe != CDATA_ELEMENT &&
+	 oe->structure &&
+	 oe->structure->omit_open &&
+	 add_ptr_set(visited, row[c]) )
+    { dtd_state *initial = make_state_engine(dtd, oe);
+
+      if ( initial )
+      { path[pathlen] = oe;
+	*pl = pathlen+1;
+	if ( do_find_omitted_path(dtd, initial, e, path, pl, visited) )
+	  return TRUE;
+	*pl = pathlen;
+      }
     }
   }
 
@@ -172,120 +337,155 @@ find_same_state(dtd_state *final, dtd_state *here, visited *visited)
 }
 
 
-int
-same_state(dtd_state *final, dtd_state *here)
-{ visited visited;
-  visited.size = 0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Tag soup  makes  the  parser  look  for    the  same  omitted  paths
+over and over again, so the  results,   including  failures, are cached
+in the automaton by (state, element).
+
+The automaton of a frozen DTD is shared by parsers in multiple threads.
+The cache is read without locking. Paths are added under model_mutex.
+An entry is complete before it is  published and is never modified after
+that, so a table that grows is copied rather than relinked. Elements in
+the overlay of a parser (those without   an  attribute index on a frozen
+DTD) die with the parser and are not cached.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  return find_same_state(final, here, &visited);
-}
+#define OMIT_HASH(s, e) ((PTR_HASH(s) ^ PTR_HASH(e)) * 16777619U)
 
+static omitted_path *
+lookup_omitted_path(automaton *a, dtd_state *state, dtd_element *e)
+{ omit_table *t = LOAD_PTR(a->omitted);
+  omitted_path *op = NULL;
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-state_allows_for(dtd_state *state, dtd_element **allow, int *n)
-    See what elements are allowed if we are in this state.  This is
-    currently not used, but might prove handly for error messages or
-    syntax-directed editors.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if ( t )
+  { int k = OMIT_HASH(state, e) & (t->size-1);
 
-static void
-do_state_allows_for(dtd_state *here, dtd_element **allow, int *n,
-		    visited *visited)
-{ transition *t;
-
-  for(t=state_transitions(here); t; t=t->next)
-  { int i;
-
-    if ( t->element == NULL )
-    { if ( visit(t->state, visited) )
-	do_state_allows_for(t->state, allow, n, visited);
-    } else
-    { for(i=0; i<*n; i++)
-      { if ( allow[i] == t->element )
-	  goto next;
-      }
-      allow[(*n)++] = t->element;
+    for(op=LOAD_PTR(t->buckets[k]); op; op=op->next)
+    { if ( op->state == state && op->element == e )
+	break;
     }
-  next:
-    ;
   }
+
+  return op;
 }
 
 
-void
-state_allows_for(dtd_state *state, dtd_element **allow, int *n)
-{ visited visited;
-  visited.size = 0;
+static omit_table *
+new_omit_table(automaton *a, int size)
+{ omit_table *t = arena_calloc(a->arena,
+			       sizeof(*t) +
+			       (size-1)*sizeof(omitted_path*));
 
-  *n = 0;
-  if ( state )
-    do_state_allows_for(state, allow, n, &visited);
+  t->size = size;
+  return t;
 }
 
 
-static int
-do_find_omitted_path(dtd_state *state, dtd_element *e,
-		     dtd_element **path, int *pl,
-		     visited *visited)
-{ transition *tset = state_transitions(state);
-  transition *t;
-  int pathlen = *pl;
+static void
+link_omitted_path(omit_table *t, omitted_path *op)
+{ int k = OMIT_HASH(op->state, op->element) & (t->size-1);
 
-  for(t=tset; t; t=t->next)
-  { if ( t->element == e )
-      return TRUE;
+  op->next = t->buckets[k];
+  STORE_PTR(t->buckets[k], op);
+  t->count++;
+}
 
-    if ( t->element &&
-	 t->element != CDATA_ELEMENT &&
-	 t->element->structure &&
-	 t->element->structure->omit_open &&
-	 visit(t->state, visited) )
-    { dtd_state *initial = make_state_engine(t->element);
-
-      path[pathlen] = t->element;
-      *pl = pathlen+1;
-      if ( do_find_omitted_path(initial, e, path, pl, visited) )
-	return TRUE;
-      *pl = pathlen;
-    }
+
+static omitted_path *
+new_omitted_path(automaton *a, dtd_state *state, dtd_element *e,
+		 dtd_element **path, int pl)
+{ omitted_path *op = arena_calloc(a->arena, sizeof(*op));
+
+  op->state   = state;
+  op->element = e;
+  op->length  = pl;
+  if ( pl > 0 )
+  { op->path = arena_alloc(a->arena, pl*sizeof(dtd_element*));
+    memcpy(op->path, path, pl*sizeof(dtd_element*));
   }
 
-  for(t=tset; t; t=t->next)
-  { if ( !t->element &&
-	 visit(t->state, visited) )
-    { if ( do_find_omitted_path(t->state, e, path, pl, visited) )
-	return TRUE;
+  return op;
+}
+
+
+static void
+add_omitted_path(automaton *a, omitted_path *op)
+{ omit_table *t = a->omitted;
+
+  if ( !t || t->count >= t->size*2 )
+  { omit_table *nt = new_omit_table(a, t ? t->size*4 : 16);
+
+    if ( t )
+    { int i;
+
+      for(i=0; i<t->size; i++)		/* old table stays in the arena */
+      { omitted_path *o;
+
+	for(o=t->buckets[i]; o; o=o->next)
+	{ omitted_path *copy = arena_alloc(a->arena, sizeof(*copy));
+
+	  *copy = *o;
+	  link_omitted_path(nt, copy);
+	}
+      }
     }
+    STORE_PTR(a->omitted, nt);
+    t = nt;
   }
 
-  return FALSE;
+  link_omitted_path(t, op);
 }
 
 
 int
-find_omitted_path(dtd_state *state, dtd_element *e, dtd_element **path)
-{ int pl = 0;
-  visited visited;
-  visited.size = 0;
+find_omitted_path(dtd *dtd, dtd_state *state, dtd_element *e,
+		  dtd_element **path)
+{ automaton *a;
+  int pl = 0;
+  int rc;
+  ptr_set visited = {0, 0, NULL};
+  omitted_path *op;
+
+  if ( !state )
+    return -1;
+  a = state->automaton;
+
+  if ( (op=lookup_omitted_path(a, state, e)) )
+  { if ( op->length > 0 )
+      memcpy(path, op->path, op->length*sizeof(dtd_element*));
+    return op->length;
+  }
 
-  if ( state && do_find_omitted_path(state, e, path, &pl, &visited) )
-    return pl;
+  rc = do_find_omitted_path(dtd, state, e, path, &pl, &visited);
+  if ( visited.slots )
+    sgml_free(visited.slots);
+  if ( !rc )
+    pl = -1;
+
+  if ( !dtd->frozen )
+  { add_omitted_path(a, new_omitted_path(a, state, e, path, pl));
+  } else if ( e == CDATA_ELEMENT || e->attr_index )
+  { LOCK();
+    if ( !lookup_omitted_path(a, state, e) )
+      add_omitted_path(a, new_omitted_path(a, state, e, path, pl));
+    UNLOCK();
+  }
 
-  return -1;
+  return pl;
 }
 
 
-dtd_state *
-new_dtd_state()
-{ dtd_state *s = sgml_calloc(1, sizeof(*s));
+static nfa_state *
+new_nfa_state(sgml_arena *a)
+{ nfa_state *s = arena_calloc(a, sizeof(*s));
 
   return s;
 }
 
 
 static void
-link(dtd_state *from, dtd_state *to, dtd_element *e)
-{ transition *t = sgml_calloc(1, sizeof(*t));
+link(sgml_arena *a, nfa_state *from, nfa_state *to, dtd_element *e)
+{ transition *t = arena_alloc(a, sizeof(*t));
 
   t->state = to;
   t->element = e;
@@ -298,47 +498,137 @@ link(dtd_state *from, dtd_state *to, dtd_element *e)
 		 *	      EXPANSION		*
 		 *******************************/
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A state that still has to see  the   members  of (a&b&...) in `left' is
+identified by the group, its target state and `left', a bitmask over the
+members of the group. Such states are  kept   in  the  memo of the element,
+such that all orders in which  the  same   members  can  be seen share
+their states. The number of states created  is thus bounded by the number
+of subsets of the group rather than the number of its permutations.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MASK_WORDS(n) (((n)+31)/32)
+
+static unsigned int
+and_hash(dtd_model *group, nfa_state *target, unsigned int *left, int words)
+{ unsigned int h = (PTR_HASH(group) ^ PTR_HASH(target)) * 16777619U;
+  int i;
+
+  for(i=0; i<words; i++)
+    h = (h ^ left[i]) * 16777619U;
+
+  return h;
+}
+
+
 static void
-add_model_list(dtd_model_list **list, dtd_model *m)
-{ dtd_model_list *l = sgml_calloc(1, sizeof(*l));
+add_and_memo(and_memo *memo, expander *ex)
+{ if ( memo->count >= memo->size*2 )
+  { int osize = memo->size;
+    expander **old = memo->table;
+    int i;
+
+    memo->size = (osize ? osize*4 : 16);
+    memo->table = arena_calloc(memo->arena, memo->size*sizeof(expander*));
+    for(i=0; i<osize; i++)		/* old table stays in the arena */
+    { expander *e, *next;
+
+      for(e=old[i]; e; e=next)
+      { int k = e->kind.and.hash & (memo->size-1);
+
+	next = e->next;
+	e->next = memo->table[k];
+	memo->table[k] = e;
+      }
+    }
+  }
 
-  l->model = m;
+  { int k = ex->kind.and.hash & (memo->size-1);
 
-  for( ; *list; list = &(*list)->next)
-    ;
-  *list = l;
+    ex->next = memo->table[k];
+    memo->table[k] = ex;
+    memo->count++;
+  }
+}
+
+
+static nfa_state *
+and_state(and_memo *memo, dtd_model *group, int members,
+	  nfa_state *target, unsigned int *left)
+{ int words = MASK_WORDS(members);
+  unsigned int hash = and_hash(group, target, left, words);
+  expander *ex;
+  nfa_state *s;
+
+  if ( memo->size )
+  { for(ex=memo->table[hash & (memo->size-1)]; ex; ex=ex->next)
+    { if ( ex->kind.and.hash == hash &&
+	   ex->kind.and.group == group &&
+	   ex->target == target &&
+	   memcmp(ex->kind.and.left, left, words*sizeof(unsigned int)) == 0 )
+	return ex->state;
+    }
+  }
+
+  s  = new_nfa_state(memo->arena);
+  ex = arena_calloc(memo->arena, sizeof(*ex));
+  ex->state  = s;
+  ex->target = target;
+  ex->memo   = memo;
+  ex->type   = EX_AND;
+  ex->kind.and.group   = group;
+  ex->kind.and.members = members;
+  ex->kind.and.left    = arena_alloc(memo->arena,
+				     words*sizeof(unsigned int));
+  memcpy(ex->kind.and.left, left, words*sizeof(unsigned int));
+  ex->kind.and.hash    = hash;
+  s->expander = ex;
+  add_and_memo(memo, ex);
+
+  return s;
 }
 
 
 static transition *
-state_transitions(dtd_state *state)
+state_transitions(nfa_state *state)
 { if ( !state->transitions && state->expander )
   { expander *ex = state->expander;
+    and_memo *memo = ex->memo;
 
     switch(ex->type)
     { case EX_AND:
-      { dtd_model_list *left = ex->kind.and.set;
-
-	if ( !left )			/* empty AND (should not happen) */
-	{ link(state, ex->target, NULL);
-	} else if ( !left->next )	/* only one left */
-	{ translate_model(left->model, state, ex->target);
-	} else
-	{ for( ; left; left = left->next )
-	  { dtd_state *tmp = new_dtd_state();
-	    expander *nex = sgml_calloc(1, sizeof(*nex));
-	    dtd_model_list *l;
-
-	    translate_model(left->model, state, tmp);
-	    tmp->expander = nex;
-	    nex->target = ex->target;
-	    nex->type = EX_AND;
-	    for(l=ex->kind.and.set; l; l=l->next)
-	    { if ( l != left )
-		add_model_list(&nex->kind.and.set, l->model);
-	    }
+      { int words = MASK_WORDS(ex->kind.and.members);
+	unsigned int *left = ex->kind.and.left;
+	unsigned int *rest = sgml_malloc(words*sizeof(unsigned int));
+	dtd_model *sub;
+	int i, nleft = 0;
+
+	for(i=0; i<ex->kind.and.members; i++)
+	{ if ( left[i/32] & (1U<<(i%32)) )
+	    nleft++;
+	}
+
+	for(sub=ex->kind.and.group->content.group, i=0;
+	    sub;
+	    sub=sub->next, i++)
+	{ if ( !(left[i/32] & (1U<<(i%32))) )
+	    continue;
+
+	  if ( nleft == 1 )		/* only one left */
+	  { translate_model(memo, sub, state, ex->target);
+	  } else
+	  { memcpy(rest, left, words*sizeof(unsigned int));
+	    rest[i/32] &= ~(1U<<(i%32));
+	    translate_model(memo, sub, state,
+			    and_state(memo, ex->kind.and.group,
+				      ex->kind.and.members,
+				      ex->target, rest));
 	  }
 	}
+	if ( nleft == 0 )		/* empty AND (should not happen) */
+	  link(memo->arena, state, ex->target, NULL);
+
+	sgml_free(rest);
       }
     }
   }
@@ -353,43 +643,47 @@ state_transitions(dtd_state *state)
 
 
 static void
-translate_one(dtd_model *m, dtd_state *from, dtd_state *to)
-{ switch(m->type)
+translate_one(and_memo *memo, dtd_model *m, nfa_state *from, nfa_state *to)
+{ sgml_arena *a = memo->arena;
+
+  switch(m->type)
   { case MT_ELEMENT:
     { dtd_element *e = m->content.element;
 
-      link(from, to, e);
+      link(a, from, to, e);
       return;
     }
     case MT_SEQ:			/* a,b,... */
     { dtd_model *sub;
 
       for( sub = m->content.group; sub->next; sub = sub->next )
-      { dtd_state *tmp = new_dtd_state();
-	translate_model(sub, from, tmp);
+      { nfa_state *tmp = new_nfa_state(a);
+	translate_model(memo, sub, from, tmp);
 	from = tmp;
       }
-      translate_model(sub, from, to);
+      translate_model(memo, sub, from, to);
       return;
     }
     case MT_AND:			/* a&b&... */
-    { expander *ex = sgml_calloc(1, sizeof(*ex));
-      dtd_model *sub;
-
-      ex->target = to;
-      ex->type   = EX_AND;
+    { dtd_model *sub;
+      int i, members = 0;
+      unsigned int *all;
 
       for( sub = m->content.group; sub; sub = sub->next )
-	add_model_list(&ex->kind.and.set, sub);
-
-      from->expander = ex;
+	members++;
+      all = sgml_calloc(MASK_WORDS(members), sizeof(unsigned int));
+      for(i=0; i<members; i++)
+	all[i/32] |= 1U<<(i%32);
+					/* from may have other transitions */
+      link(a, from, and_state(memo, m, members, to, all), NULL);
+      sgml_free(all);
       return;
     }
     case MT_OR:				/* a|b|... */
     { dtd_model *sub;
 
       for( sub = m->content.group; sub; sub = sub->next )
-	translate_model(sub, from, to);
+	translate_model(memo, sub, from, to);
       return;
     }
     case MT_PCDATA:
@@ -401,124 +695,399 @@ translate_one(dtd_model *m, dtd_state *from, dtd_state *to)
 
 
 static void
-translate_model(dtd_model *m, dtd_state *from, dtd_state *to)
-{ if ( m->type == MT_PCDATA )
-  { link(from, from, CDATA_ELEMENT);
-    link(from, to, NULL);
+translate_model(and_memo *memo, dtd_model *m, nfa_state *from, nfa_state *to)
+{ sgml_arena *a = memo->arena;
+
+  if ( m->type == MT_PCDATA )
+  { link(a, from, from, CDATA_ELEMENT);
+    link(a, from, to, NULL);
     return;
   }
 
   switch(m->cardinality)
   { case MC_OPT:			/* ? */
-      link(from, to, NULL);
+      link(a, from, to, NULL);
     /*FALLTHROUGH*/
     case MC_ONE:
-      translate_one(m, from, to);
+      translate_one(memo, m, from, to);
       return;
     case MC_REP:			/* * */
-      translate_one(m, from, from);
-      link(from, to, NULL);
+      translate_one(memo, m, from, from);
+      link(a, from, to, NULL);
       return;
     case MC_PLUS:			/* + */
-      translate_one(m, from, to);
-      translate_one(m, to, to);
+      translate_one(memo, m, from, to);
+      translate_one(memo, m, to, to);
       return;
   }
 }
 
 
-dtd_state *
-make_state_engine(dtd_element *e)
-{ if ( e->structure )
-  { dtd_edef *def = e->structure;
+		 /*******************************
+		 *	   DETERMINISATION	*
+		 *******************************/
 
-    if ( !def->initial_state )
-    { if ( def->content )
-      { def->initial_state = new_dtd_state();
-	def->final_state   = new_dtd_state();
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A DFA state is the epsilon closure of a set of NFA states. The closure is
+sorted by address, such that equal sets  can be found in the hash table
+of DFA states of the automaton.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-	translate_model(def->content, def->initial_state, def->final_state);
-      } else if ( def->type == C_CDATA || def->type == C_RCDATA )
-      { def->initial_state = new_dtd_state();
-	def->final_state   = new_dtd_state();
+static int
+compare_states(const void *p1, const void *p2)
+{ const nfa_state *s1 = *(nfa_state *const*)p1;
+  const nfa_state *s2 = *(nfa_state *const*)p2;
 
-	link(def->initial_state, def->initial_state, CDATA_ELEMENT);
-	link(def->initial_state, def->final_state, NULL);
-      } else
-	return NULL;
-    }
+  return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+}
 
-    return def->initial_state;
+
+static void
+add_dfa_state(automaton *a, dtd_state *s)
+{ if ( a->nstates >= a->ssize*2 )
+  { int osize = a->ssize;
+    dtd_state **old = a->states;
+    int i;
+
+    a->ssize = (osize ? osize*4 : 16);
+    a->states = arena_calloc(a->arena, a->ssize*sizeof(dtd_state*));
+    for(i=0; i<osize; i++)		/* old table stays in the arena */
+    { dtd_state *n, *next;
+
+      for(n=old[i]; n; n=next)
+      { int k = n->hash & (a->ssize-1);
+
+	next = n->next;
+	n->next = a->states[k];
+	a->states[k] = n;
+      }
+    }
   }
 
-  return NULL;
+  { int k = s->hash & (a->ssize-1);
+
+    s->next = a->states[k];
+    a->states[k] = s;
+    a->nstates++;
+  }
 }
 
 
-		 /*******************************
-		 *	       FREE		*
-		 *******************************/
+static dtd_state *
+dfa_state(automaton *a, nfa_state **seeds, int nseeds)
+{ ptr_set seen = {0, 0, NULL};
+  int allocated = nseeds+16;
+  nfa_state **set = sgml_malloc(allocated*sizeof(nfa_state*));
+  int size = 0;
+  int top;
+  unsigned int hash = 0;
+  dtd_state *s;
+  int i;
+
+  for(i=0; i<nseeds; i++)
+  { if ( add_ptr_set(&seen, seeds[i]) )
+      set[size++] = seeds[i];
+  }
+  for(top=0; top<size; top++)		/* set[top..size) is the agenda */
+  { transition *t;
+
+    for(t=state_transitions(set[top]); t; t=t->next)
+    { if ( !t->element && add_ptr_set(&seen, t->state) )
+      { if ( size == allocated )
+	{ allocated *= 2;
+	  set = sgml_realloc(set, allocated*sizeof(nfa_state*));
+	}
+	set[size++] = t->state;
+      }
+    }
+  }
+  sgml_free(seen.slots);
+
+  qsort(set, size, sizeof(nfa_state*), compare_states);
+  for(i=0; i<size; i++)
+    hash = (hash ^ PTR_HASH(set[i])) * 16777619U;
+
+  if ( a->ssize )
+  { for(s=a->states[hash & (a->ssize-1)]; s; s=s->next)
+    { if ( s->hash == hash && s->size == size &&
+	   memcmp(s->set, set, size*sizeof(nfa_state*)) == 0 )
+      { sgml_free(set);
+	return s;
+      }
+    }
+  }
 
-static void do_free_state_engine(dtd_state *state, visited *visited);
+  s = arena_calloc(a->arena, sizeof(*s));
+  s->automaton = a;
+  s->size = size;
+  s->hash = hash;
+  s->set = arena_alloc(a->arena, size*sizeof(nfa_state*));
+  memcpy(s->set, set, size*sizeof(nfa_state*));
+  for(i=0; i<size; i++)
+  { if ( set[i] == a->final )
+    { s->final = TRUE;
+      break;
+    }
+  }
+  sgml_free(set);
+  add_dfa_state(a, s);
 
-static void
-free_model_list(dtd_model_list *l)
-{ dtd_model_list *next;
+  return s;
+}
 
-  for( ; l; l=next)
-  { next = l->next;
 
-    sgml_free(l);
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+make_state_row() computes the transitions of  a DFA state. The targets of
+the non-epsilon transitions of the NFA states  are bucketed by column,
+after which each bucket is mapped to its DFA state.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_state **
+make_state_row(dtd_state *state)
+{ automaton *a = state->automaton;
+  int *start, *fill;
+  nfa_state **targets;
+  dtd_state **row;
+  int i, c;
+
+  start = sgml_calloc(a->nsymbols+1, sizeof(int));
+  for(i=0; i<state->size; i++)
+  { transition *t;
+
+    for(t=state_transitions(state->set[i]); t; t=t->next)
+    { if ( t->element && (c=symbol_column(a, t->element)) >= 0 )
+	start[c+1]++;
+    }
+  }
+  for(c=0; c<a->nsymbols; c++)
+    start[c+1] += start[c];
+
+  fill = sgml_malloc((a->nsymbols+1)*sizeof(int));
+  memcpy(fill, start, (a->nsymbols+1)*sizeof(int));
+  targets = sgml_malloc((start[a->nsymbols]+1)*sizeof(nfa_state*));
+  for(i=0; i<state->size; i++)
+  { transition *t;
+
+    for(t=state->set[i]->transitions; t; t=t->next)
+    { if ( t->element && (c=symbol_column(a, t->element)) >= 0 )
+	targets[fill[c]++] = t->state;
+    }
   }
+
+  row = arena_calloc(a->arena, (a->nsymbols+1)*sizeof(dtd_state*));
+  for(c=0; c<a->nsymbols; c++)
+  { if ( start[c+1] > start[c] )
+      row[c] = dfa_state(a, &targets[start[c]], start[c+1]-start[c]);
+  }
+  sgml_free(targets);
+  sgml_free(fill);
+  sgml_free(start);
+
+  STORE_PTR(state->row, row);		/* see state_row() */
+  return row;
 }
 
 
-static void
-free_expander(expander *e, visited *visited)
-{ if ( visit(e->target, visited) )
-    do_free_state_engine(e->target, visited);
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+state_row() returns the  transitions  of  a   DFA  state,  computing them
+if this has not yet been done. A shared automaton belongs to a frozen DTD
+that was not fully expanded (see  complete_state_engine()). A row that
+exists is used without locking. Missing rows  are made under model_mutex
+and published by make_state_row() after  the   row  and  the states it
+refers to are complete. The lock is global  because all automata of a
+DTD allocate from the arena of the DTD.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_state **
+state_row(dtd_state *state)
+{ dtd_state **row;
+
+  if ( (row=LOAD_PTR(state->row)) )
+    return row;
+  if ( !state->automaton->shared )
+    return make_state_row(state);
+
+  LOCK();
+  if ( !(row=state->row) )
+    row = make_state_row(state);
+  UNLOCK();
+
+  return row;
+}
 
-  switch(e->type)
-  { case EX_AND:
-      free_model_list(e->kind.and.set);
+
+static int
+count_symbols(dtd_model *m)
+{ switch(m->type)
+  { case MT_PCDATA:
+    case MT_ELEMENT:
+      return 1;
+    case MT_SEQ:
+    case MT_AND:
+    case MT_OR:
+    { dtd_model *sub;
+      int n = 0;
+
+      for(sub = m->content.group; sub; sub = sub->next)
+	n += count_symbols(sub);
+
+      return n;
+    }
     default:
-      ;
+      return 0;
   }
-
-  sgml_free(e);
 }
 
 
 static void
-do_free_state_engine(dtd_state *state, visited *visited)
-{ transition *t, *next;
+add_symbol(automaton *a, dtd_element *e)
+{ unsigned int k = PTR_HASH(e) & (a->isize-1);
+  int i;
 
-  for(t=state->transitions; t; t=next)
-  { next = t->next;
+  while( (i=a->index[k]) )
+  { if ( a->symbols[i-1] == e )
+      return;
+    k = (k+1) & (a->isize-1);
+  }
+
+  a->symbols[a->nsymbols++] = e;
+  a->index[k] = a->nsymbols;
+}
 
-    if ( visit(t->state, visited) )
-      do_free_state_engine(t->state, visited);
 
-    sgml_free(t);
+static void
+add_model_symbols(automaton *a, dtd_model *m)
+{ switch(m->type)
+  { case MT_PCDATA:
+      add_symbol(a, CDATA_ELEMENT);
+      break;
+    case MT_ELEMENT:
+      add_symbol(a, m->content.element);
+      break;
+    case MT_SEQ:
+    case MT_AND:
+    case MT_OR:
+    { dtd_model *sub;
+
+      for(sub = m->content.group; sub; sub = sub->next)
+	add_model_symbols(a, sub);
+      break;
+    }
+    default:
+      break;
   }
+}
 
-  if ( state->expander )
-    free_expander(state->expander, visited);
 
-  sgml_free(state);
+static dtd_state *
+make_automaton(sgml_arena *arena, dtd_model *model,
+	       nfa_state *initial, nfa_state *final)
+{ automaton *a = arena_calloc(arena, sizeof(*a));
+  int n = (model ? count_symbols(model) : 1);
+
+  a->arena = arena;
+  a->final = final;
+  a->symbols = arena_alloc(arena, (n ? n : 1)*sizeof(dtd_element*));
+  for(a->isize = 4; a->isize < n*2; a->isize *= 2)
+    ;
+  a->index = arena_calloc(arena, a->isize*sizeof(int));
+  if ( model )
+    add_model_symbols(a, model);
+  else
+    add_symbol(a, CDATA_ELEMENT);
+
+  return dfa_state(a, &initial, 1);
 }
 
 
-void
-free_state_engine(dtd_state *state)
-{ if ( state )
-  { visited visited;
-    visited.size = 0;
+dtd_state *
+make_state_engine(dtd *dtd, dtd_element *e)
+{ if ( e->structure )
+  { dtd_edef *def = e->structure;
+    sgml_arena *a = &dtd->arena;
+
+    if ( !def->initial_state )
+    { nfa_state *initial, *final;
+
+      if ( def->content )
+      { initial = new_nfa_state(a);
+	final   = new_nfa_state(a);
 
-    visit(state, &visited);
-    do_free_state_engine(state, &visited);
+	if ( !def->and_memo )
+	{ def->and_memo = arena_calloc(a, sizeof(and_memo));
+	  def->and_memo->arena = a;
+	}
+	translate_model(def->and_memo, def->content, initial, final);
+	def->initial_state = make_automaton(a, def->content, initial, final);
+      } else if ( def->type == C_CDATA || def->type == C_RCDATA )
+      { initial = new_nfa_state(a);
+	final   = new_nfa_state(a);
+
+	link(a, initial, initial, CDATA_ELEMENT);
+	link(a, initial, final, NULL);
+	def->initial_state = make_automaton(a, NULL, initial, final);
+      } else
+	return NULL;
+    }
+
+    return def->initial_state;
   }
+
+  return NULL;
 }
 
 
+		 /*******************************
+		 *	      FREEZING		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+complete_state_engine() creates the state engine of e and computes the
+transitions of all DFA states that can  be reached from its initial
+state, expanding the lazy (a&b&...) NFA   states  on the way. After this,
+walking the engine no longer modifies it, which allows a frozen DTD to be
+used by multiple parsers concurrently (see freeze_dtd()).
+
+A group (a&b&...) of N members has 2^N DFA states. If expansion reaches
+MAXFROZENSTATES, the remainder is left   lazy  and the automaton is
+marked shared, such that state_row() completes it under model_mutex.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+void
+complete_state_engine(dtd *dtd, dtd_element *e)
+{ dtd_state *initial;
+  dtd_state **stack;
+  int top = 0, allocated = 64;
+
+  if ( !(initial = make_state_engine(dtd, e)) )
+    return;
+
+  stack = sgml_malloc(allocated*sizeof(dtd_state*));
+  stack[top++] = initial;
+
+  while(top > 0)
+  { dtd_state *s = stack[--top];
+    automaton *a = s->automaton;
+    dtd_state **row;
+    int c;
 
+    if ( s->row )
+      continue;
+    if ( a->nstates >= MAXFROZENSTATES )
+    { a->shared = TRUE;
+      break;
+    }
+    row = make_state_row(s);
+    for(c=0; c<a->nsymbols; c++)
+    { if ( row[c] && !row[c]->row )
+      { if ( top == allocated )
+	{ allocated *= 2;
+	  stack = sgml_realloc(stack, allocated*sizeof(dtd_state*));
+	}
+	stack[top++] = row[c];
+      }
+    }
+  }
+
+  sgml_free(stack);
+}
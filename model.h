@@ -29,19 +29,15 @@
 
 #define CDATA_ELEMENT	((dtd_element *)1)
 
-typedef struct _dtd_state
-{ struct _state_transition *transitions;
-  struct _state_expander *expander;
-} dtd_state;
+typedef struct _dtd_state dtd_state;	/* opaque; see model.c */
 
-dtd_state      *new_dtd_state(void);
 dtd_state *	make_dtd_transition(dtd_state *here, dtd_element *e);
-int		same_state(dtd_state *final, dtd_state *here);
-int 		find_omitted_path(dtd_state *state, dtd_element *e,
-				  dtd_element **path);
-dtd_state *	make_state_engine(dtd_element *e);
-void		free_state_engine(dtd_state *state);
+int		state_is_final(dtd_state *here);
+int 		find_omitted_path(dtd *dtd, dtd_state *state,
+				  dtd_element *e, dtd_element **path);
+dtd_state *	make_state_engine(dtd *dtd, dtd_element *e);
 void		state_allows_for(dtd_state *state,
 				 dtd_element **allow, int *n);
+void		complete_state_engine(dtd *dtd, dtd_element *e);
 
 #endif /*MODEL_H_INCLUDED*/
@@ -36,14 +36,29 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
 #include "utf8.h"
 #include <errno.h>
 #include <wctype.h>
 #include "xml_unicode.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define DEBUG(g) ((void)0)
 #define ZERO_TERM_LEN (-1)		/* terminated by nul */
 
+#ifdef _REENTRANT
+#include <pthread.h>
+
+static pthread_mutex_t dtd_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK() pthread_mutex_lock(&dtd_mutex)
+#define UNLOCK() pthread_mutex_unlock(&dtd_mutex)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
 #ifdef __WINDOWS__
 #define inline __inline
 #define swprintf _snwprintf
@@ -59,6 +74,42 @@ typedef struct locbuf
   dtd_srcloc here;			/* p->location */
 } locbuf;
 
+typedef struct _overlay_attr		/* implicit attribute */
+{ dtd_element *element;			/* element it belongs to */
+  dtd_attr *attribute;			/* the definition */
+  struct _overlay_attr *next;
+} overlay_attr;
+
+typedef struct _overlay_entity		/* loaded external entity */
+{ dtd_entity *entity;			/* the entity */
+  ichar *value;				/* its text */
+  int length;				/* length of the text */
+  struct _overlay_entity *next;
+} overlay_entity;
+
+typedef struct _dtd_overlay		/* parser extensions to a frozen DTD */
+{ dtd_symbol_table *symbols;		/* symbols not in the DTD */
+  overlay_attr *attributes;		/* implicit attributes */
+  overlay_entity *entities;		/* values of external entities */
+  int has_encoding;			/* encoding is set */
+  dtd_char_encoding encoding;		/* encoding of the document */
+  sgml_arena arena;			/* storage for all of the above */
+} dtd_overlay;
+
+typedef struct _text_buffer		/* expanded declaration text */
+{ ichar *data;				/* the text (0-terminated) */
+  size_t size;				/* # characters in data */
+  size_t allocated;			/* # characters allocated */
+  ichar local[INLINE_TEXT];		/* initial store */
+} text_buffer;
+
+typedef struct _attribute_vector	/* attributes of a begin-tag */
+{ int size;				/* # attributes */
+  int allocated;			/* # allocated */
+  sgml_attribute *atts;			/* the attributes */
+  sgml_attribute local[INLINE_ATTRIBUTES]; /* initial store */
+} attribute_vector;
+
 
 		 /*******************************
 		 *	      PROTOYPES		*
@@ -72,7 +123,6 @@ static const ichar *	itake_namegroup(dtd_parser *p, const ichar *decl,
 					dtd_symbol **names, int *n);
 static const ichar *	iskip_layout(dtd *dtd, const ichar *in);
 static dtd_parser *	clone_dtd_parser(dtd_parser *p);
-static void		free_model(dtd_model *m);
 static int		process_entity_declaration(dtd_parser *p,
 						    const ichar *decl);
 static void		free_notations(dtd_notation *n);
@@ -93,10 +143,12 @@ int			putchar_dtd_parser(dtd_parser *p, int chr);
 void			free_dtd_parser(dtd_parser *p);
 static const ichar *	isee_character_entity(dtd *dtd, const ichar *in,
 					      int *chr);
-static int		add_default_attributes(dtd_parser *p, dtd_element *e,
-					       int natts,
-					       sgml_attribute *atts);
+static sgml_attribute *	default_attributes(dtd_parser *p, dtd_element *e,
+					   int *natts);
 static int		prepare_cdata(dtd_parser *p);
+static void		init_tokenizer(dtd_charfunc *cf);
+static const ichar *	overlay_entity_value(dtd_parser *p, dtd_entity *e,
+					     int *len);
 
 
 		 /*******************************
@@ -117,7 +169,6 @@ static int		prepare_cdata(dtd_parser *p);
 #ifdef O_STATISTICS
 
 int edefs_created = 0;
-int edefs_freed = 0;
 int edefs_implicit = 0;
 int edefs_atts = 0;
 int edefs_decl = 0;
@@ -126,7 +177,7 @@ int dtd_freed = 0;
 
 void
 sgml_statistics(void)
-{ fprintf(stderr, "EDEFS: created %d; freed %d\n", edefs_created, edefs_freed);
+{ fprintf(stderr, "EDEFS: created %d\n", edefs_created);
   fprintf(stderr, "EDEFS: implicit %d; atts %d; decl %d\n",
 	  edefs_implicit, edefs_atts, edefs_decl);
   fprintf(stderr, "DTDs: created: %d; freed: %d\n", dtd_created, dtd_freed);
@@ -168,7 +219,7 @@ _sgml_cplocation(dtd_srcloc *d, dtd_srcloc *loc)
 { d->type    = loc->type;
   d->name.file = loc->name.file;
   d->line    = loc->line;
-  d->linepos = loc->linepos;
+  d->lineoff = loc->lineoff;
   d->charpos = loc->charpos;
 					/* but not the parent! */
 }
@@ -182,32 +233,38 @@ sgml_cplocation(dtd_srcloc *d, dtd_srcloc *loc)
 
 static void
 inc_location(dtd_srcloc *l, int chr)
-{ if ( chr == '\n' )
-  { l->linepos = 0;
+{ int linepos = sgml_linepos(l);
+
+  if ( chr == '\n' )
+  { linepos = 0;
     l->line++;
   } else if ( chr == '\t' )
-  { l->linepos |= 7;
+  { linepos |= 7;
   }
 
-  l->linepos++;
   l->charpos++;
+  sgml_set_linepos(l, linepos+1);
 }
 
 
 static void
 dec_location(dtd_srcloc *l, int chr)
-{ if ( chr == '\n' )
-  { l->linepos = 2;			/* not good! */
+{ l->charpos--;
+  if ( chr == '\n' )
+  { sgml_set_linepos(l, 1);		/* not good! */
     l->line--;
   }
-  l->linepos--;
-  l->charpos--;
 }
 
 		 /*******************************
 		 *   CLASSIFICATION PRIMITIVES	*
 		 *******************************/
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Characters up to 0xff are classified by  the table of the DTD. The others
+use the two-level table of xml_unicode.c, which  is built by new_dtd().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static inline int
 HasClass(dtd *dtd, wint_t chr, int mask)
 { if ( chr <= 0xff )
@@ -215,21 +272,15 @@ HasClass(dtd *dtd, wint_t chr, int mask)
   else
   { switch(mask)
     { case CH_NAME:
-	return ( xml_basechar(chr) ||
-		 xml_digit(chr) ||
-		 xml_ideographic(chr) ||
-		 xml_combining_char(chr) ||
-		 xml_extender(chr)
-	       );
+	return xml_char_class(chr) & XML_NAME_CHAR;
       case CH_NMSTART:
-	return ( xml_basechar(chr) ||
-		 xml_ideographic(chr) );
+	return xml_char_class(chr) & XML_NMSTART_CHAR;
       case CH_WHITE:
 	return FALSE;			/* only ' ' and '\t' */
       case CH_BLANK:
 	return iswspace(chr);
       case CH_DIGIT:
-	return xml_digit(chr);
+	return xml_char_class(chr) & XML_DIGIT;
       case CH_RS:
       case CH_RE:
 	return FALSE;
@@ -253,28 +304,42 @@ isee_func(dtd *dtd, const ichar *in, charfunc func)
 		 *	      SYMBOLS		*
 		 *******************************/
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The symbol table uses open addressing with linear probing. The table is
+indexed by the case-insensitive hash  of   the  name,  such  that both
+case-sensitive and case-insensitive lookup use  the same probe sequence.
+The hash is kept in the slot, so mismatches rarely touch the symbol. The
+table doubles when it is 3/4 full. The symbol and its  name are allocated
+together in the arena of the DTD.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static dtd_symbol_table *
 new_symbol_table()
 { dtd_symbol_table *t = sgml_calloc(1, sizeof(*t));
   t->size    = SYMBOLHASHSIZE;
-  t->entries = sgml_calloc(t->size, sizeof(dtd_symbol*));
+  t->entries = sgml_calloc(t->size, sizeof(dtd_symbol_slot));
 
   return t;
 }
 
 
+/* dtd_release_symbol() is called for each symbol that has a client handle
+   when its table is freed, such that a client can cache data for a
+   name (e.g., the Prolog atom, see sgml2pl.c).
+*/
+
+dtd_release_symbol_f dtd_release_symbol = NULL;
+
 static void
 free_symbol_table(dtd_symbol_table *t)
-{ int i;
-
-  for(i=0; i<t->size; i++)
-  { dtd_symbol *s, *next;
+{ if ( dtd_release_symbol )
+  { int i;
 
-    for(s=t->entries[i]; s; s=next)
-    { next = s->next;
+    for(i=0; i<t->size; i++)
+    { dtd_symbol *s = t->entries[i].symbol;
 
-      sgml_free((ichar*)s->name);
-      sgml_free(s);
+      if ( s && (s->handle || s->local_handle) )
+	(*dtd_release_symbol)(s);
     }
   }
 
@@ -283,78 +348,230 @@ free_symbol_table(dtd_symbol_table *t)
 }
 
 
-dtd_symbol *
-dtd_find_symbol(dtd *dtd, const ichar *name)
-{ dtd_symbol_table *t = dtd->symbols;
+static void
+resize_symbol_table(dtd_symbol_table *t)
+{ dtd_symbol_slot *old = t->entries;
+  int oldsize = t->size;
+  unsigned int mask;
+  int i;
 
-  if ( dtd->case_sensitive )
-  { int k = istrhash(name, t->size);
-    dtd_symbol *s;
+  t->size *= 2;
+  t->entries = sgml_calloc(t->size, sizeof(dtd_symbol_slot));
+  mask = t->size-1;
 
-    for(s=t->entries[k]; s; s = s->next)
-    { if ( istreq(s->name, name) )
-	return s;
-    }
-  } else
-  { int k = istrcasehash(name, t->size);
-    dtd_symbol *s;
+  for(i=0; i<oldsize; i++)
+  { if ( old[i].symbol )
+    { unsigned int k = old[i].hash & mask;
 
-    for(s=t->entries[k]; s; s = s->next)
-    { if ( istrcaseeq(s->name, name) )
-	return s;
+      while( t->entries[k].symbol )
+	k = (k+1) & mask;
+      t->entries[k] = old[i];
     }
   }
 
+  sgml_free(old);
+}
+
+
+static dtd_symbol *
+find_symbol(dtd_symbol_table *t, const ichar *name, int case_sensitive)
+{ unsigned int hash = istrfoldhash(name);
+  unsigned int mask = t->size-1;
+  unsigned int k;
+  dtd_symbol_slot *e;
+
+  for(k = hash&mask; (e=&t->entries[k])->symbol; k = (k+1)&mask)
+  { if ( e->hash == hash &&
+	 (case_sensitive ? istreq(e->symbol->name, name)
+			 : istrcaseeq(e->symbol->name, name)) )
+      return e->symbol;
+  }
+
   return NULL;
 }
 
 
+dtd_symbol *
+dtd_find_symbol(dtd *dtd, const ichar *name)
+{ return find_symbol(dtd->symbols, name, dtd->case_sensitive);
+}
+
+
 static dtd_symbol *
 dtd_find_entity_symbol(dtd *dtd, const ichar *name)
-{ dtd_symbol_table *t = dtd->symbols;
+{ return find_symbol(dtd->symbols, name, dtd->ent_case_sensitive);
+}
 
-  if ( dtd->ent_case_sensitive )
-  { int k = istrhash(name, t->size);
-    dtd_symbol *s;
 
-    for(s=t->entries[k]; s; s = s->next)
-    { if ( istreq(s->name, name) )
-	return s;
+static int
+same_name(const ichar *s, const ichar *name, size_t len, int fold)
+{ size_t i;
+
+  if ( fold )
+  { for(i=0; i<len; i++)
+    { if ( s[i] != FOLDCHAR(name[i]) )
+	return FALSE;
     }
   } else
-  { int k = istrcasehash(name, t->size);
-    dtd_symbol *s;
-
-    for(s=t->entries[k]; s; s = s->next)
-    { if ( istrcaseeq(s->name, name) )
-	return s;
+  { for(i=0; i<len; i++)
+    { if ( s[i] != name[i] )
+	return FALSE;
     }
   }
 
-  return NULL;
+  return s[len] == '\0';
 }
 
 
-dtd_symbol *
-dtd_add_symbol(dtd *dtd, const ichar *name)
-{ dtd_symbol_table *t = dtd->symbols;
-  int k = istrhash(name, t->size);
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+lookup_symbol() finds the symbol named by the  first len characters of
+name, mapped to lowercase if fold is TRUE.   hash is the istrfoldhash()
+of the name, normally computed while  scanning   it  (see itake_name()).
+The name is compared in place. If the  symbol   does  not exist and a is
+not NULL, it is created in a.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_symbol *
+lookup_symbol(dtd_symbol_table *t, sgml_arena *a,
+	      const ichar *name, size_t len, unsigned int hash, int fold)
+{ unsigned int mask = t->size-1;
+  unsigned int k;
+  dtd_symbol_slot *e;
   dtd_symbol *s;
+  ichar *n;
+  size_t i;
 
-  for(s=t->entries[k]; s; s = s->next)
-  { if ( istreq(s->name, name) )
-      return s;
+  for(k = hash&mask; (e=&t->entries[k])->symbol; k = (k+1)&mask)
+  { if ( e->hash == hash && same_name(e->symbol->name, name, len, fold) )
+      return e->symbol;
   }
 
-  s = sgml_calloc(1, sizeof(*s));
-  s->name = istrdup(name);
-  s->next = t->entries[k];
-  t->entries[k] = s;
+  if ( !a )
+    return NULL;
+
+  s = arena_calloc(a, sizeof(*s) + (len+1)*sizeof(ichar));
+  s->name = n = (ichar*)(s+1);
+  for(i=0; i<len; i++)
+    n[i] = (fold ? FOLDCHAR(name[i]) : name[i]);
+  n[len] = '\0';
+  e->hash   = hash;
+  e->symbol = s;
+
+  if ( ++t->count*4 > t->size*3 )
+    resize_symbol_table(t);
 
   return s;
 }
 
 
+/* add_symbol() finds the symbol with exactly this name.  If it does not
+   exist and a is not NULL, it is created in a.
+*/
+
+static dtd_symbol *
+add_symbol(dtd_symbol_table *t, sgml_arena *a, const ichar *name)
+{ return lookup_symbol(t, a, name, istrlen(name), istrfoldhash(name), FALSE);
+}
+
+
+dtd_symbol *
+dtd_add_symbol(dtd *dtd, const ichar *name)
+{ return add_symbol(dtd->symbols, &dtd->arena, name);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A frozen DTD (see freeze_dtd()) is shared between parsers and may not be
+modified. Names that are not in the DTD  are added to the overlay of the
+parser.  The overlay symbol table  also   holds  the  names  of elements
+created by the parser for  DTD   symbols  that  have no element (see
+document_element()).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_overlay *
+parser_overlay(dtd_parser *p)
+{ if ( !p->overlay )
+  { dtd_overlay *o = sgml_calloc(1, sizeof(*o));
+
+    o->symbols = new_symbol_table();
+    init_arena(&o->arena);
+    p->overlay = o;
+  }
+
+  return p->overlay;
+}
+
+
+static dtd_symbol *
+overlay_symbol(dtd_parser *p, const ichar *name)
+{ dtd_overlay *o = parser_overlay(p);
+
+  return add_symbol(o->symbols, &o->arena, name);
+}
+
+
+static void
+free_overlay(dtd_overlay *o)
+{ overlay_entity *oe;
+
+  for(oe=o->entities; oe; oe=oe->next)
+  { if ( oe->value )
+      sgml_free(oe->value);
+  }
+  free_symbol_table(o->symbols);
+  free_arena(&o->arena);
+  sgml_free(o);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+hashed_symbol_dtd_parser() is add_symbol_dtd_parser()   for a name that
+is not 0-terminated and whose hash is known (see lookup_symbol()).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_symbol *
+hashed_symbol_dtd_parser(dtd_parser *p, const ichar *name, size_t len,
+			 unsigned int hash, int fold)
+{ dtd *dtd = p->dtd;
+  dtd_overlay *o;
+  dtd_symbol *s;
+
+  if ( !dtd->frozen )
+    return lookup_symbol(dtd->symbols, &dtd->arena, name, len, hash, fold);
+
+  if ( (s=lookup_symbol(dtd->symbols, NULL, name, len, hash, fold)) )
+    return s;
+
+  o = parser_overlay(p);
+  return lookup_symbol(o->symbols, &o->arena, name, len, hash, fold);
+}
+
+
+dtd_symbol *
+add_symbol_dtd_parser(dtd_parser *p, const ichar *name)
+{ return hashed_symbol_dtd_parser(p, name, istrlen(name),
+				  istrfoldhash(name), FALSE);
+}
+
+
+static dtd_symbol *
+add_folded_symbol(dtd_parser *p, const ichar *name, size_t len, int fold)
+{ uint64_t h = FOLDHASH_INIT;
+  size_t i;
+
+  for(i=0; i<len; i++)
+    FOLDHASH_ADD(h, name[i]);
+
+  return hashed_symbol_dtd_parser(p, name, len, foldhash_value(h), fold);
+}
+
+
+dtd_symbol *
+add_nsymbol_dtd_parser(dtd_parser *p, const ichar *name, size_t len)
+{ return add_folded_symbol(p, name, len, FALSE);
+}
+
+
 		 /*******************************
 		 *	    ENTITIES		*
 		 *******************************/
@@ -425,6 +642,9 @@ static const ichar *
 entity_value(dtd_parser *p, dtd_entity *e, int *len)
 { ichar *file;
 
+  if ( !e->value && p->dtd->frozen )
+    return overlay_entity_value(p, e, len);
+
   if ( !e->value && (file=entity_file(p->dtd, e)) )
   { int normalise = (e->content == EC_SGML || e->content == EC_CDATA);
     size_t l;
@@ -441,8 +661,82 @@ entity_value(dtd_parser *p, dtd_entity *e, int *len)
 }
 
 
+/* overlay_entity_value() is entity_value() for a frozen DTD: the value
+   of an external entity is loaded into the overlay of the parser.
+*/
+
+static const ichar *
+overlay_entity_value(dtd_parser *p, dtd_entity *e, int *len)
+{ dtd_overlay *o = parser_overlay(p);
+  overlay_entity *oe;
+  ichar *file;
+
+  for(oe=o->entities; oe; oe=oe->next)
+  { if ( oe->entity == e )
+    { if ( len )
+	*len = oe->length;
+      return oe->value;
+    }
+  }
+
+  if ( (file=entity_file(p->dtd, e)) )
+  { int normalise = (e->content == EC_SGML || e->content == EC_CDATA);
+    size_t l;
+
+    oe = arena_calloc(&o->arena, sizeof(*oe));
+    oe->entity = e;
+    oe->value = load_sgml_file_to_charp(file, normalise, &l);
+    oe->length = (int)l;
+    oe->next = o->entities;
+    o->entities = oe;
+    sgml_free(file);
+
+    if ( len )
+      *len = oe->length;
+    return oe->value;
+  }
+
+  if ( len )
+    *len = e->length;
+
+  return NULL;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Declarations are expanded into a  text_buffer.   The  buffer  starts  on the
+stack and moves to the value arena of the parser if the text does not
+fit. This storage is released by   process_declaration() after handling
+the declaration.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+init_text_buffer(text_buffer *b)
+{ b->data = b->local;
+  b->size = 0;
+  b->allocated = INLINE_TEXT;
+  b->data[0] = '\0';
+}
+
+
+static void
+add_text_buffer(dtd_parser *p, text_buffer *b, ichar chr)
+{ if ( b->size+1 >= b->allocated )
+  { ichar *new = arena_alloc(&p->value_arena,
+			     b->allocated*2*sizeof(ichar));
+
+    memcpy(new, b->data, b->size*sizeof(ichar));
+    b->data = new;
+    b->allocated *= 2;
+  }
+
+  b->data[b->size++] = chr;
+  b->data[b->size] = '\0';
+}
+
+
 static int
-expand_pentities(dtd_parser *p, const ichar *in, int ilen, ichar *out, int len)
+expand_pentities(dtd_parser *p, const ichar *in, int ilen, text_buffer *out)
 { dtd *dtd = p->dtd;
   int pero = dtd->charfunc->func[CF_PERO]; /* % */
   int ero = dtd->charfunc->func[CF_ERO]; /* & */
@@ -462,7 +756,6 @@ expand_pentities(dtd_parser *p, const ichar *in, int ilen, ichar *out, int len)
       if ( (s = itake_entity_name(p, in+1, &id)) )
       { dtd_entity *e = find_pentity(dtd, id);
 	const ichar *eval;
-	int l;
 
 	in = s;
 	if ( (s=isee_func(dtd, s, CF_ERC)) ) /* ; is not obligatory? */
@@ -474,21 +767,13 @@ expand_pentities(dtd_parser *p, const ichar *in, int ilen, ichar *out, int len)
 	if ( !(eval = entity_value(p, e, NULL)) )
 	  return FALSE;
 
-	if ( !expand_pentities(p, eval, ZERO_TERM_LEN, out, len) )
+	if ( !expand_pentities(p, eval, ZERO_TERM_LEN, out) )
 	  return FALSE;
-	l = (int)istrlen(out);		/* could be better */
-	out += l;
-	len -= l;
 
 	continue;
       }
     }
 
-    if ( --len <= 0 )
-    { gripe(p, ERC_REPRESENTATION, L"Declaration too long");
-      return FALSE;
-    }
-
     if ( *in == ero && in[1] == '#' )	/* &# */
     { int chr;
 
@@ -496,18 +781,16 @@ expand_pentities(dtd_parser *p, const ichar *in, int ilen, ichar *out, int len)
       { if ( chr == 0 )
 	{ gripe(p, ERC_SYNTAX_ERROR, L"Illegal character entity", in);
 	} else
-	{ *out++ = chr;
+	{ add_text_buffer(p, out, chr);
 	  in = s;
 	  continue;
 	}
       }
     }
 
-    *out++ = *in++;
+    add_text_buffer(p, out, *in++);
   }
 
-  *out = '\0';
-
   return TRUE;
 }
 
@@ -659,18 +942,26 @@ expand_entities(dtd_parser *p, const ichar *in, int len, ocharbuf *out)
 		 *******************************/
 
 static dtd_element *
-find_element(dtd *dtd, dtd_symbol *id)
-{ dtd_element *e;
-
-  if ( id->element )
-    return id->element;			/* must check */
+new_element(sgml_arena *a, dtd_symbol *id)
+{ dtd_element *e = arena_calloc(a, sizeof(*e));
 
-  e = sgml_calloc(1, sizeof(*e));
   e->space_mode = SP_INHERIT;
   e->undefined = TRUE;
   e->name = id;
   id->element = e;
 
+  return e;
+}
+
+
+static dtd_element *
+find_element(dtd *dtd, dtd_symbol *id)
+{ dtd_element *e;
+
+  if ( id->element )
+    return id->element;			/* must check */
+
+  e = new_element(&dtd->arena, id);
   e->next = dtd->elements;
   dtd->elements = e;
 
@@ -679,8 +970,8 @@ find_element(dtd *dtd, dtd_symbol *id)
 
 
 static dtd_edef *
-new_element_definition(dtd *dtd)
-{ dtd_edef *def = sgml_calloc(1, sizeof(*def));
+new_element_definition(sgml_arena *a)
+{ dtd_edef *def = arena_calloc(a, sizeof(*def));
 
   STAT(edefs_created++);
 
@@ -693,8 +984,7 @@ def_element(dtd *dtd, dtd_symbol *id)
 { dtd_element *e = find_element(dtd, id);
 
   if ( !e->structure )
-  { e->structure = new_element_definition(dtd);
-    e->structure->references = 1;
+  { e->structure = new_element_definition(&dtd->arena);
     e->structure->type = C_EMPTY;
   }
 
@@ -702,116 +992,198 @@ def_element(dtd *dtd, dtd_symbol *id)
 }
 
 
-static void
-free_name_list(dtd_name_list *nl)
-{ dtd_name_list *next;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+document_element() returns the element for a tag  in the document. If the
+DTD is frozen, elements that are  not   in  the DTD are created in the
+overlay of the parser. They are attached  to   the  overlay  symbol of the
+same name, so the  DTD  symbol  is   not  modified.  freeze_dtd() gives
+all elements of the DTD a definition, so these are all we need to create.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_element *
+document_element(dtd_parser *p, dtd_symbol *id)
+{ dtd *dtd = p->dtd;
 
-  for( ; nl; nl=next)
-  { next = nl->next;
+  if ( !dtd->frozen )
+    return find_element(dtd, id);
+  if ( id->element )
+    return id->element;
+
+  id = overlay_symbol(p, id->name);
+  if ( !id->element )
+  { sgml_arena *a = &p->overlay->arena;
+    dtd_element *e = new_element(a, id);
 
-    sgml_free(nl);
+    STAT(edefs_implicit++);
+    e->structure = new_element_definition(a);
+    e->structure->type = C_EMPTY;
   }
+
+  return id->element;
 }
 
 
-#define REFS_VIRGIN (-42)
+		 /*******************************
+		 *	    ATTRIBUTES		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Elements often have many attributes and every   start tag looks up its
+attributes by name and walks the attributes  that have a default. The
+attribute index of an element is an  open   hash  table on the (interned)
+name of the attribute and  a  list  of   the  attributes  that  have  a
+default value. It is created on first use  and extended by add_attribute().
+freeze_dtd() creates the index of all elements, such that a frozen DTD is
+not modified. Elements without an index on  a frozen DTD, those in the
+overlay of the parser, use the attribute list.
+
+The index also holds  the  values   of  the  default  attributes as
+sgml_attribute structures, ready to be copied by add_default_attributes().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define ATTR_HASH(name) ((unsigned int)(((uintptr_t)(name) >> 3) * 2654435761U))
 
 static void
-free_attribute(dtd_attr *a)
-{ if ( a->references == REFS_VIRGIN || --a->references == 0 )
-  { switch(a->type)
-    { case AT_NAMEOF:
-      case AT_NOTATION:
-	free_name_list(a->typeex.nameof);
-      default:
-	;
-    }
-    switch(a->def)
-    { case AT_DEFAULT:
-      case AT_FIXED:
-      { if ( a->islist )
-	  sgml_free(a->att_def.list);
-	else if ( a->type == AT_CDATA && a->att_def.cdata )
-	  sgml_free(a->att_def.cdata);
+index_attribute(sgml_arena *arena, dtd_attr_index *ix, dtd_attr *a)
+{ unsigned int k;
+
+  if ( ix->count*2 >= ix->size )
+  { int osize = ix->size;
+    dtd_attr **old = ix->table;
+    int i;
+
+    ix->size = (osize ? osize*2 : 16);
+    ix->table = arena_calloc(arena, ix->size*sizeof(dtd_attr*));
+    ix->count = 0;
+    for(i=0; i<osize; i++)		/* old table stays in the arena */
+    { if ( old[i] )
+      { for(k=ATTR_HASH(old[i]->name) & (ix->size-1);
+	    ix->table[k];
+	    k = (k+1) & (ix->size-1))
+	  ;
+	ix->table[k] = old[i];
+	ix->count++;
       }
-      default:
-	;
     }
-
-    sgml_free(a);
   }
-}
-
 
-static void
-free_attribute_list(dtd_attr_list *l)
-{ dtd_attr_list *next;
+  for(k=ATTR_HASH(a->name) & (ix->size-1);
+      ix->table[k];
+      k = (k+1) & (ix->size-1))
+  { if ( ix->table[k]->name == a->name )
+      return;				/* first wins */
+  }
+  ix->table[k] = a;
+  ix->count++;
 
-  for(; l; l=next)
-  { next = l->next;
+  if ( a->def == AT_FIXED || a->def == AT_DEFAULT )
+  { dtd_attr_list *l = arena_calloc(arena, sizeof(*l));
 
-    free_attribute(l->attribute);
-    sgml_free(l);
+    l->attribute = a;
+    *ix->defaults_tail = l;
+    ix->defaults_tail = &l->next;
   }
 }
 
 
 static void
-free_element_list(dtd_element_list *l)
-{ dtd_element_list *next;
+index_default_values(dtd *dtd, dtd_attr_index *ix)
+{ dtd_attr_list *al;
+  sgml_attribute *ap;
+  int n = 0;
+
+  for(al=ix->defaults; al; al=al->next)
+    n++;
+  ap = arena_calloc(&dtd->arena, (n ? n : 1)*sizeof(*ap));
+  ix->default_values = ap;
+  ix->ndefaults = n;
+  ix->number_mode = dtd->number_mode;
 
-  for( ; l; l=next)
-  { next = l->next;
+  for(al=ix->defaults; al; al=al->next, ap++)
+  { dtd_attr *a = al->attribute;
+
+    ap->definition   = a;
+    ap->flags        = SGML_AT_DEFAULT;
 
-    sgml_free(l);
+    switch(a->type)
+    { case AT_CDATA:
+	ap->value.textW = a->att_def.cdata;
+	ap->value.number = (long)istrlen(ap->value.textW);
+	break;
+      case AT_NUMBER:
+	if ( dtd->number_mode == NU_TOKEN )
+	{ ap->value.textW  = (ichar*)a->att_def.name->name;
+	  ap->value.number = (long)istrlen(ap->value.textW);
+	} else
+	{ ap->value.number = a->att_def.number;
+	}
+	break;
+      default:
+	if ( a->islist )
+	{ ap->value.textW = a->att_def.list;
+	} else
+	{ ap->value.textW = (ichar*)a->att_def.name->name;
+	}
+	ap->value.number = (long)istrlen(ap->value.textW);
+    }
   }
 }
 
-static void
-free_element_definition(dtd_edef *def)
-{ if ( --def->references == 0 )
-  { STAT(edefs_freed++);
-    if ( def->content )
-      free_model(def->content);
-    free_element_list(def->included);
-    free_element_list(def->excluded);
-    free_state_engine(def->initial_state);
 
-    sgml_free(def);
+static dtd_attr_index *
+attribute_index(dtd *dtd, dtd_element *e)
+{ if ( !e->attr_index && !dtd->frozen )
+  { dtd_attr_index *ix = arena_calloc(&dtd->arena, sizeof(*ix));
+    dtd_attr_list *al;
+
+    ix->defaults_tail = &ix->defaults;
+    for(al=e->attributes; al; al=al->next)
+      index_attribute(&dtd->arena, ix, al->attribute);
+    index_default_values(dtd, ix);
+    e->attr_index = ix;
   }
+
+  return e->attr_index;
 }
 
 
-static void
-free_elements(dtd_element *e)
-{ dtd_element *next;
+static dtd_attr *
+find_attribute(dtd *dtd, dtd_element *e, dtd_symbol *name)
+{ dtd_attr_index *ix;
 
-  for( ; e; e=next)
-  { next = e->next;
+  if ( (ix=attribute_index(dtd, e)) )
+  { unsigned int k;
 
-    if ( e->structure )
-      free_element_definition(e->structure);
-    free_attribute_list(e->attributes);
+    if ( ix->size == 0 )
+      return NULL;
+    for(k=ATTR_HASH(name) & (ix->size-1);
+	ix->table[k];
+	k = (k+1) & (ix->size-1))
+    { if ( ix->table[k]->name == name )
+	return ix->table[k];
+    }
+  } else
+  { dtd_attr_list *a;
 
-    sgml_free(e);
+    for(a=e->attributes; a; a=a->next)
+    { if ( a->attribute->name == name )
+	return a->attribute;
+    }
   }
-}
 
+  return NULL;
+}
 
-		 /*******************************
-		 *	    ATTRIBUTES		*
-		 *******************************/
 
-static dtd_attr *
-find_attribute(dtd_element *e, dtd_symbol *name)
-{ dtd_attr_list *a;
+/* dtd_default_attributes() returns a list that holds at least all
+   attributes of e that have a default value.
+*/
 
-  for(a=e->attributes; a; a=a->next)
-  { if ( a->attribute->name == name )
-      return a->attribute;
-  }
+dtd_attr_list *
+dtd_default_attributes(dtd *dtd, dtd_element *e)
+{ dtd_attr_index *ix = attribute_index(dtd, e);
 
-  return NULL;
+  return ix ? ix->defaults : e->attributes;
 }
 
 
@@ -865,130 +1237,76 @@ isee_identifier(dtd *dtd, const ichar *in, char *id)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+itake_symbol() scans the name characters  at   in  and returns the symbol
+for them in *id. The name is  hashed   while  scanning, so the symbol
+table is probed once and the name is not copied unless it is new.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static const ichar *
-itake_name(dtd_parser *p, const ichar *in, dtd_symbol **id)
-{ ichar buf[MAXNMLEN];
-  ichar *o = buf;
-  ichar *e = &buf[MAXNMLEN]-1;
-  dtd *dtd = p->dtd;
+itake_symbol(dtd_parser *p, const ichar *in, int fold, dtd_symbol **id)
+{ dtd *dtd = p->dtd;
+  uint64_t h = FOLDHASH_INIT;
+  const ichar *e;
 
-  in = iskip_layout(dtd, in);
-  if ( !HasClass(dtd, *in, CH_NMSTART) )
-    return NULL;
+  for(e=in; HasClass(dtd, *e, CH_NAME); e++)
+    FOLDHASH_ADD(h, *e);
+  *id = hashed_symbol_dtd_parser(p, in, e-in, foldhash_value(h), fold);
 
-  if ( dtd->case_sensitive )
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = *in++;
-  } else
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = towlower(*in++);
-  }
+  return e;
+}
 
-  if ( o == e )
-  { gripe(p, ERC_REPRESENTATION, L"NAME too long");
-    return NULL;
-  }
 
-  *o++ = '\0';
+static const ichar *
+itake_name(dtd_parser *p, const ichar *in, dtd_symbol **id)
+{ dtd *dtd = p->dtd;
 
-  *id = dtd_add_symbol(dtd, buf);
+  in = iskip_layout(dtd, in);
+  if ( !HasClass(dtd, *in, CH_NMSTART) )
+    return NULL;
 
-  return iskip_layout(dtd, in);
+  return iskip_layout(dtd, itake_symbol(p, in, !dtd->case_sensitive, id));
 }
 
 
 static const ichar *
 itake_entity_name(dtd_parser *p, const ichar *in, dtd_symbol **id)
-{ ichar buf[MAXNMLEN];
-  ichar *o = buf;
-  ichar *e = &buf[MAXNMLEN]-1;
-  dtd *dtd = p->dtd;
+{ dtd *dtd = p->dtd;
 
   in = iskip_layout(dtd, in);
   if ( !HasClass(dtd, *in, CH_NMSTART) )
     return NULL;
 
-  if ( dtd->ent_case_sensitive )
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = *in++;
-  } else
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = towlower(*in++);
-  }
-  if ( o == e )
-  { gripe(p, ERC_REPRESENTATION, L"Entity NAME too long");
-    return NULL;
-  }
-
-  *o++ = '\0';
-
-  *id = dtd_add_symbol(dtd, buf);
-
-  return in;
+  return itake_symbol(p, in, !dtd->ent_case_sensitive, id);
 }
 
 
 static const ichar *
 itake_nmtoken(dtd_parser *p, const ichar *in, dtd_symbol **id)
-{ ichar buf[MAXNMLEN];
-  ichar *o = buf;
-  ichar *e = &buf[MAXNMLEN]-1;
-  dtd *dtd = p->dtd;
+{ dtd *dtd = p->dtd;
 
   in = iskip_layout(dtd, in);
   if ( !HasClass(dtd, *in, CH_NAME) )
     return NULL;
-  if ( dtd->case_sensitive )
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = *in++;
-  } else
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = towlower(*in++);
-  }
-  if ( o == e )
-  { gripe(p, ERC_REPRESENTATION, L"NMTOKEN too long");
-    return NULL;
-  }
-
-  *o = '\0';
-
-  *id = dtd_add_symbol(dtd, buf);
 
-  return iskip_layout(dtd, in);
+  return iskip_layout(dtd, itake_symbol(p, in, !dtd->case_sensitive, id));
 }
 
 
 static const ichar *
 itake_nutoken(dtd_parser *p, const ichar *in, dtd_symbol **id)
-{ ichar buf[MAXNMLEN];
-  ichar *o = buf;
-  ichar *e = &buf[MAXNMLEN]-1;
-  dtd *dtd = p->dtd;
+{ dtd *dtd = p->dtd;
+  const ichar *e;
 
   in = iskip_layout(dtd, in);
   if ( !HasClass(dtd, *in, CH_DIGIT) )
     return NULL;
 
-  if ( dtd->case_sensitive )
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = *in++;
-  } else
-  { while( HasClass(dtd, *in, CH_NAME) && o < e )
-      *o++ = towlower(*in++);
-  }
-
-  if ( o == e )
-  { gripe(p, ERC_REPRESENTATION, L"NUTOKEN too long");
-    return NULL;
-  }
-
-  *o = '\0';
-  if ( o - buf > 8 )
+  e = itake_symbol(p, in, !dtd->case_sensitive, id);
+  if ( e - in > 8 )
     gripe(p, ERC_LIMIT, L"nutoken length");
 
-  *id = dtd_add_symbol(dtd, buf);
-
-  return iskip_layout(dtd, in);
+  return iskip_layout(dtd, e);
 }
 
 
@@ -1000,17 +1318,15 @@ itake_number(dtd_parser *p, const ichar *in, dtd_attr *at)
 
   switch(dtd->number_mode)
   { case NU_TOKEN:
-    { ichar buf[MAXNMLEN];
-      ichar *o = buf;
+    { const ichar *e;
 
-      while( HasClass(dtd, *in, CH_DIGIT) )
-	*o++ = *in++;
-      if ( o == buf )
+      for(e=in; HasClass(dtd, *e, CH_DIGIT); e++)
+	;
+      if ( e == in )
 	return NULL;			/* empty */
-      *o = '\0';
-      at->att_def.name = dtd_add_symbol(dtd, buf);
+      at->att_def.name = add_folded_symbol(p, in, e-in, FALSE);
 
-      return iskip_layout(dtd, (const ichar *)in);
+      return iskip_layout(dtd, e);
     }
     case NU_INTEGER:
     { ichar *end;
@@ -1080,18 +1396,17 @@ itake_url(dtd *dtd, const ichar *in, ichar **out)
 
 
 static const ichar *
-itake_nmtoken_chars(dtd_parser *p, const ichar *in, ichar *out, int len)
+itake_nmtoken_chars(dtd_parser *p, const ichar *in, text_buffer *out)
 { dtd *dtd = p->dtd;
 
   in = iskip_layout(dtd, in);
   if ( !HasClass(dtd, *in, CH_NAME) )
     return NULL;
   while( HasClass(dtd, *in, CH_NAME) )
-  { if ( --len <= 0 )
-      gripe(p, ERC_REPRESENTATION, L"Name token too long");
-    *out++ = (dtd->case_sensitive ? *in++ : (ichar)towlower(*in++));
+  { add_text_buffer(p, out,
+		    dtd->case_sensitive ? *in : (ichar)towlower(*in));
+    in++;
   }
-  *out++ = '\0';
 
   return iskip_layout(dtd, in);
 }
@@ -1135,7 +1450,7 @@ JW: I decided to accept / as part of an unquoted in SGML-mode if
 */
 
 static ichar const *
-itake_unquoted(dtd_parser *p, ichar const *in, ichar *out, int len)
+itake_unquoted(dtd_parser *p, ichar const *in, ichar const **start, int *len)
 { dtd *dtd = p->dtd;
   ichar const end2 = dtd->charfunc->func[CF_ETAGO2];	/* / */
   ichar c;
@@ -1144,20 +1459,17 @@ itake_unquoted(dtd_parser *p, ichar const *in, ichar *out, int len)
   while (c = *in, HasClass(dtd, c, CH_BLANK))
     in++;
 
-  /* copy the attribute to out[] */
+  /* find the end of the attribute */
+  *start = in;
   while ( !HasClass(dtd, c, CH_BLANK) &&
 	  c != '\0' )
   { if ( c == end2 && (dtd->shorttag ||
 		       (in[1] == '\0' && IS_XML_DIALECT(dtd->dialect))) )
       break;
 
-    if ( --len > 0 )
-      *out++ = c;
-    else if ( len == 0 )
-      gripe(p, ERC_REPRESENTATION, L"Attribute too long");
     c = *++in;
   }
-  *out = '\0';
+  *len = (int)(in - *start);
 
   /* skip trailing layout.  While it is kind to skip comments here,
      it is technically wrong to do so.  Tags may not contain comments.
@@ -1175,15 +1487,21 @@ dtd *
 new_dtd(const ichar *doctype)
 { dtd *dtd = sgml_calloc(1, sizeof(*dtd));
 
+  LOCK();
+  init_xml_char_classes();
+  UNLOCK();
+
   STAT(dtd_created++);
   dtd->magic	 = SGML_DTD_MAGIC;
   dtd->implicit  = TRUE;
   dtd->dialect   = DL_SGML;
   if ( doctype )
     dtd->doctype = istrdup(doctype);
+  init_arena(&dtd->arena);
   dtd->symbols	 = new_symbol_table();
   dtd->charclass = new_charclass();
   dtd->charfunc	 = new_charfunc();
+  init_tokenizer(dtd->charfunc);
   dtd->space_mode = SP_SGML;
   dtd->ent_case_sensitive = TRUE;	/* case-sensitive entities */
   dtd->shorttag    = TRUE;		/* allow for <tag/value/ */
@@ -1194,9 +1512,44 @@ new_dtd(const ichar *doctype)
 }
 
 
+/* dtd_release_attr() is called for each attribute that has a client
+   handle when the DTD is freed, such that a client can cache data for
+   its default value (see sgml2pl.c).
+*/
+
+dtd_release_attr_f dtd_release_attr = NULL;
+
+static void
+free_attr_handles(dtd *dtd)
+{ dtd_element *e;
+
+  if ( !dtd_release_attr )
+    return;
+
+  for(e=dtd->elements; e; e=e->next)
+  { dtd_attr_list *al;
+
+    for(al=e->attributes; al; al=al->next)
+    { dtd_attr *a = al->attribute;
+
+      if ( a->handle )
+      { (*dtd_release_attr)(a);
+	a->handle = 0;			/* shared by (a|b) ATTLISTs */
+      }
+    }
+  }
+}
+
+
 void
 free_dtd(dtd *dtd)
-{ if ( --dtd->references == 0 )
+{ int references;
+
+  LOCK();				/* frozen DTDs are shared */
+  references = --dtd->references;
+  UNLOCK();
+
+  if ( references == 0 )
   { STAT(dtd_freed++);
 
     if ( dtd->doctype )
@@ -1206,8 +1559,9 @@ free_dtd(dtd *dtd)
     free_entity_list(dtd->pentities);
     free_notations(dtd->notations);
     free_shortrefs(dtd->shortrefs);
-    free_elements(dtd->elements);
     free_symbol_table(dtd->symbols);
+    free_attr_handles(dtd);
+    free_arena(&dtd->arena);
     sgml_free(dtd->charfunc);
     sgml_free(dtd->charclass);
     dtd->magic = 0;
@@ -1217,6 +1571,45 @@ free_dtd(dtd *dtd)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+freeze_dtd() makes dtd read-only, after which it may be shared by parsers
+in multiple threads without locking.  The  parser normally completes the
+DTD lazily while parsing a document. Freezing  does this work in advance:
+elements that are only referenced get an   EMPTY  definition and all state
+engines are created and expanded  (see   complete_state_engine()).  What
+remains, symbols, elements and attributes that   only appear in the
+document and the values of external entities,   is kept in the overlay of
+the parser. A parser that must modify the DTD before the document starts
+gets its own copy (see unshare_dtd_parser()).
+
+Some of the DTD is still completed  while parsing; large state engines
+are left lazy and omitted paths are  cached (see model.c). This is done
+under a mutex if the library is compiled with _REENTRANT. Without it, a
+frozen DTD may be shared by parsers in one thread only.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+int
+freeze_dtd(dtd *dtd)
+{ dtd_element *e;
+
+  if ( dtd->frozen )
+    return TRUE;
+
+  for(e=dtd->elements; e; e=e->next)
+  { if ( !e->structure )
+    { e->undefined = TRUE;
+      e->structure = new_element_definition(&dtd->arena);
+      e->structure->type = C_EMPTY;
+    }
+    complete_state_engine(dtd, e);
+    attribute_index(dtd, e);
+  }
+  dtd->frozen = TRUE;
+
+  return TRUE;
+}
+
+
 static const wchar_t *xml_entities[] =
 { L"lt CDATA \"&#60;\"",		/* < */
   L"gt CDATA \"&#62;\"",		/* > */
@@ -1230,7 +1623,10 @@ static const wchar_t *xml_entities[] =
 int
 set_dialect_dtd(dtd *dtd, dtd_dialect dialect)
 { if ( dtd->dialect != dialect )
-  { dtd->dialect = dialect;
+  { if ( dtd->frozen )
+      return FALSE;
+
+    dtd->dialect = dialect;
 
     switch(dialect)
     { case DL_HTML5:
@@ -1269,9 +1665,31 @@ set_dialect_dtd(dtd *dtd, dtd_dialect dialect)
 }
 
 
+/* has_option_dtd() is TRUE if setting option to set does not change dtd */
+
+static int
+has_option_dtd(dtd *dtd, dtd_option option, int set)
+{ switch(option)
+  { case OPT_SHORTTAG:
+      return dtd->shorttag == set;
+    case OPT_CASE_SENSITIVE_ATTRIBUTES:
+      return dtd->att_case_sensitive == set;
+    case OPT_CASE_PRESERVING_ATTRIBUTES:
+      return dtd->att_case_preserving == set && dtd->att_case_sensitive == set;
+    case OPT_SYSTEM_ENTITIES:
+      return dtd->system_entities == set;
+  }
+
+  return FALSE;
+}
+
+
 int
 set_option_dtd(dtd *dtd, dtd_option option, int set)
-{ switch(option)
+{ if ( dtd->frozen )
+    return has_option_dtd(dtd, option, set);
+
+  switch(option)
   { case OPT_SHORTTAG:
       dtd->shorttag = set;
       break;
@@ -1316,13 +1734,16 @@ process_entity_value_declaration(dtd_parser *p,
     goto string_expected;
   } else
   { ichar *start; int len;
-    ichar val[MAXSTRINGLEN];
+    text_buffer buf;
+    const ichar *val;
 
     if ( !(s = itake_string(dtd, decl, &start, &len)) )
       goto string_expected;
     decl = s;
 
-    expand_pentities(p, start, len, val, sizeof(val)/sizeof(ichar));
+    init_text_buffer(&buf);
+    expand_pentities(p, start, len, &buf);
+    val = buf.data;
 
     switch ( e->type )
     { case ET_PUBLIC:
@@ -1376,7 +1797,7 @@ process_entity_declaration(dtd_parser *p, const ichar *decl)
   if ( !(s = itake_entity_name(p, decl, &id)) )
   { if ( !(s = isee_identifier(dtd, decl, "#default")) )
       return gripe(p, ERC_SYNTAX_ERROR, L"Name expected", decl);
-    id = dtd_add_symbol(dtd, (ichar*)"#DEFAULT");
+    id = dtd_add_symbol(dtd, L"#DEFAULT");
     isdef = TRUE;
   }
 
@@ -1726,14 +2147,15 @@ compile_map(dtd *dtd, dtd_shortref *sr)
 static int
 process_shortref_declaration(dtd_parser *p, const ichar *decl)
 { dtd *dtd = p->dtd;
-  ichar buf[MAXDECL];
+  text_buffer buf;
   dtd_shortref *sr;
   dtd_symbol *name;
   const ichar *s;
 
-  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, buf, sizeof(buf)/sizeof(ichar)) )
+  init_text_buffer(&buf);
+  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, &buf) )
     return FALSE;
-  decl = buf;
+  decl = buf.data;
 
   if ( !(s=itake_name(p, decl, &name)) )
     return gripe(p, ERC_SYNTAX_ERROR, L"Name expected", decl);
@@ -1774,7 +2196,7 @@ find_map(dtd *dtd, dtd_symbol *name)
 
     if ( !empty )
     { empty = sgml_calloc(1, sizeof(*empty));
-      empty->name = dtd_add_symbol(dtd, (ichar*)"#EMPTY");
+      empty->name = dtd_add_symbol(dtd, L"#EMPTY");
       empty->defined = TRUE;
     }
 
@@ -1803,16 +2225,17 @@ set_map_element(dtd_element *e, void *closure)
 static int
 process_usemap_declaration(dtd_parser *p, const ichar *decl)
 { dtd *dtd = p->dtd;
-  ichar buf[MAXDECL];
+  text_buffer buf;
   dtd_symbol *name;
   const ichar *s;
   dtd_symbol *ename;
   dtd_element *e;
   dtd_shortref *map;
 
-  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, buf, sizeof(buf)/sizeof(ichar)) )
+  init_text_buffer(&buf);
+  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, &buf) )
     return FALSE;
-  decl = buf;
+  decl = buf.data;
 
   if ( !(s=itake_name(p, decl, &name)) )
   { if ( (s=isee_identifier(dtd, decl, "#empty")) )
@@ -1830,7 +2253,6 @@ process_usemap_declaration(dtd_parser *p, const ichar *decl)
 
     if ( (model = make_model(p, decl, &s)) )
     { for_elements_in_model(model, set_map_element, map);
-      free_model(model);
       decl = s;
     } else
       return FALSE;
@@ -1856,21 +2278,20 @@ process_usemap_declaration(dtd_parser *p, const ichar *decl)
 
 static int
 match_map(dtd *dtd, dtd_map *map, ocharbuf *buf)
-{ wchar_t *data = buf->data.w;
-  wchar_t *e    = data+buf->size-1;
-  ichar *m      = map->from+map->len-1;
+{ int e      = buf->size-1;
+  ichar *m   = map->from+map->len-1;
 
   while( m >= map->from )
-  { if ( e < data )
+  { if ( e < 0 )
       return 0;
 
-    if ( *m == *e )
+    if ( *m == fetch_ocharbuf(buf, e) )
     { m--;
       e--;
       continue;
     }
     if ( *m == CHR_DBLANK )
-    { if ( e>data && HasClass(dtd, *e, CH_WHITE) )
+    { if ( e>0 && HasClass(dtd, fetch_ocharbuf(buf, e), CH_WHITE) )
 	e--;
       else
 	return FALSE;
@@ -1878,7 +2299,7 @@ match_map(dtd *dtd, dtd_map *map, ocharbuf *buf)
     }
     if ( *m == CHR_BLANK )
     { wblank:
-      while( e>data && HasClass(dtd, *e, CH_WHITE) )
+      while( e>0 && HasClass(dtd, fetch_ocharbuf(buf, e), CH_WHITE) )
 	e--;
       m--;
       continue;
@@ -1886,7 +2307,7 @@ match_map(dtd *dtd, dtd_map *map, ocharbuf *buf)
     return 0;
   }
 
-  return (int)(data+buf->size-1-e);
+  return buf->size-1-e;
 }
 
 
@@ -1902,11 +2323,10 @@ match_shortref(dtd_parser *p)
 
       if ( p->cdata_must_be_empty )
       { int blank = TRUE;
-	const wchar_t *s;
 	int i;
 
-	for(s = p->cdata->data.w, i=0; i++ < p->cdata->size; s++)
-	{ if ( !iswspace(*s) )
+	for(i=0; i < p->cdata->size; i++)
+	{ if ( !iswspace(fetch_ocharbuf(p->cdata, i)) )
 	  { blank = FALSE;
 	    break;
 	  }
@@ -1918,10 +2338,9 @@ match_shortref(dtd_parser *p)
       WITH_CLASS(p, EV_SHORTREF,
 		 { sgml_cplocation(&p->startloc, &p->location);
 		   p->startloc.charpos -= len;
-		   p->startloc.linepos -= len;
-		   if ( p->startloc.linepos < 0 )
+		   if ( sgml_linepos(&p->startloc) < 0 )
 		   { p->startloc.line--;
-		     p->startloc.linepos = 0; /* not correct! */
+		     sgml_set_linepos(&p->startloc, 0); /* not correct! */
 		   }
 		   DEBUG(printf("%d-%d: Matched map '%s' --> %s, len = %d\n",
 				p->startloc.charpos,
@@ -1980,35 +2399,12 @@ for_elements_in_model(dtd_model *m,
 }
 
 
-static void
-free_model(dtd_model *m)
-{ switch(m->type)
-  { case MT_SEQ:
-    case MT_AND:
-    case MT_OR:
-    { dtd_model *sub = m->content.group;
-      dtd_model *next;
-
-      for(; sub; sub = next)
-      { next = sub->next;
-
-	free_model(sub);
-      }
-    }
-    default:
-      ;
-  }
-
-  sgml_free(m);
-}
-
-
 static dtd_model *
 make_model(dtd_parser *p, const ichar *decl, const ichar **end)
 { const ichar *s;
-  dtd_model *m = sgml_calloc(1, sizeof(*m));
-  dtd_symbol *id;
   dtd *dtd = p->dtd;
+  dtd_model *m = arena_calloc(&dtd->arena, sizeof(*m));
+  dtd_symbol *id;
 
   decl = iskip_layout(dtd, decl);
 
@@ -2026,7 +2422,6 @@ make_model(dtd_parser *p, const ichar *decl, const ichar **end)
   } else
   { if ( !(s=isee_func(dtd, decl, CF_GRPO)) )
     { gripe(p, ERC_SYNTAX_ERROR, L"Name group expected", decl);
-      free_model(m);
       return NULL;
     }
     decl = s;
@@ -2036,9 +2431,7 @@ make_model(dtd_parser *p, const ichar *decl, const ichar **end)
       modeltype mt;
 
       if ( !(sub = make_model(p, decl, &s)) )
-      { free_model(sub);
 	return NULL;
-      }
       decl = s;
       add_submodel(m, sub);
 
@@ -2056,7 +2449,6 @@ make_model(dtd_parser *p, const ichar *decl, const ichar **end)
 	break;
       } else
       { gripe(p, ERC_SYNTAX_ERROR, L"Connector ('|', ',' or '&') expected", decl);
-	free_model(m);
 	return NULL;
       }
       decl = iskip_layout(dtd, decl);
@@ -2066,7 +2458,6 @@ make_model(dtd_parser *p, const ichar *decl, const ichar **end)
 	  m->type = mt;
 	else
 	{ gripe(p, ERC_SYNTAX_ERROR, L"Different connector types in model", decl);
-	  free_model(m);
 	  return NULL;
 	}
       }
@@ -2104,7 +2495,6 @@ make_model(dtd_parser *p, const ichar *decl, const ichar **end)
 
     *m = *sub;
     m->cardinality = card;
-    sgml_free(sub);
   }
 
 out:
@@ -2234,7 +2624,6 @@ itake_el_or_model_element_list(dtd_parser *p,
       nl.list = names;
       nl.size = 0;
       for_elements_in_model(model, add_list_element, &nl);
-      free_model(model);
 
       *n = nl.size;
       return s;
@@ -2252,8 +2641,8 @@ itake_el_or_model_element_list(dtd_parser *p,
 
 
 static void
-add_element_list(dtd_element_list **l, dtd_element *e)
-{ dtd_element_list *n = sgml_calloc(1, sizeof(*n));
+add_element_list(dtd *dtd, dtd_element_list **l, dtd_element *e)
+{ dtd_element_list *n = arena_calloc(&dtd->arena, sizeof(*n));
 
   n->value = e;
 
@@ -2266,7 +2655,7 @@ add_element_list(dtd_element_list **l, dtd_element *e)
 static int
 process_element_declaraction(dtd_parser *p, const ichar *decl)
 { dtd *dtd = p->dtd;
-  ichar buf[MAXDECL];
+  text_buffer buf;
   const ichar *s;
   dtd_symbol *eid[MAXATTELEM];
   dtd_edef *def;
@@ -2274,10 +2663,10 @@ process_element_declaraction(dtd_parser *p, const ichar *decl)
   int i;
 
 					/* expand parameter entities */
-  if ( !expand_pentities(p, decl, ZERO_TERM_LEN,
-			 buf, sizeof(buf)/sizeof(ichar)) )
+  init_text_buffer(&buf);
+  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, &buf) )
     return FALSE;
-  decl = buf;
+  decl = buf.data;
 
   if ( !(s=itake_el_or_model_element_list(p, decl, eid, &en)) )
     return gripe(p, ERC_SYNTAX_ERROR, L"Name or name-group expected", decl);
@@ -2286,18 +2675,15 @@ process_element_declaraction(dtd_parser *p, const ichar *decl)
     return TRUE;			/* 0 elements */
 
   STAT(edefs_decl++);
-  def = new_element_definition(dtd);
+  def = new_element_definition(&dtd->arena);
   for(i=0; i<en; i++)
   { find_element(dtd, eid[i]);
-    if ( eid[i]->element->structure )
-    { if ( eid[i]->element->structure->type != C_EMPTY )
-	gripe(p, ERC_SYNTAX_WARNING, L"Redefined element", decl);
-      free_element_definition(eid[i]->element->structure);
-    }
+    if ( eid[i]->element->structure &&
+	 eid[i]->element->structure->type != C_EMPTY )
+      gripe(p, ERC_SYNTAX_WARNING, L"Redefined element", decl);
     eid[i]->element->structure = def;
     eid[i]->element->undefined = FALSE;
   }
-  def->references = en;			/* for GC */
 
 					/* omitted tag declarations (opt) */
   if ( (s = isee_identifier(dtd, decl, "-")) )
@@ -2341,7 +2727,7 @@ process_element_declaraction(dtd_parser *p, const ichar *decl)
       decl = s;
 
       for(i=0; i<ns; i++)
-	add_element_list(l, find_element(dtd, ng[i]));
+	add_element_list(dtd, l, find_element(dtd, ng[i]));
     } else
     { return gripe(p, ERC_SYNTAX_ERROR, L"Name group expected", decl);
     }
@@ -2355,8 +2741,8 @@ process_element_declaraction(dtd_parser *p, const ichar *decl)
 
 
 static void
-add_name_list(dtd_name_list **nl, dtd_symbol *s)
-{ dtd_name_list *n = sgml_calloc(1, sizeof(*n));
+add_name_list(dtd *dtd, dtd_name_list **nl, dtd_symbol *s)
+{ dtd_name_list *n = arena_calloc(&dtd->arena, sizeof(*n));
 
   n->value = s;
 
@@ -2402,34 +2788,86 @@ add_attribute(dtd_parser *p, dtd_element *e, dtd_attr *a)
   for(l = &e->attributes; *l; l = &(*l)->next)
   { if ( (*l)->attribute->name == a->name )
     { gripe(p, ERC_REDEFINED, L"attribute", a->name);
-      a->references++;			/* attempt to redefine attribute: */
-      free_attribute(a);		/* first wins according to standard */
-
-      return;
+      return;				/* first wins according to standard */
     }
   }
 
-  n = sgml_calloc(1, sizeof(*n));
+  n = arena_calloc(&p->dtd->arena, sizeof(*n));
 
   n->attribute = a;
-  a->references++;
   *l = n;
+  if ( e->attr_index )
+  { index_attribute(&p->dtd->arena, e->attr_index, a);
+    if ( a->def == AT_FIXED || a->def == AT_DEFAULT )
+      index_default_values(p->dtd, e->attr_index);
+  }
   set_element_properties(e, a);
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+implicit_attribute() defines an attribute  that   is  used  in the document
+but not declared as CDATA #IMPLIED.  On a frozen DTD the definition is
+kept in the overlay of the parser.  find_implicit_attribute() finds such
+a definition.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static dtd_attr *
+find_implicit_attribute(dtd_parser *p, dtd_element *e, dtd_symbol *name)
+{ overlay_attr *oa;
+
+  if ( !p->overlay )
+    return NULL;
+
+  for(oa=p->overlay->attributes; oa; oa=oa->next)
+  { if ( oa->element == e && oa->attribute->name == name )
+      return oa->attribute;
+  }
+
+  return NULL;
+}
+
+
+static dtd_attr *
+implicit_attribute(dtd_parser *p, dtd_element *e, dtd_symbol *name)
+{ dtd_attr *a;
+
+  if ( p->dtd->frozen )
+  { dtd_overlay *o = parser_overlay(p);
+    overlay_attr *oa = arena_calloc(&o->arena, sizeof(*oa));
+
+    a = arena_calloc(&o->arena, sizeof(*a));
+    oa->element = e;
+    oa->attribute = a;
+    oa->next = o->attributes;
+    o->attributes = oa;
+  } else
+  { a = arena_calloc(&p->dtd->arena, sizeof(*a));
+  }
+
+  a->name = name;
+  a->type = AT_CDATA;
+  a->def  = AT_IMPLIED;
+  if ( !p->dtd->frozen )
+    add_attribute(p, e, a);
+
+  return a;
+}
+
+
 static int
 process_attlist_declaraction(dtd_parser *p, const ichar *decl)
 { dtd *dtd = p->dtd;
   dtd_symbol *eid[MAXATTELEM];
   int i, en;
-  ichar buf[MAXDECL];
+  text_buffer buf;
   const ichar *s;
 
 					/* expand parameter entities */
-  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, buf, sizeof(buf)/sizeof(ichar)) )
+  init_text_buffer(&buf);
+  if ( !expand_pentities(p, decl, ZERO_TERM_LEN, &buf) )
     return FALSE;
-  decl = iskip_layout(dtd, buf);
+  decl = iskip_layout(dtd, buf.data);
   DEBUG(printf("Expanded to %s\n", decl));
 
   if ( !(decl=itake_el_or_model_element_list(p, decl, eid, &en)) )
@@ -2437,14 +2875,11 @@ process_attlist_declaraction(dtd_parser *p, const ichar *decl)
 
 					/* fetch attributes */
   while(*decl)
-  { dtd_attr *at = sgml_calloc(1, sizeof(*at));
-    at->references = REFS_VIRGIN;
+  { dtd_attr *at = arena_calloc(&dtd->arena, sizeof(*at));
 
 					/* name of attribute */
     if ( !(s = itake_name(p, decl, &at->name)) )
-    { free_attribute(at);
       return gripe(p, ERC_SYNTAX_ERROR, L"Name expected", decl);
-    }
     decl = s;
 
 					/* (name1|name2|...) type */
@@ -2458,11 +2893,9 @@ process_attlist_declaraction(dtd_parser *p, const ichar *decl)
       { dtd_symbol *nm;
 
 	if ( !(s = itake_nmtoken(p, decl, &nm)) )
-	{ free_attribute(at);
 	  return gripe(p, ERC_SYNTAX_ERROR, L"Name expected", decl);
-	}
 	decl = s;
-	add_name_list(&at->typeex.nameof, nm);
+	add_name_list(dtd, &at->typeex.nameof, nm);
 	if ( (s=isee_ngsep(dtd, decl, &ngs)) )
 	{ decl = s;
 	  continue;
@@ -2472,7 +2905,6 @@ process_attlist_declaraction(dtd_parser *p, const ichar *decl)
 	  decl = iskip_layout(dtd, decl);
 	  break;
 	}
-	free_attribute(at);
 	return gripe(p, ERC_SYNTAX_ERROR, L"Illegal name-group", decl);
       }
     } else if ( (s=isee_identifier(dtd, decl, "cdata")) )
@@ -2533,15 +2965,11 @@ process_attlist_declaraction(dtd_parser *p, const ichar *decl)
       { decl = s;
 
 	for(i=0; i<ns; i++)
-	  add_name_list(&at->typeex.nameof, ng[i]);
+	  add_name_list(dtd, &at->typeex.nameof, ng[i]);
       } else
-      { free_attribute(at);
 	return gripe(p, ERC_SYNTAX_ERROR, L"name-group expected", decl);
-      }
     } else
-    { free_attribute(at);
       return gripe(p, ERC_SYNTAX_ERROR, L"Attribute-type expected", decl);
-    }
 
 					/* Attribute Defaults */
     if ( (s=isee_identifier(dtd, decl, "#fixed")) )
@@ -2563,14 +2991,15 @@ process_attlist_declaraction(dtd_parser *p, const ichar *decl)
       at->def = AT_DEFAULT;
 
     if ( at->def == AT_DEFAULT || at->def == AT_FIXED )
-    { ichar buf[MAXSTRINGLEN];
+    { text_buffer buf;
       ichar *start; int len;
       const ichar *end;
 
       if ( !(end=itake_string(dtd, decl, &start, &len)) )
-      { end=itake_nmtoken_chars(p, decl, buf, sizeof(buf)/sizeof(ichar));
-	start = buf;
-	len = (int)istrlen(buf);
+      { init_text_buffer(&buf);
+	end=itake_nmtoken_chars(p, decl, &buf);
+	start = buf.data;
+	len = (int)buf.size;
       }
       if ( !end )
 	return gripe(p, ERC_SYNTAX_ERROR, L"Bad attribute default", decl);
@@ -2584,7 +3013,7 @@ length of the parsed data to verify we parsed all of it.
 
       switch(at->type)
       { case AT_CDATA:
-	{ at->att_def.cdata = istrndup(start, len);
+	{ at->att_def.cdata = arena_istrndup(&dtd->arena, start, len);
 	  break;
 	}
 	case AT_ENTITY:
@@ -2620,20 +3049,17 @@ length of the parsed data to verify we parsed all of it.
 	case AT_NMTOKENS:
 	case AT_NUMBERS:
 	case AT_NUTOKENS:
-	{ at->att_def.list = istrndup(buf, len);
+	{ at->att_def.list = arena_istrndup(&dtd->arena, start, len);
 	  break;
 	}
 	default:
-	{ free_attribute(at);
 	  return gripe(p, ERC_REPRESENTATION, L"No default for type");
-	}
       }
 
       decl = end;
     }
 
 					/* add to list */
-    at->references = 0;
     for(i=0; i<en; i++)
     { dtd_element *e = def_element(dtd, eid[i]);
 
@@ -2682,9 +3108,7 @@ complete(sgml_environment *env)
 { if ( env->element->structure &&
        !env->element->undefined &&
        env->element->structure->type != C_ANY )
-  { dtd_edef *def = env->element->structure;
-
-    if ( !same_state(def->final_state, env->state) )
+  { if ( !state_is_final(env->state) )
       return FALSE;
   }
 
@@ -2695,12 +3119,14 @@ complete(sgml_environment *env)
 static void
 validate_completeness(dtd_parser *p, sgml_environment *env)
 { if ( !complete(env) )
-  { wchar_t buf[MAXNMLEN+50];
+  { size_t len = istrlen(env->element->name->name)+50;
+    wchar_t *buf = sgml_malloc(len*sizeof(wchar_t));
 
-    swprintf(buf, MAXNMLEN+50, L"Incomplete element: <%s>",
+    swprintf(buf, len, L"Incomplete element: <%s>",
 	     env->element->name->name);
 
     gripe(p, ERC_VALIDATE, buf);		/* TBD: expected */
+    sgml_free(buf);
   }
 }
 
@@ -2708,12 +3134,18 @@ validate_completeness(dtd_parser *p, sgml_environment *env)
 static sgml_environment *
 push_element(dtd_parser *p, dtd_element *e, int callback)
 { if ( e != CDATA_ELEMENT )
-  { sgml_environment *env = sgml_calloc(1, sizeof(*env));
+  { sgml_environment *env;
+
+    if ( (env=p->free_environments) )
+      p->free_environments = env->parent;
+    else
+      env = arena_alloc(&p->arena, sizeof(*env));
+    memset(env, 0, sizeof(*env));
 
     emit_cdata(p, FALSE);
 
     env->element = e;
-    env->state = make_state_engine(e);
+    env->state = make_state_engine(p->dtd, e);
     env->space_mode = (p->environments ? p->environments->space_mode
 				       : p->dtd->space_mode);
     env->parent = p->environments;
@@ -2739,11 +3171,8 @@ push_element(dtd_parser *p, dtd_element *e, int callback)
 
     p->first = TRUE;
     if ( callback && p->on_begin_element )
-    { sgml_attribute atts[MAXATTRIBUTES];
-      int natts = 0;
-
-      if ( !(p->flags & SGML_PARSER_NODEFS) )
-	natts = add_default_attributes(p, e, natts, atts);
+    { int natts;
+      sgml_attribute *atts = default_attributes(p, e, &natts);
 
       (*p->on_begin_element)(p, e, natts, atts);
     }
@@ -2766,14 +3195,32 @@ push_element(dtd_parser *p, dtd_element *e, int callback)
 
 
 static void
-free_environment(sgml_environment *env)
+free_environment(dtd_parser *p, sgml_environment *env)
 {
 #ifdef XMLNS
   if ( env->xmlns )
-    xmlns_free(env->xmlns);
+    xmlns_release(p, env->xmlns);
 #endif
 
-  sgml_free(env);
+  env->parent = p->free_environments;
+  p->free_environments = env;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+empty_document_arena() discards all  per-document   objects  at  once.
+Environments and their xmlns declarations   are  allocated from p->arena
+and recycled through free-lists while the document is being parsed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+empty_document_arena(dtd_parser *p)
+{ p->environments = NULL;
+  p->free_environments = NULL;
+#ifdef XMLNS
+  p->free_xmlns = NULL;
+#endif
+  empty_arena(&p->arena);
 }
 
 
@@ -2806,7 +3253,7 @@ pop_to(dtd_parser *p, sgml_environment *to, dtd_element *e0)
     WITH_CLASS(p, EV_OMITTED,
 	       if ( p->on_end_element )
 	         (*p->on_end_element)(p, e));
-    free_environment(env);
+    free_environment(p, env);
   }
   p->environments = to;
   p->map = to->map;
@@ -2816,13 +3263,13 @@ pop_to(dtd_parser *p, sgml_environment *to, dtd_element *e0)
 
 
 static void
-allow_for(dtd_element *in, dtd_element *e)
+allow_for(dtd *dtd, dtd_element *in, dtd_element *e)
 { dtd_edef *def = in->structure;
   dtd_model *g;
 
   if ( def->type == C_EMPTY )
   { def->type = C_PCDATA;
-    def->content = sgml_calloc(1, sizeof(*def->content));
+    def->content = arena_calloc(&dtd->arena, sizeof(*def->content));
     def->content->type = MT_OR;
     def->content->cardinality = MC_REP;
   }
@@ -2837,7 +3284,7 @@ allow_for(dtd_element *in, dtd_element *e)
     { if ( g->type == MT_PCDATA )
 	return;
     }
-    m = sgml_calloc(1, sizeof(*m));
+    m = arena_calloc(&dtd->arena, sizeof(*m));
     m->type	   = MT_PCDATA;
     m->cardinality = MC_ONE;		/* ignored */
     add_submodel(def->content, m);
@@ -2848,7 +3295,7 @@ allow_for(dtd_element *in, dtd_element *e)
     { if ( g->type == MT_ELEMENT && g->content.element == e )
 	return;
     }
-    m = sgml_calloc(1, sizeof(*m));
+    m = arena_calloc(&dtd->arena, sizeof(*m));
     m->type	   = MT_ELEMENT;
     m->cardinality = MC_ONE;		/* ignored */
     m->content.element = e;
@@ -2871,11 +3318,8 @@ open_element(dtd_parser *p, dtd_element *e, int warn)
       WITH_CLASS(p, EV_OMITTED,
 		 { open_element(p, f, TRUE);
 		   if ( p->on_begin_element )
-		   { sgml_attribute atts[MAXATTRIBUTES];
-		     int natts = 0;
-
-		     if ( !(p->flags & SGML_PARSER_NODEFS) )
-		       natts = add_default_attributes(p, f, natts, atts);
+		   { int natts;
+		     sgml_attribute *atts = default_attributes(p, f, &natts);
 
 		     (*p->on_begin_element)(p, f, natts, atts);
 		   }
@@ -2884,7 +3328,8 @@ open_element(dtd_parser *p, dtd_element *e, int warn)
   }
 
 					/* no DTD available yet */
-  if ( !p->environments && !p->dtd->doctype && e != CDATA_ELEMENT )
+  if ( !p->environments && !p->dtd->doctype && !p->dtd->frozen &&
+       e != CDATA_ELEMENT )
   { const ichar *file;
 
     file = find_in_catalogue(CAT_DOCTYPE, e->name->name, NULL, NULL,
@@ -2908,7 +3353,8 @@ open_element(dtd_parser *p, dtd_element *e, int warn)
   { sgml_environment *env = p->environments;
 
     if ( env->element->undefined )
-    { allow_for(env->element, e);	/* <!ELEMENT x - - (model) +(y)> */
+    { if ( !p->dtd->frozen )
+	allow_for(p->dtd, env->element, e);	/* <!ELEMENT x - - (model) +(y)> */
       push_element(p, e, FALSE);
       return TRUE;
     }
@@ -2943,7 +3389,7 @@ open_element(dtd_parser *p, dtd_element *e, int warn)
 	    int olen;
 	    int i;
 
-	    if ( (olen=find_omitted_path(env->state, e, oe)) > 0 )
+	    if ( (olen=find_omitted_path(p->dtd, env->state, e, oe)) > 0 )
 	    { pop_to(p, env, e);
 	      WITH_CLASS(p, EV_OMITTED,
 	      for(i=0; i<olen; i++)
@@ -2998,7 +3444,7 @@ close_element(dtd_parser *p, dtd_element *e, int conref)
 	p->first = FALSE;
 	if ( p->on_end_element )
 	  (*p->on_end_element)(p, env->element);
-	free_environment(env);
+	free_environment(p, env);
 	p->environments = parent;
 
 	if ( ce == e )			/* closing current element */
@@ -3076,8 +3522,7 @@ not yet been fixed.
 
 static ichar const *
 get_attribute_value(dtd_parser *p, ichar const *decl, sgml_attribute *att)
-{ ichar tmp[MAXSTRINGLEN];
-  ichar *buf = tmp;
+{ ichar *buf;
   ichar const *s;
   ichar c;
   dtd *dtd = p->dtd;
@@ -3106,16 +3551,17 @@ get_attribute_value(dtd_parser *p, ichar const *decl, sgml_attribute *att)
     expand_entities(p, start, len, &out);
 
     if ( att->definition->type == AT_CDATA )
-    { malloc_ocharbuf(&out);
-
-      att->value.number = out.size;
-      att->value.textW  = out.data.w;
+    { att->value.number = out.size;
+      att->value.textW  = arena_istrndup(&p->value_arena,
+					 wide_ocharbuf(&out), out.size);
+      discard_ocharbuf(&out);
 
       return end;
     } else
     { ichar *d;
 
-      buf = out.data.w;
+      buf = arena_istrndup(&p->value_arena, wide_ocharbuf(&out), out.size);
+      discard_ocharbuf(&out);
 
       /* canonicalise blanks */
       s = buf;
@@ -3148,9 +3594,12 @@ get_attribute_value(dtd_parser *p, ichar const *decl, sgml_attribute *att)
       *d = '\0';
     }
   } else
-  { end = itake_unquoted(p, decl, tmp, sizeof(tmp)/sizeof(ichar));
+  { ichar const *text;
+
+    end = itake_unquoted(p, decl, &text, &len);
     if (end == NULL)
       return NULL;
+    buf = arena_istrndup(&p->value_arena, text, len);
 
     s = buf;
     c = *s++;
@@ -3176,12 +3625,12 @@ get_attribute_value(dtd_parser *p, ichar const *decl, sgml_attribute *att)
       } else if (dtd->number_mode == NU_INTEGER)
       { (void) istrtol(buf, &att->value.number);
       } else
-      { att->value.textW  = istrdup(buf);
+      { att->value.textW  = buf;
 	att->value.number = (long)istrlen(buf);
       }
       return end;
     case AT_CDATA:		/* CDATA attribute */
-      att->value.textW  = istrdup(buf);
+      att->value.textW  = buf;
       att->value.number = (long)istrlen(buf);
       return end;
     case AT_ID:		/* identifier */
@@ -3244,18 +3693,47 @@ get_attribute_value(dtd_parser *p, ichar const *decl, sgml_attribute *att)
       return NULL;
   }
 
-passed:
-  att->value.textW  = istrdup(buf);	/* TBD: more validation */
+passed:					/* TBD: more validation */
+  att->value.textW  = buf;
   att->value.number = (long)istrlen(buf);
   return end;
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The attributes of a begin-tag are collected in an attribute_vector. This
+starts on the stack of process_begin_element(). If   a tag has more
+attributes, the vector is moved to the value arena of the parser, which
+is released with the attribute values after the tag has been processed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+init_attribute_vector(attribute_vector *v)
+{ v->size = 0;
+  v->allocated = INLINE_ATTRIBUTES;
+  v->atts = v->local;
+}
+
+
+static sgml_attribute *
+next_attribute(dtd_parser *p, attribute_vector *v)
+{ if ( v->size == v->allocated )
+  { sgml_attribute *new = arena_alloc(&p->value_arena,
+				      v->allocated*2*sizeof(*new));
+
+    memcpy(new, v->atts, v->size*sizeof(*new));
+    v->atts = new;
+    v->allocated *= 2;
+  }
+
+  return &v->atts[v->size];
+}
+
+
 static const ichar *
 process_attributes(dtd_parser *p, dtd_element *e, const ichar *decl,
-		   sgml_attribute *atts, int *argc)
-{ int attn = 0;
-  dtd *dtd = p->dtd;
+		   attribute_vector *v)
+{ dtd *dtd = p->dtd;
 
   decl = iskip_layout(dtd, decl);
   while(decl && *decl)
@@ -3267,19 +3745,16 @@ process_attributes(dtd_parser *p, dtd_element *e, const ichar *decl,
 
       if ( (s=isee_func(dtd, decl, CF_VI)) ) /* name= */
       { dtd_attr *a;
+	sgml_attribute *att;
 
 	if ( !HasClass(dtd, nm->name[0], CH_NMSTART) )
 	  gripe(p, ERC_SYNTAX_WARNING,
 		"Illegal start of attribute-name", decl);
 
 	decl = s;
-	if ( !(a=find_attribute(e, nm)) )
-	{ a = sgml_calloc(1, sizeof(*a));
-
-	  a->name = nm;
-	  a->type = AT_CDATA;
-	  a->def  = AT_IMPLIED;
-	  add_attribute(p, e, a);
+	if ( !(a=find_attribute(dtd, e, nm)) &&
+	     !(dtd->frozen && (a=find_implicit_attribute(p, e, nm))) )
+	{ a = implicit_attribute(p, e, nm);
 
 	  if ( !e->undefined &&
 	       !(IS_XML_DIALECT(dtd->dialect) &&
@@ -3289,9 +3764,10 @@ process_attributes(dtd_parser *p, dtd_element *e, const ichar *decl,
 		 istrprefix(L"data-", nm->name)) )
 	    gripe(p, ERC_NO_ATTRIBUTE, e->name->name, nm->name);
 	}
-	atts[attn].definition = a;
-	if ( (decl=get_attribute_value(p, decl, atts+attn)) )
-	{ attn++;
+	att = next_attribute(p, v);
+	att->definition = a;
+	if ( (decl=get_attribute_value(p, decl, att)) )
+	{ v->size++;
 	  continue;
 	}
       } else if ( e->structure )
@@ -3305,14 +3781,16 @@ process_attributes(dtd_parser *p, dtd_element *e, const ichar *decl,
 
 	    for(nl=a->typeex.nameof; nl; nl = nl->next)
 	    { if ( nl->value == nm )
-	      { if ( IS_XML_DIALECT(dtd->dialect) )
+	      { sgml_attribute *att = next_attribute(p, v);
+
+		if ( IS_XML_DIALECT(dtd->dialect) )
 		  gripe(p, ERC_SYNTAX_WARNING,
 			"Value short-hand in XML mode", decl);
-		atts[attn].flags	= 0;
-		atts[attn].definition   = a;
-		atts[attn].value.textW  = istrdup(nm->name);
-		atts[attn].value.number = (long)istrlen(nm->name);
-		attn++;
+		att->flags	  = 0;
+		att->definition   = a;
+		att->value.textW  = arena_istrdup(&p->value_arena, nm->name);
+		att->value.number = (long)istrlen(nm->name);
+		v->size++;
 		goto next;
 	      }
 	    }
@@ -3325,103 +3803,68 @@ process_attributes(dtd_parser *p, dtd_element *e, const ichar *decl,
 	decl = s;
       }
     } else
-    { *argc = attn;
       return decl;
-    }
 
   next:
     ;
   }
 
-  *argc = attn;
   return decl;
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-sgml_add_default_attributes()
+default_attributes()
 
-This function adds attributes for omitted  default and fixed attributes.
-These attributes are added to  the  end   of  the  attribute  list. This
-function returns the new  number  of   attributes.  The  `atts' array is
-assumed   to   be   MAXATTRIBUTES    long,     normally    passed   from
-process_begin_element.
+Returns the template  of  default  and   fixed  attributes  of  e  (see
+index_default_values()) and its length  in   *natts.  The template is
+passed unmodified to on_begin_element() for elements without a begin-tag.
+Returns no attributes if SGML_PARSER_NODEFS is set.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static int
-add_default_attributes(dtd_parser *p, dtd_element *e,
-		       int natts, sgml_attribute *atts)
-{ dtd_attr_list *al;
-
-  if ( e == CDATA_ELEMENT )
-    return natts;
-
-  for(al=e->attributes; al; al=al->next)
-  { dtd_attr *a = al->attribute;
-
-    switch(a->def)
-    { case AT_REQUIRED:			/* TBD: check if present */
-      case AT_CURRENT:			/* TBD: register in DTD and reuse */
-      case AT_CONREF:
-      case AT_IMPLIED:
-	goto next;
-      case AT_FIXED:
-      case AT_DEFAULT:
-      { int i;
-	sgml_attribute *ap;
-
-	for(i=0, ap=atts; i<natts; i++, ap++)
-	{ if ( ap->definition == a )
-	    goto next;
-	}
-
-        ap->definition   = a;
-	ap->value.textW  = NULL;
-	ap->value.number = 0;
-	ap->flags        = SGML_AT_DEFAULT;
-
-	switch(a->type)
-	{ case AT_CDATA:
-	    ap->value.textW = a->att_def.cdata;
-	    ap->value.number = (long)istrlen(ap->value.textW);
-	    break;
-	  case AT_NUMBER:
-	    if ( p->dtd->number_mode == NU_TOKEN )
-	    { ap->value.textW  = (ichar*)a->att_def.name->name;
-	      ap->value.number = (long)istrlen(ap->value.textW);
-	    } else
-	    { ap->value.number = a->att_def.number;
-	    }
-	    break;
-	  default:
-	    if ( a->islist )
-	    { ap->value.textW = a->att_def.list;
-	    } else
-	    { ap->value.textW = (ichar*)a->att_def.name->name;
-	    }
-	    ap->value.number = (long)istrlen(ap->value.textW);
-	}
+static sgml_attribute *
+default_attributes(dtd_parser *p, dtd_element *e, int *natts)
+{ dtd_attr_index *ix;
 
-	natts++;
-      }
-    }
-  next:;
+  if ( (p->flags & SGML_PARSER_NODEFS) ||
+       e == CDATA_ELEMENT || !(ix=attribute_index(p->dtd, e)) )
+  { *natts = 0;				/* overlay elements have no defaults */
+    return NULL;
   }
+  if ( ix->number_mode != p->dtd->number_mode && !p->dtd->frozen )
+    index_default_values(p->dtd, ix);
 
-  return natts;
+  *natts = ix->ndefaults;
+  return ix->default_values;
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+add_default_attributes()
+
+This function adds attributes for omitted  default and fixed attributes.
+These attributes are added to the end of the attribute vector.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static void
-free_attribute_values(int argc, sgml_attribute *argv)
-{ int i;
+add_default_attributes(dtd_parser *p, dtd_element *e, attribute_vector *v)
+{ sgml_attribute *dv;
+  int i, ndefs;
+  int natts = v->size;
+
+  if ( !(dv=default_attributes(p, e, &ndefs)) )
+    return;
 
-  for(i=0; i<argc; i++, argv++)
-  { if ( (argv->flags & SGML_AT_DEFAULT) )
-      continue;				/* shared with the DTD */
+  for(i=0; i<ndefs; i++, dv++)
+  { int j;
 
-    if ( argv->value.textW )
-      sgml_free(argv->value.textW);
+    for(j=0; j<natts; j++)
+    { if ( v->atts[j].definition == dv->definition )
+	goto next;
+    }
+    *next_attribute(p, v) = *dv;
+    v->size++;
+  next:;
   }
 }
 
@@ -3433,9 +3876,9 @@ process_begin_element(dtd_parser *p, const ichar *decl)
   const ichar *s;
 
   if ( (s=itake_name(p, decl, &id)) )
-  { sgml_attribute atts[MAXATTRIBUTES];
-    int natts;
-    dtd_element *e = find_element(dtd, id);
+  { attribute_vector atts;
+    arena_mark values;
+    dtd_element *e = document_element(p, id);
     int empty = FALSE;
     int conref = FALSE;
     int rc = TRUE;
@@ -3452,7 +3895,9 @@ process_begin_element(dtd_parser *p, const ichar *decl)
     open_element(p, e, TRUE);
 
     decl=s;
-    if ( (s=process_attributes(p, e, decl, atts, &natts)) )
+    mark_arena(&p->value_arena, &values);
+    init_attribute_vector(&atts);
+    if ( (s=process_attributes(p, e, decl, &atts)) )
       decl=s;
 
     if ( IS_XML_DIALECT(dtd->dialect) )
@@ -3462,9 +3907,9 @@ process_begin_element(dtd_parser *p, const ichar *decl)
       }
 #ifdef XMLNS
       if ( dtd->dialect == DL_XMLNS )
-	update_xmlns(p, e, natts, atts);
+	update_xmlns(p, e, atts.size, atts.atts);
 #endif
-      update_space_mode(p, e, natts, atts);
+      update_space_mode(p, e, atts.size, atts.atts);
     } else				/* SGML, HTML */
     { int i;
 
@@ -3476,8 +3921,8 @@ process_begin_element(dtd_parser *p, const ichar *decl)
 	decl = s;
       }
 
-      for(i=0; i<natts; i++)
-      { if ( atts[i].definition->def == AT_CONREF )
+      for(i=0; i<atts.size; i++)
+      { if ( atts.atts[i].definition->def == AT_CONREF )
 	{ empty = TRUE;
 	  conref = TRUE;
 	}
@@ -3486,8 +3931,7 @@ process_begin_element(dtd_parser *p, const ichar *decl)
     if ( *decl )
       gripe(p, ERC_SYNTAX_ERROR, L"Bad attribute list", decl);
 
-    if ( !(p->flags & SGML_PARSER_NODEFS) )
-      natts = add_default_attributes(p, e, natts, atts);
+    add_default_attributes(p, e, &atts);
 
     if ( empty ||
 	 (IS_SGML_DIALECT(dtd->dialect) &&
@@ -3499,9 +3943,9 @@ process_begin_element(dtd_parser *p, const ichar *decl)
       p->empty_element = NULL;
 
     if ( p->on_begin_element )
-      rc = (*p->on_begin_element)(p, e, natts, atts);
+      rc = (*p->on_begin_element)(p, e, atts.size, atts.atts);
 
-    free_attribute_values(natts, atts);
+    release_arena(&p->value_arena, &values); /* free attribute values */
 
     if ( p->empty_element )
     { p->empty_element = NULL;
@@ -3519,13 +3963,12 @@ process_begin_element(dtd_parser *p, const ichar *decl)
 
 static int
 process_end_element(dtd_parser *p, const ichar *decl)
-{ dtd *dtd = p->dtd;
-  dtd_symbol *id;
+{ dtd_symbol *id;
   const ichar *s;
 
   emit_cdata(p, TRUE);
   if ( (s=itake_name(p, decl, &id)) && *s == '\0' )
-    return close_element(p, find_element(dtd, id), FALSE);
+    return close_element(p, document_element(p, id), FALSE);
 
   if ( p->dtd->shorttag && *decl == '\0' ) /* </>: close current element */
     return close_current_element(p);
@@ -3560,7 +4003,7 @@ process_net(dtd_parser *p)
 		   (*p->on_end_element)(p, env->element));
       }
 
-      free_environment(env);
+      free_environment(p, env);
       p->environments = parent;
       p->map = (parent ? parent->map : NULL);
 
@@ -3572,6 +4015,27 @@ process_net(dtd_parser *p)
 }
 
 
+/* writable_dtd() makes the DTD of p writable  for processing the DOCTYPE
+   declaration.  *id is the doctype name, which must be a symbol of the
+   new DTD.
+*/
+
+static int
+writable_dtd(dtd_parser *p, dtd_symbol **id)
+{ if ( !p->dtd->frozen )
+    return TRUE;
+
+  if ( unshare_dtd_parser(p) )
+  { *id = dtd_add_symbol(p->dtd, (*id)->name);
+    return TRUE;
+  }
+
+  gripe(p, ERC_SYNTAX_WARNING,
+	L"DOCTYPE declaration ignored by shared DTD", NULL);
+  return FALSE;
+}
+
+
 static int				/* <!DOCTYPE ...> */
 process_doctype(dtd_parser *p, const ichar *decl, const ichar *decl0)
 { dtd *dtd = p->dtd;
@@ -3602,9 +4066,11 @@ process_doctype(dtd_parser *p, const ichar *decl, const ichar *decl0)
     decl = s;
   }
 
-  if ( !dtd->doctype )			/* i.e. anonymous DTD */
+  if ( !dtd->doctype && writable_dtd(p, &id) ) /* i.e. anonymous DTD */
   { ichar *file;
 
+    dtd = p->dtd;
+
     dtd->doctype = istrdup(id->name);	/* Fill it */
     if ( et )
       file = entity_file(dtd, et);
@@ -3629,7 +4095,8 @@ process_doctype(dtd_parser *p, const ichar *decl, const ichar *decl0)
     free_entity_list(et);
 
 local:
-  if ( (s=isee_func(dtd, decl, CF_DSO)) ) /* [...] */
+  if ( (s=isee_func(dtd, decl, CF_DSO)) && /* [...] */
+       writable_dtd(p, &id) )
   { int grouplevel = 1;
     data_mode oldmode   = p->dmode;
     dtdstate  oldstate  = p->state;
@@ -3689,14 +4156,13 @@ local:
 
 
 static void
-init_decoding(dtd_parser *p)
+init_decoding(dtd_parser *p, dtd_char_encoding encoding)
 {
 #ifdef UTF8
   int decode;
-  dtd *dtd = p->dtd;
 
-  if ( dtd->encoding == SGML_ENC_UTF8 &&
-       p->encoded    == TRUE )
+  if ( encoding   == SGML_ENC_UTF8 &&
+       p->encoded == TRUE )
     decode = TRUE;
   else
     decode = FALSE;
@@ -3737,17 +4203,25 @@ posix_strcasecmp(const char *s1, const char *s2)
 int
 xml_set_encoding(dtd_parser *p, const char *enc)
 { dtd *dtd = p->dtd;
+  dtd_char_encoding encoding;
 
   if ( posix_strcasecmp(enc, "iso-8859-1") == 0 )
-  { dtd->encoding = SGML_ENC_ISO_LATIN1;
+  { encoding = SGML_ENC_ISO_LATIN1;
   } else if ( posix_strcasecmp(enc, "us-ascii") == 0 )
-  { dtd->encoding = SGML_ENC_ISO_LATIN1;	/* doesn't make a difference */
+  { encoding = SGML_ENC_ISO_LATIN1;	/* doesn't make a difference */
   } else if ( posix_strcasecmp(enc, "utf-8") == 0 )
-  { dtd->encoding = SGML_ENC_UTF8;
+  { encoding = SGML_ENC_UTF8;
   } else
     return FALSE;
 
-  init_decoding(p);
+  if ( dtd->frozen )			/* only for this parser */
+  { dtd_overlay *o = parser_overlay(p);
+
+    o->has_encoding = TRUE;
+    o->encoding = encoding;
+  } else
+    dtd->encoding = encoding;
+  init_decoding(p, encoding);
   return TRUE;
 }
 
@@ -3792,17 +4266,21 @@ process_pi(dtd_parser *p, const ichar *decl)
   dtd *dtd = p->dtd;
 
   if ( (s=isee_identifier(dtd, decl, "xml")) ) /* <?xml version="1.0"?> */
-  { decl = s;
+  { dtd_dialect dialect = dtd->dialect;
+    arena_mark m;
+
+    decl = s;
+    mark_arena(&p->value_arena, &m);
 
     switch(dtd->dialect)
     { case DL_SGML:
-	set_dialect_dtd(dtd, DL_XML);
+	dialect = DL_XML;
         break;
       case DL_HTML:
-	set_dialect_dtd(dtd, DL_XHTML);
+	dialect = DL_XHTML;
         break;
       case DL_HTML5:
-	set_dialect_dtd(dtd, DL_XHTML5);
+	dialect = DL_XHTML5;
         break;
       case DL_XHTML:
       case DL_XHTML5:
@@ -3810,6 +4288,14 @@ process_pi(dtd_parser *p, const ichar *decl)
       case DL_XMLNS:
 	break;
     }
+    if ( dialect != dtd->dialect )
+    { if ( unshare_dtd_parser(p) )
+      { dtd = p->dtd;
+	set_dialect_dtd(dtd, dialect);
+      } else
+	gripe(p, ERC_SYNTAX_WARNING,
+	      L"Cannot switch the dialect of a shared DTD", NULL);
+    }
 
     while(*decl)
     { dtd_symbol *nm;
@@ -3818,13 +4304,14 @@ process_pi(dtd_parser *p, const ichar *decl)
 	   (s=isee_func(dtd, s, CF_VI)) )		/* = */
       { ichar *start;
 	int len;
-	ichar buf[MAXSTRINGLEN];
+	text_buffer buf;
 	const ichar *end;
 
 	if ( !(end=itake_string(dtd, s, &start, &len)) )
-	{ end=itake_nmtoken_chars(p, s, buf, sizeof(buf)/sizeof(ichar));
-	  start = buf;
-	  len = (int)istrlen(buf);
+	{ init_text_buffer(&buf);
+	  end=itake_nmtoken_chars(p, s, &buf);
+	  start = buf.data;
+	  len = (int)buf.size;
 	}
 
 	if ( end )
@@ -3852,6 +4339,7 @@ process_pi(dtd_parser *p, const ichar *decl)
       gripe(p, ERC_SYNTAX_ERROR, L"Illegal XML parameter", decl);
       break;
     }
+    release_arena(&p->value_arena, &m);
 
     return TRUE;
   }
@@ -3883,11 +4371,21 @@ process_declaration(dtd_parser *p, const ichar *decl)
   }
 
   if ( (s=isee_func(dtd, decl, CF_MDO2)) ) /* <! ... >*/
-  { decl = s;
+  { arena_mark m;
+
+    decl = s;
 
     if ( p->on_decl )
       (*p->on_decl)(p, decl);
 
+    if ( dtd->frozen && !isee_identifier(dtd, decl, "doctype") )
+    { if ( !unshare_dtd_parser(p) )
+	return gripe(p, ERC_SYNTAX_WARNING,
+		     L"Declaration ignored by shared DTD", decl);
+      dtd = p->dtd;
+    }
+
+    mark_arena(&p->value_arena, &m);	/* for long declarations */
     if ( (s = isee_identifier(dtd, decl, "entity")) )
       process_entity_declaration(p, s);
     else if ( (s = isee_identifier(dtd, decl, "element")) )
@@ -3911,6 +4409,7 @@ process_declaration(dtd_parser *p, const ichar *decl)
       if ( *s )
 	gripe(p, ERC_SYNTAX_ERROR, L"Invalid declaration", s);
     }
+    release_arena(&p->value_arena, &m);
 
     return TRUE;
   }
@@ -3927,7 +4426,7 @@ set_file_dtd_parser(dtd_parser *p, input_type type, const ichar *name)
 { p->location.type      = type;
   p->location.name.file = name;
   p->location.line      = 1;
-  p->location.linepos   = 0;
+  p->location.lineoff   = 0;
   p->location.charpos   = 0;
 }
 
@@ -3937,7 +4436,7 @@ set_src_dtd_parser(dtd_parser *p, input_type type, const ichar *name)
 { p->location.type        = type;
   p->location.name.entity = name;
   p->location.line        = 1;
-  p->location.linepos     = 0;
+  p->location.lineoff     = 0;
   p->location.charpos     = 0;
 }
 
@@ -3956,7 +4455,9 @@ new_dtd_parser(dtd *dtd)
 
   if ( !dtd )
     dtd = new_dtd(NULL);
+  LOCK();
   dtd->references++;
+  UNLOCK();
 
   p->magic       = SGML_PARSER_MAGIC;
   p->dtd	 = dtd;
@@ -3966,6 +4467,8 @@ new_dtd_parser(dtd *dtd)
   p->encoded	 = TRUE;		/* encoded octet stream */
   p->buffer	 = new_icharbuf(0);
   p->cdata	 = new_ocharbuf(0);
+  init_arena(&p->arena);
+  init_arena(&p->value_arena);
   p->event_class = EV_EXPLICIT;
   set_src_dtd_parser(p, IN_NONE, NULL);
 
@@ -3978,7 +4481,9 @@ clone_dtd_parser(dtd_parser *p)
 { dtd_parser *clone = sgml_calloc(1, sizeof(*p));
 
   *clone = *p;
+  LOCK();
   clone->dtd->references++;
+  UNLOCK();
   clone->environments =	NULL;
   clone->marked	      =	NULL;
   clone->etag	      =	NULL;
@@ -3988,21 +4493,81 @@ clone_dtd_parser(dtd_parser *p)
   clone->dmode	      =	DM_DTD;
   clone->buffer	      =	new_icharbuf(clone->max_memory);
   clone->cdata	      =	new_ocharbuf(clone->max_memory);
+  init_arena(&clone->arena);
+  init_arena(&clone->value_arena);
+  clone->free_environments = NULL;
+#ifdef XMLNS
+  clone->free_xmlns   =	NULL;
+#endif
+  clone->overlay      = NULL;
+  clone->shared_dtd   = NULL;
+  clone->client_data  = NULL;
 
   return clone;
 }
 
 
-void
-free_dtd_parser(dtd_parser *p)
-{ free_icharbuf(p->buffer);
-  free_ocharbuf(p->cdata);
+void
+free_dtd_parser(dtd_parser *p)
+{ free_icharbuf(p->buffer);
+  free_ocharbuf(p->cdata);
+  free_arena(&p->arena);
+  free_arena(&p->value_arena);
+#ifdef XMLNS
+  xmlns_free(p->xmlns);
+#endif
+  if ( p->overlay )
+    free_overlay(p->overlay);
+  free_dtd(p->dtd);
+  if ( p->shared_dtd )
+    free_dtd(p->shared_dtd);
+
+  sgml_free(p);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+unshare_dtd_parser() gives p a private copy  of its DTD if the DTD is
+frozen. This is needed if an option or   the  document header (<?xml?>,
+<!DOCTYPE ... [...]>, declarations) must  modify   the  DTD. It fails if
+the document has already started, as the   open environments refer to
+the frozen DTD.  The frozen DTD  is   kept  until  p is freed because
+symbols in the overlay and the location may still refer to it.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+int
+unshare_dtd_parser(dtd_parser *p)
+{ dtd *org = p->dtd;
+  dtd *copy;
+#ifdef XMLNS
+  xmlns *x;
+#endif
+
+  if ( !org->frozen )
+    return TRUE;
+  if ( p->environments || !(copy=clone_dtd(org)) )
+    return FALSE;
+
+  copy->references++;
+  p->dtd = copy;
+  p->shared_dtd = org;
+
+  if ( p->overlay && p->overlay->has_encoding )
+  { copy->encoding = p->overlay->encoding;
+    p->overlay->has_encoding = FALSE;
+  }
+  if ( p->enforce_outer_element )
+    p->enforce_outer_element =
+      dtd_add_symbol(copy, p->enforce_outer_element->name);
 #ifdef XMLNS
-  xmlns_free(p->xmlns);
+  for(x=p->xmlns; x; x=x->next)
+  { if ( x->name )
+      x->name = dtd_add_symbol(copy, x->name->name);
+    x->url = dtd_add_symbol(copy, x->url->name);
+  }
 #endif
-  free_dtd(p->dtd);
 
-  sgml_free(p);
+  return TRUE;
 }
 
 
@@ -4061,17 +4626,20 @@ For the purpose of <!DOCTYPE spec [additions]> we switch to S_GROUP if
 
 static void
 process_marked_section(dtd_parser *p)
-{ ichar buf[MAXDECL];
+{ text_buffer buf;
+  arena_mark m;
   dtd *dtd = p->dtd;
   const ichar *decl = p->buffer->data;
   const ichar *s;
 
+  init_text_buffer(&buf);
+  mark_arena(&p->value_arena, &m);
   if ( (decl=isee_func(dtd, decl, CF_MDO2)) && /* ! */
        (decl=isee_func(dtd, decl, CF_DSO)) && /* [ */
-       expand_pentities(p, decl, ZERO_TERM_LEN, buf, sizeof(buf)/sizeof(ichar)) )
+       expand_pentities(p, decl, ZERO_TERM_LEN, &buf) )
   { dtd_symbol *kwd;
 
-    decl = buf;
+    decl = buf.data;
     if ( (s=itake_name(p, decl, &kwd)) &&
 	 isee_func(dtd, s, CF_DSO) )	/* [ */
     { dtd_marked *m = sgml_calloc(1, sizeof(*m));
@@ -4110,6 +4678,7 @@ process_marked_section(dtd_parser *p)
       p->grouplevel = 1;
     }
   }
+  release_arena(&p->value_arena, &m);
 }
 
 
@@ -4180,10 +4749,18 @@ empty_cdata(dtd_parser *p)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+cb_cdata() passes ISO Latin-1 data to  on_latin1_data()  if the client
+provides it. Otherwise, or if the  buffer   holds  wider characters, the
+buffer is upgraded to UCS and passed to on_data().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static void
 cb_cdata(dtd_parser *p, ocharbuf *buf, int offset, int size)
-{ if ( p->on_data )
-    (*p->on_data)(p, EC_CDATA, size, buf->data.w+offset);
+{ if ( !buf->wide && p->on_latin1_data )
+    (*p->on_latin1_data)(p, EC_CDATA, size, buf->data.t+offset);
+  else if ( p->on_data )
+    (*p->on_data)(p, EC_CDATA, size, wide_ocharbuf(buf)+offset);
 }
 
 
@@ -4382,7 +4959,7 @@ prepare_cdata(dtd_parser *p)
       p->blank_cdata = blank;
       if ( !blank )
       { if ( p->dmode == DM_DTD )
-	  gripe(p, ERC_SYNTAX_ERROR, L"CDATA in DTD", p->cdata->data);
+	  gripe(p, ERC_SYNTAX_ERROR, L"CDATA in DTD", wide_ocharbuf(p->cdata));
 	else
 	  open_element(p, CDATA_ELEMENT, TRUE);
       }
@@ -4525,13 +5102,20 @@ on the state and the start-location of the error.
 
 int
 end_document_dtd_parser(dtd_parser *p)
-{ int rval;
+{ int rval = TRUE;
+
+#ifdef UTF8
+  if ( p->utf8_len > 0 )		/* also report the state below */
+  { p->utf8_len = 0;
+    rval = gripe(p, ERC_SYNTAX_ERROR,
+		 L"Unexpected end-of-file in UTF-8 sequence", L"");
+  }
+#endif
 
   switch(p->state)
   { case S_RCDATA:
     case S_CDATA:
     case S_PCDATA:
-      rval = TRUE;
       break;
     case S_CMT:
     case S_CMT1:
@@ -4559,12 +5143,6 @@ end_document_dtd_parser(dtd_parser *p)
       rval = gripe(p, ERC_SYNTAX_ERROR,
 		   L"Unexpected end-of-file", L"");
       break;
-#ifdef UTF8
-    case S_UTF8:
-      rval = gripe(p, ERC_SYNTAX_ERROR,
-		   L"Unexpected end-of-file in UTF-8 sequence", L"");
-      break;
-#endif
     case S_MSCDATA:
     case S_EMSCDATA1:
     case S_EMSCDATA2:
@@ -4603,6 +5181,9 @@ end_document_dtd_parser(dtd_parser *p)
 	gripe(p, ERC_OMITTED_CLOSE, e->name->name);
       close_element(p, e, FALSE);
     }
+
+    if ( !p->environments )
+      empty_document_arena(p);
   }
 
   return rval;
@@ -4611,7 +5192,10 @@ end_document_dtd_parser(dtd_parser *p)
 
 int
 begin_document_dtd_parser(dtd_parser *p)
-{ init_decoding(p);
+{ if ( p->overlay && p->overlay->has_encoding )
+    init_decoding(p, p->overlay->encoding);
+  else
+    init_decoding(p, p->dtd->encoding);
 
   return TRUE;
 }
@@ -4619,17 +5203,7 @@ begin_document_dtd_parser(dtd_parser *p)
 
 void
 reset_document_dtd_parser(dtd_parser *p)
-{ if ( p->environments )
-  { sgml_environment *env, *parent;
-
-    for(env = p->environments; env; env=parent)
-    { parent = env->parent;
-
-      free_environment(env);
-    }
-
-    p->environments = NULL;
-  }
+{ empty_document_arena(p);
 
   while(p->marked)
     pop_marked_section(p);
@@ -4643,34 +5217,15 @@ reset_document_dtd_parser(dtd_parser *p)
   p->blank_cdata   = TRUE;
   p->event_class   = EV_EXPLICIT;
   p->dmode	   = DM_DATA;
+#ifdef UTF8
+  p->utf8_len	   = 0;
+#endif
 
   begin_document_dtd_parser(p);
 }
 
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Set the UTF-8 state
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-
-#ifdef UTF8
-static void
-process_utf8(dtd_parser *p, int chr)
-{ int bytes;
-  int mask;
-
-  for( bytes=1, mask=0x20; chr&mask; bytes++, mask >>= 1 )
-    ;
-  mask--;				/* 0x20 --> 0x1f */
-
-  p->utf8_saved_state = p->state;		/* state to return to */
-  p->state = S_UTF8;
-  p->utf8_char = chr & mask;
-  p->utf8_left = bytes;
-}
-#endif
-
-
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 add_cdata() adds a character to the output  data. It also maps \r\n onto
 a single \n for Windows newline conventions.
@@ -4761,60 +5316,194 @@ recover_parser(dtd_parser *p)
 
 
 static inline void
-setlocation(dtd_srcloc *d, dtd_srcloc *loc, int line, int lpos)
+setlocation(dtd_srcloc *d, dtd_srcloc *loc, int line, long lineoff)
 { d->line    = line;
-  d->linepos = lpos;
+  d->lineoff = lineoff;
   d->charpos = loc->charpos - 1;
   d->type    = loc->type;
   d->name    = loc->name;
 }
 
 
-int
-putchar_dtd_parser(dtd_parser *p, int chr)
-{ dtd *dtd = p->dtd;
-  const ichar *f = dtd->charfunc->func;
-  int line = p->location.line;
-  int lpos = p->location.linepos;
+		 /*******************************
+		 *	  TOKENIZER TABLE	*
+		 *******************************/
 
-  p->location.charpos++;		/* TBD: actually `bytepos' */
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The tokenizer is driven by a [state][class]  table that is computed from
+the character functions by init_tokenizer().   Each  function character
+gets a class of its own; all   other  characters share class 0. For each
+state and class the table  gives  an  action   and  the  next  state.
+TA_SWITCH (0) runs the full handler   for  the state in step_dtd_parser().
+The other actions handle the common   cases,  such as ordinary characters
+in data, declarations or comments, without comparing against f[CF_*].
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  if ( p->buffer->limit_reached )
-  { return gripe(p, ERC_RESOURCE, L"input buffer");
-  }
-  if ( p->cdata->limit_reached )
-  { return gripe(p, ERC_RESOURCE, L"CDATA buffer");
-  }
+typedef enum
+{ TA_SWITCH = 0,			/* run the state handler */
+  TA_NONE,				/* only change state */
+  TA_CDATA,				/* add to the cdata (S_PCDATA) */
+  TA_VERBATIM,				/* add_verbatim_cdata() */
+  TA_BUFFER				/* add to the declaration buffer */
+} tok_action;
+
+static const charfunc tok_funcs[] =
+{ CF_MDO1, CF_MDO2, CF_MDC, CF_ETAGO1, CF_ETAGO2, CF_PERO, CF_ERO, CF_ERC,
+  CF_DSO, CF_DSC, CF_PRO2, CF_PRC, CF_CMT, CF_LIT, CF_LITA,
+  CF_ENDTABLE
+};
 
-#ifdef UTF8
-  if ( p->state == S_UTF8 )
-  { if ( (chr & 0xc0) != 0x80 )	/* TBD: recover */
-      gripe(p, ERC_SYNTAX_ERROR, L"Bad UTF-8 sequence", L"");
-    p->utf8_char <<= 6;
-    p->utf8_char |= (chr & ~0xc0);
-    if ( --p->utf8_left == 0 )
-    { chr = p->utf8_char;
-      p->state = p->utf8_saved_state;
-    } else
-    { return TRUE;
-    }
-  } else if ( ISUTF8_MB(chr) && p->utf8_decode )
-  { process_utf8(p, chr);
-    return TRUE;
+static void
+tok_default(dtd_charfunc *cf, dtdstate state, tok_action a, dtdstate next)
+{ dtd_transition *t = cf->tok_table[state];
+  int i;
+
+  for(i=0; i<TOK_NCLASSES; i++)
+  { t[i].action = (unsigned char)a;
+    t[i].state  = (unsigned char)next;
   }
-#endif
+}
+
+
+static void
+tok_on(dtd_charfunc *cf, dtdstate state, charfunc f,
+       tok_action a, dtdstate next)
+{ dtd_transition *t = &cf->tok_table[state][cf->tok_class[cf->func[f]]];
+
+  t->action = (unsigned char)a;
+  t->state  = (unsigned char)next;
+}
+
+
+static void
+init_tokenizer(dtd_charfunc *cf)
+{ const charfunc *fp;
+  int nclasses = 1;
+
+  assert(S_ENTCR < TOK_NSTATES);
+  memset(cf->tok_class, 0, sizeof(cf->tok_class));
+  memset(cf->tok_table, 0, sizeof(cf->tok_table));
+
+  for(fp = tok_funcs; *fp != CF_ENDTABLE; fp++)
+  { ichar chr = cf->func[*fp];
+
+    assert(chr < INPUT_CHARSET_SIZE);
+    if ( !cf->tok_class[chr] )
+    { assert(nclasses < TOK_NCLASSES);
+      cf->tok_class[chr] = (unsigned char)nclasses++;
+    }
+  }
+
+  tok_default(cf, S_PCDATA,    TA_CDATA,    S_PCDATA);
+  tok_on(cf, S_PCDATA,    CF_MDO1,   TA_SWITCH,   S_PCDATA);
+  tok_on(cf, S_PCDATA,    CF_PERO,   TA_SWITCH,   S_PCDATA);
+  tok_on(cf, S_PCDATA,    CF_ERO,    TA_SWITCH,   S_PCDATA);
+  tok_on(cf, S_PCDATA,    CF_DSC,    TA_SWITCH,   S_PCDATA);
+  tok_on(cf, S_PCDATA,    CF_ETAGO2, TA_SWITCH,   S_PCDATA);
+
+  tok_default(cf, S_CDATA,     TA_VERBATIM, S_CDATA);
+  tok_on(cf, S_CDATA,     CF_MDO1,   TA_SWITCH,   S_CDATA);
+  tok_on(cf, S_CDATA,     CF_ETAGO2, TA_SWITCH,   S_CDATA);
+
+  tok_default(cf, S_RCDATA,    TA_VERBATIM, S_RCDATA);
+  tok_on(cf, S_RCDATA,    CF_ERO,    TA_SWITCH,   S_RCDATA);
+  tok_on(cf, S_RCDATA,    CF_MDO1,   TA_SWITCH,   S_RCDATA);
+  tok_on(cf, S_RCDATA,    CF_ETAGO2, TA_SWITCH,   S_RCDATA);
+
+  tok_default(cf, S_MSCDATA,   TA_VERBATIM, S_MSCDATA);
+  tok_on(cf, S_MSCDATA,   CF_DSC,    TA_VERBATIM, S_EMSCDATA1);
+  tok_default(cf, S_EMSCDATA1, TA_VERBATIM, S_MSCDATA);
+  tok_on(cf, S_EMSCDATA1, CF_DSC,    TA_VERBATIM, S_EMSCDATA2);
+  tok_default(cf, S_EMSCDATA2, TA_VERBATIM, S_MSCDATA);
+  tok_on(cf, S_EMSCDATA2, CF_DSC,    TA_VERBATIM, S_EMSCDATA2);
+  tok_on(cf, S_EMSCDATA2, CF_MDC,    TA_SWITCH,   S_EMSCDATA2);
+
+  tok_default(cf, S_DECL,      TA_BUFFER,   S_DECL);
+  tok_on(cf, S_DECL,      CF_MDC,    TA_SWITCH,   S_DECL);
+  tok_on(cf, S_DECL,      CF_ETAGO2, TA_SWITCH,   S_DECL);
+  tok_on(cf, S_DECL,      CF_LIT,    TA_SWITCH,   S_DECL);
+  tok_on(cf, S_DECL,      CF_LITA,   TA_SWITCH,   S_DECL);
+  tok_on(cf, S_DECL,      CF_CMT,    TA_SWITCH,   S_DECL);
+  tok_on(cf, S_DECL,      CF_DSO,    TA_SWITCH,   S_DECL);
+
+  tok_default(cf, S_DECLCMT,   TA_NONE,     S_DECLCMT);
+  tok_on(cf, S_DECLCMT,   CF_CMT,    TA_NONE,     S_DECLCMTE0);
+  tok_default(cf, S_DECLCMTE0, TA_NONE,     S_DECLCMT);
+  tok_on(cf, S_DECLCMTE0, CF_CMT,    TA_NONE,     S_DECL);
+
+  tok_default(cf, S_PI,        TA_BUFFER,   S_PI);
+  tok_on(cf, S_PI,        CF_PRO2,   TA_SWITCH,   S_PI);
+  tok_on(cf, S_PI,        CF_PRC,    TA_SWITCH,   S_PI);
+  tok_default(cf, S_PI2,       TA_BUFFER,   S_PI);
+  tok_on(cf, S_PI2,       CF_PRC,    TA_SWITCH,   S_PI2);
+
+  tok_default(cf, S_STRING,    TA_BUFFER,   S_STRING);
+  tok_on(cf, S_STRING,    CF_LIT,    TA_SWITCH,   S_STRING);
+  tok_on(cf, S_STRING,    CF_LITA,   TA_SWITCH,   S_STRING);
+
+  tok_default(cf, S_CMT1,      TA_NONE,     S_CMT);
+  tok_default(cf, S_CMT,       TA_NONE,     S_CMT);
+  tok_on(cf, S_CMT,       CF_CMT,    TA_NONE,     S_CMTE0);
+  tok_default(cf, S_CMTE0,     TA_NONE,     S_CMT);
+  tok_on(cf, S_CMTE0,     CF_CMT,    TA_NONE,     S_CMTE1);
+
+  tok_default(cf, S_GROUP,     TA_BUFFER,   S_GROUP);
+  tok_on(cf, S_GROUP,     CF_DSO,    TA_SWITCH,   S_GROUP);
+  tok_on(cf, S_GROUP,     CF_DSC,    TA_SWITCH,   S_GROUP);
+  tok_on(cf, S_GROUP,     CF_LIT,    TA_SWITCH,   S_GROUP);
+  tok_on(cf, S_GROUP,     CF_LITA,   TA_SWITCH,   S_GROUP);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+step_dtd_parser() runs the  tokenizer  state   machine  for  one  (fully
+decoded) character. The caller has already  dealt with the byte position
+and the buffer limits. It is inlined   into  putchar_dtd_parser() and the
+block loop of process_buffer_dtd_parser().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static inline int
+step_dtd_parser(dtd_parser *p, int chr)
+{ dtd *dtd = p->dtd;
+  const ichar *f = dtd->charfunc->func;
+  int line = p->location.line;
+  long lpos = p->location.lineoff;	/* location before chr */
 
   if ( f[CF_RS] == chr )
   { p->location.line++;
-    p->location.linepos = 0;
-  } else
-  { if ( f[CF_RE] == chr )
-      p->location.linepos = 0;
-    else
-      p->location.linepos++;
+    p->location.lineoff = p->location.charpos;
+  } else if ( f[CF_RE] == chr )
+  { p->location.lineoff = p->location.charpos;
   }
 
 reprocess:
+  { const dtd_transition *t =
+	&dtd->charfunc->tok_table[p->state]
+				 [chr < INPUT_CHARSET_SIZE ?
+				    dtd->charfunc->tok_class[chr] : 0];
+
+    switch(t->action)
+    { case TA_NONE:
+	p->state = t->state;
+	return TRUE;
+      case TA_CDATA:
+	if ( p->cdata->size == 0 )
+	  setlocation(&p->startcdata, &p->location, line, lpos);
+	add_cdata(p, chr);
+	return TRUE;
+      case TA_VERBATIM:
+	add_verbatim_cdata(p, chr);
+	p->state = t->state;
+	return TRUE;
+      case TA_BUFFER:
+	add_icharbuf(p->buffer, chr);
+	p->state = t->state;
+	return TRUE;
+      default:
+	break;
+    }
+  }
+
   switch(p->state)
   { case S_PCDATA:
     { if ( f[CF_MDO1] == chr )		/* < */
@@ -5226,9 +5915,6 @@ reprocess:
       }
       return TRUE;
     }
-#ifdef UTF8
-    case S_UTF8:
-#endif
     default:
       assert(0);
       return FALSE;
@@ -5236,13 +5922,277 @@ reprocess:
 }
 
 
+static inline int
+check_limits_dtd_parser(dtd_parser *p)
+{ if ( p->buffer->limit_reached )
+  { return gripe(p, ERC_RESOURCE, L"input buffer");
+  }
+  if ( p->cdata->limit_reached )
+  { return gripe(p, ERC_RESOURCE, L"CDATA buffer");
+  }
+
+  return TRUE;
+}
+
+
+#ifdef UTF8
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+UTF-8 decoding. Input that  must  be   decoded  is  validated  using
+sgml_utf8_sequence(). An invalid sequence is   reported  with its byte
+offset in the current input, after which   the bytes of the sequence are
+passed as ISO Latin-1 characters. This   recovers  documents that are
+Latin-1 but claim to be UTF-8.
+
+process_buffer_dtd_parser() decodes sequences  in  place. Only bytes
+that arrive one at a time through   putchar_dtd_parser() or sequences
+split over two blocks are collected in p->utf8_buf.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+bad_utf8(dtd_parser *p, long offset, const unsigned char *s, int len)
+{ wchar_t msg[64];
+  wchar_t bytes[4*4+1];
+  int i;
+
+  swprintf(msg, 64, L"Illegal UTF-8 sequence at byte %ld", offset);
+  for(i=0; i<len; i++)
+    swprintf(bytes+i*4, 5, L"\\x%02X", s[i]);
+  bytes[len*4] = 0;
+
+  gripe(p, ERC_SYNTAX_ERROR, msg, bytes);
+}
+
+
+static int
+process_utf8(dtd_parser *p)
+{ int rc = TRUE;
+
+  while ( p->utf8_len > 0 )
+  { unsigned char *s = p->utf8_buf;
+    int chr;
+    int n = sgml_utf8_sequence(s, s+p->utf8_len, &chr);
+
+    if ( n == 0 )			/* need more */
+      return rc;
+
+    if ( n > 0 )
+    { p->location.lineoff += n-1;
+      rc = step_dtd_parser(p, chr);
+    } else
+    { int i;
+
+      n = -n;
+      bad_utf8(p, p->location.charpos-p->utf8_len, s, n);
+      for(i=0; i<n; i++)
+	rc = step_dtd_parser(p, s[i]);
+    }
+
+    p->utf8_len -= n;
+    memmove(s, s+n, p->utf8_len);
+  }
+
+  return rc;
+}
+
+#endif /*UTF8*/
+
+
+int
+putchar_dtd_parser(dtd_parser *p, int chr)
+{ p->location.charpos++;		/* TBD: actually `bytepos' */
+
+  if ( !check_limits_dtd_parser(p) )
+    return FALSE;
+
+#ifdef UTF8
+  if ( p->utf8_len > 0 || (p->utf8_decode && chr >= 0x80 && chr <= 0xff) )
+  { p->utf8_buf[p->utf8_len++] = (unsigned char)chr;
+
+    return process_utf8(p);
+  }
+#endif
+
+  return step_dtd_parser(p, chr);
+}
+
+
+		 /*******************************
+		 *	  PCDATA SCANNER	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+scan_pcdata() returns a pointer to the first byte in [s,e) that may not
+simply be appended to  the  PCDATA  buffer.   The  set  of  bytes  is
+computed by new_charfunc() (see   charmap.c).  If  a SHORTREF map is
+active, the end characters of the map  stop   the  run as well. This is
+rare and only uses the scalar loop.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static const unsigned char *
+scan_pcdata(const dtd_charfunc *cf, const dtd_shortref *map,
+	    const unsigned char *s, const unsigned char *e)
+{ const char *stop = cf->pcdata_stop;
+
+  if ( map )
+  { const char *ends = map->ends;
+
+    while( s < e && !stop[*s] && !ends[*s] )
+      s++;
+
+    return s;
+  }
+
+#ifdef __SSE2__
+  if ( e-s >= 16 )
+  { __m128i set[MAXPCDATASTOP];
+    int i, n = cf->pcdata_nstop;
+
+    for(i=0; i<n; i++)
+      set[i] = _mm_set1_epi8((char)cf->pcdata_stop_chars[i]);
+
+    for( ; e-s >= 16; s += 16 )
+    { __m128i v = _mm_loadu_si128((const __m128i*)s);
+      int mask = _mm_movemask_epi8(v);	/* bytes >= 0x80 */
+
+      for(i=0; i<n; i++)
+	mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, set[i]));
+      if ( mask )
+	return s + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  while( s < e && !stop[*s] )
+    s++;
+
+  return s;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+pcdata_run() appends the longest run of plain characters at s to the
+PCDATA buffer, decoding valid UTF-8 sequences on the way. This is only
+safe if we are inside non-blank, included  character data and no context
+makes other characters special (marked  sections,   SHORTTAG  NET).
+Returns the first byte not consumed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static inline const unsigned char *
+pcdata_run(dtd_parser *p, const unsigned char *s, const unsigned char *e)
+{ const unsigned char *r;
+
+  if ( p->mark_state != MS_INCLUDE || p->blank_cdata ||
+       p->cdata->size == 0 || p->marked || p->waiting_for_net )
+    return s;
+
+  for(;;)
+  { r = scan_pcdata(p->dtd->charfunc, p->map, s, e);
+    if ( r > s )
+    { if ( !add_bytes_ocharbuf(p->cdata, s, r-s) )
+	return s;
+      p->location.charpos += (int)(r-s);
+      s = r;
+    }
+
+#ifdef UTF8
+    if ( s == e || *s < 0x80 || !p->utf8_decode || p->map )
+      return s;
+
+    do					/* valid UTF-8 sequences */
+    { int chr;
+      int n = sgml_utf8_sequence(s, e, &chr);
+
+      if ( n <= 0 || p->cdata->limit_reached )
+	return s;
+      add_ocharbuf(p->cdata, chr);
+      p->location.charpos += n;
+      p->location.lineoff += n-1;
+      s += n;
+    } while ( s < e && *s >= 0x80 );
+#else
+    return s;
+#endif
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+process_buffer_dtd_parser() feeds a block of   raw  input bytes into the
+parser. It is equivalent to  calling   putchar_dtd_parser()  for  each
+byte, but single-byte characters run  the   state  machine inline rather
+than through a function call per character. UTF-8 sequences are decoded
+directly from the block; only a   sequence  that is split over two blocks
+is collected in p->utf8_buf. Runs of   plain character data are copied as
+a whole using pcdata_run().
+
+Processing stops early if the client  sets   p->halted  from one of the
+callbacks. The return value is the number of bytes consumed.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+size_t
+process_buffer_dtd_parser(dtd_parser *p, const char *buf, size_t len)
+{ const unsigned char *s = (const unsigned char *)buf;
+  const unsigned char *e = s+len;
+
+  while( s < e && !p->halted )
+  { int chr;
+
+    if ( p->state == S_PCDATA && (s = pcdata_run(p, s, e)) == e )
+      break;
+
+    chr = *s;
+
+#ifdef UTF8
+    if ( p->utf8_len > 0 )		/* sequence started in last block */
+    { putchar_dtd_parser(p, chr);
+      s++;
+      continue;
+    }
+    if ( chr >= 0x80 && p->utf8_decode )
+    { int n = sgml_utf8_sequence(s, e, &chr);
+
+      if ( n > 0 )
+      { p->location.charpos += n;
+	p->location.lineoff += n-1;
+	s += n;
+	if ( check_limits_dtd_parser(p) )
+	  step_dtd_parser(p, chr);
+      } else if ( n == 0 )		/* truncated by the end of the block */
+      { while( s < e )
+	  p->utf8_buf[p->utf8_len++] = *s++;
+	p->location.charpos += p->utf8_len;
+      } else
+      { const unsigned char *s0;
+
+	bad_utf8(p, p->location.charpos, s, -n);
+	for(s0=s, s += -n; s0 < s; s0++)
+	{ p->location.charpos++;
+	  if ( check_limits_dtd_parser(p) )
+	    step_dtd_parser(p, *s0);
+	}
+      }
+      continue;
+    }
+#endif
+
+    s++;
+    p->location.charpos++;
+    if ( check_limits_dtd_parser(p) )
+      step_dtd_parser(p, chr);
+  }
+
+  return s - (const unsigned char *)buf;
+}
+
+
 		 /*******************************
 		 *	     TOPLEVEL		*
 		 *******************************/
 
 int
 load_dtd_from_file(dtd_parser *p, const ichar *file)
-{ FILE *fd;
+{ file_buffer fb;
   int rval;
   data_mode   oldmode  = p->dmode;
   dtdstate    oldstate = p->state;
@@ -5254,13 +6204,9 @@ load_dtd_from_file(dtd_parser *p, const ichar *file)
   empty_icharbuf(p->buffer);		/* dubious */
   set_file_dtd_parser(p, IN_FILE, file);
 
-  if ( (fd = wfopen(file, "rb")) )
-  { int chr;
-
-    while( (chr = getc(fd)) != EOF )
-      putchar_dtd_parser(p, chr);
-
-    fclose(fd);
+  if ( open_file_buffer(file, &fb) )
+  { process_buffer_dtd_parser(p, fb.data, fb.size);
+    close_file_buffer(&fb);
 
     p->dtd->implicit = FALSE;
     rval = TRUE;
@@ -5304,45 +6250,82 @@ SGML sees a file as
 I.e. the newline  appearing  just  before   the  end-of-file  should  be
 ignored. In addition, Unix-style files are   mapped  to CR-LF. Thanks to
 Richard O'Keefe.
+
+The stream is read in blocks. The last byte of each block is held back
+until we know whether it is the last byte of the file. process_eof()
+handles this last byte, where p0 is the byte before it.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+static int
+process_eof(dtd_parser *p, int p0, int p1, unsigned flags)
+{ if ( p1 != LF )
+    putchar_dtd_parser(p, p1);
+  else if ( p0 != CR )
+    putchar_dtd_parser(p, CR);
+
+  if ( flags & SGML_SUB_DOCUMENT )
+    return TRUE;
+  else
+    return end_document_dtd_parser(p);
+}
+
+
 int
 sgml_process_stream(dtd_parser *p, FILE *fd, unsigned flags)
-{ int p0, p1;
+{ char buf[4096];
+  size_t n;
+  int p0, p1;				/* p1 is held back, p0 before it */
 
-  if ( (p0 = getc(fd)) == EOF )
+  if ( (n = fread(buf, 1, sizeof(buf), fd)) == 0 )
     return TRUE;
-  if ( (p1 = getc(fd)) == EOF )
-  { putchar_dtd_parser(p, p0);
+  if ( n == 1 && (p1 = getc(fd)) == EOF )
+  { putchar_dtd_parser(p, buf[0]&0xff);
     return end_document_dtd_parser(p);
+  } else if ( n == 1 )
+  { buf[n++] = (char)p1;
   }
 
-  for(;;)
-  { int p2 = getc(fd);
+  for(;;)				/* n >= 2 */
+  { process_buffer_dtd_parser(p, buf, n-1);
+    p0 = buf[n-2]&0xff;
+    p1 = buf[n-1]&0xff;
 
-    if ( p2 == EOF )
-    { putchar_dtd_parser(p, p0);
-      if ( p1 != LF )
-	putchar_dtd_parser(p, p1);
-      else if ( p0 != CR )
-	putchar_dtd_parser(p, CR);
+    buf[0] = (char)p1;
+    if ( (n = fread(buf+1, 1, sizeof(buf)-1, fd)) == 0 )
+      break;
+    n++;
+  }
 
-      if ( flags & SGML_SUB_DOCUMENT )
-	return TRUE;
-      else
-	return end_document_dtd_parser(p);
-    }
+  return process_eof(p, p0, p1, flags);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Files are mapped into memory  (see   open_file_buffer())  and passed to
+the parser as a single block, avoiding the copy through stdio.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+process_file_buffer(dtd_parser *p, const file_buffer *fb, unsigned flags)
+{ const char *s = fb->data;
+  size_t n = fb->size;
 
-    putchar_dtd_parser(p, p0);
-    p0 = p1;
-    p1 = p2;
+  if ( n == 0 )
+    return TRUE;
+  if ( n == 1 )
+  { putchar_dtd_parser(p, s[0]&0xff);
+    return end_document_dtd_parser(p);
   }
+
+  process_buffer_dtd_parser(p, s, n-1);
+
+  return process_eof(p, s[n-2]&0xff, s[n-1]&0xff, flags);
 }
 
 
 int
 sgml_process_file(dtd_parser *p, const ichar *file, unsigned flags)
-{ FILE *fd;
+{ file_buffer fb;
   int rval;
   locbuf oldloc;
 
@@ -5351,9 +6334,9 @@ sgml_process_file(dtd_parser *p, const ichar *file, unsigned flags)
   if ( !(flags & SGML_SUB_DOCUMENT) )
     set_mode_dtd_parser(p, DM_DATA);
 
-  if ( (fd = wfopen(file, "rb")) )
-  { rval = sgml_process_stream(p, fd, flags);
-    fclose(fd);
+  if ( open_file_buffer(file, &fb) )
+  { rval = process_file_buffer(p, &fb, flags);
+    close_file_buffer(&fb);
   } else
     rval = FALSE;
 
@@ -5386,10 +6369,12 @@ format_location(wchar_t *s, size_t len, dtd_srcloc *l)
     { case IN_NONE:
 	assert(0);
       case IN_FILE:
-	swprintf(s, len, L"%ls:%d:%d", l->name.file, l->line, l->linepos);
+	swprintf(s, len, L"%ls:%d:%d",
+		 l->name.file, l->line, sgml_linepos(l));
         break;
       case IN_ENTITY:
-        swprintf(s, len, L"&%ls;%d:%d", l->name.entity, l->line, l->linepos);
+        swprintf(s, len, L"&%ls;%d:%d",
+		 l->name.entity, l->line, sgml_linepos(l));
         break;
     }
 
@@ -5582,10 +6567,10 @@ gripe(dtd_parser *p, dtd_error_id e, ...)
       break;
     }
     case ERC_NOT_ALLOWED_PCDATA:
-    { const ocharbuf *cdata = va_arg(args, const ocharbuf *);
+    { ocharbuf *cdata = va_arg(args, ocharbuf *);
 
       swprintf(buf, 1024, L"#PCDATA (\"%ls\") not allowed here",
-	       str_summary(cdata->data.w, 25));
+	       str_summary(wide_ocharbuf(cdata), 25));
       error.argv[0] = buf;
       error.severity = ERS_WARNING;
       e = ERC_VALIDATE;
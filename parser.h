@@ -55,6 +55,9 @@ typedef int (*sgml_data_f)(dtd_parser_p parser,
 			   data_type type, int len, const wchar_t *text);
 typedef int (*sgml_wdata_f)(dtd_parser_p parser,
 			   data_type type, int len, const wchar_t *text);
+typedef int (*sgml_latin1_data_f)(dtd_parser_p parser,
+				  data_type type, int len,
+				  const unsigned char *text);
 typedef int (*sgml_entity_f)(dtd_parser_p parser,
 			     dtd_entity *entity,
 			     int chr);
@@ -76,9 +79,6 @@ typedef int (*xmlns_f)(dtd_parser_p parser,
 
 typedef enum
 { S_PCDATA,				/* between declarations */
-#ifdef UTF8
-  S_UTF8,				/* Loading UTF-8 character */
-#endif
   S_CDATA,				/* non-parsed data */
   S_RCDATA,				/* CDATA+entities */
   S_MSCDATA,				/* <![CDATA[...]]> */
@@ -199,9 +199,8 @@ typedef struct _dtd_parser
   dtd_shortref *map;			/* SHORTREF map */
 #ifdef UTF8
   int	   utf8_decode;			/* decode UTF-8 sequences? */
-  int      utf8_char;			/* building character */
-  int	   utf8_left;			/* bytes left */
-  dtdstate utf8_saved_state;		/* state from which we come */
+  int	   utf8_len;			/* # bytes in utf8_buf */
+  unsigned char utf8_buf[4];		/* incomplete UTF-8 sequence */
 #endif
   dtd_srcloc	location;		/* Current location */
   dtd_srcloc	startloc;		/* Start of last markup */
@@ -212,11 +211,21 @@ typedef struct _dtd_parser
 #ifdef XMLNS
   struct _xmlns *xmlns;			/* Outer xmlns declaration */
 #endif
+  sgml_arena	arena;			/* Per-document objects */
+  sgml_arena	value_arena;		/* Attribute values of current tag */
+  sgml_environment *free_environments;	/* Free-list of environments */
+#ifdef XMLNS
+  struct _xmlns *free_xmlns;		/* Free-list of xmlns nodes */
+#endif
+  struct _dtd_overlay *overlay;		/* Local additions to a frozen DTD */
+  dtd	       *shared_dtd;		/* Frozen DTD after unsharing */
 
   void *closure;			/* client handle */
+  void *client_data;			/* client data kept between documents */
   sgml_begin_element_f	on_begin_element; /* start an element */
   sgml_end_element_f	on_end_element;	/* end an element */
   sgml_data_f		on_data;	/* process cdata */
+  sgml_latin1_data_f	on_latin1_data;	/* process ISO Latin-1 cdata */
   sgml_entity_f		on_entity;	/* unprocessed entity */
   sgml_pi_f		on_pi;		/* processing instruction */
   sgml_error_f		on_error;	/* handle error */
@@ -225,6 +234,7 @@ typedef struct _dtd_parser
   xmlns_f		on_xmlns;	/* handle new namespace */
 #endif
   unsigned		flags;		/* misc flags */
+  int			halted;		/* client asks to stop processing */
 } dtd_parser;
 
 
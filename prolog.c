@@ -408,12 +408,11 @@ prolog_print_attribute(dtd_element *e, dtd_attr *at)
 
 static void
 prolog_print_element(dtd_element *e, unsigned int flags)
-{ ichar nbuf[MAXNMLEN];
+{ ichar *nbuf = istrdup(e->name->name);
 
-  istrcpy(nbuf, e->name->name);
   istrupper(nbuf);
-
   wprintf(L"\n%% Element <%s>\n", nbuf);
+  sgml_free(nbuf);
 
   if ( e->structure )
   { dtd_edef *def = e->structure;
@@ -330,9 +330,7 @@ is_xml_nmstart(dtd_charclass *map, int c)
 { if ( c <= 0xff )
   { return (map->class[c] & CH_NMSTART);
   } else
-  { return ( xml_basechar(c) ||
-	     xml_ideographic(c)
-	   );
+  { return xml_char_class(c) & XML_NMSTART_CHAR;
   }
 }
 
@@ -342,12 +340,7 @@ is_xml_chname(dtd_charclass *map, int c)
 { if ( c <= 0xff )
   { return (map->class[c] & CH_NAME);
   } else
-  { return ( xml_basechar(c) ||
-	     xml_digit(c) ||
-	     xml_ideographic(c) ||
-	     xml_combining_char(c) ||
-	     xml_extender(c)
-	   );
+  { return xml_char_class(c) & XML_NAME_CHAR;
   }
 }
 
@@ -530,6 +523,7 @@ install_xml_quote()
   ATOM_utf8        = PL_new_atom("utf8");
   ATOM_unicode     = PL_new_atom("unicode");
   ATOM_ascii       = PL_new_atom("ascii");
+  init_xml_char_classes();
 
   PL_register_foreign("xml_quote_attribute", 3,	xml_quote_attribute,   0);
   PL_register_foreign("xml_quote_cdata",     3,	xml_quote_cdata,       0);
@@ -317,7 +317,7 @@ on_error(dtd_parser * p, dtd_error * error)
   if ( l->name.file )
   { fwprintf(stderr, L"%s: (%s mode) %s: %ls:%d:%d %ls\n",
 	     program, dialect, severity,
-	     l->name.entity, l->line, l->linepos,
+	     l->name.entity, l->line, sgml_linepos(l),
 	     error->plain_message);
   } else
   { fwprintf(stderr, L"%s: (%s mode) %s: %d:%d %ls\n",
@@ -46,7 +46,10 @@
 
 	    new_dtd/2,			% +Doctype, -DTD
 	    free_dtd/1,			% +DTD
+	    freeze_dtd/1,		% +DTD
 	    open_dtd/3,			% +DTD, +Options, -Stream
+	    save_dtd/2,			% +DTD, +File
+	    load_dtd_image/2,		% +DTD, +File
 
 	    new_sgml_parser/2,		% -Parser, +Options
 	    free_sgml_parser/1,		% +Parser
@@ -121,10 +124,12 @@
 		       pass_to(open/4, 4)
 		     ]).
 :- predicate_options(sgml_parse/2, 2,
-		     [ call(oneof([begin,end,cdata,pi,decl,error,xmlns,urlns]),
+		     [ call(oneof([begin,end,cdata,pi,decl,error,xmlns,urlns,
+				   events]),
 			    callable),
 		       content_length(integer),
 		       document(-any),
+		       event_batch(positive_integer),
 		       max_errors(integer),
 		       parse(oneof([file,element,content,declaration,input])),
 		       source(any),
@@ -193,20 +198,16 @@ register_catalog(Base) :-
 		 *******************************/
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Note that concurrent access to DTD objects  is not allowed, and hence we
-will allocate and destroy them in each   thread.  Possibibly it would be
-nicer to find out why  concurrent  access   to  DTD's  is  flawed. It is
-diagnosed to mess with the entity resolution by Fabien Todescato.
+DTD objects loaded by dtd/2 are frozen  (see freeze_dtd/1) and shared by
+all threads. The parser keeps definitions  that   are  implied by the
+document in a private overlay and  makes   a  private  copy of the DTD if
+the document must modify the DTD itself.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-:- thread_local
+:- dynamic
 	current_dtd/2.
 :- volatile
 	current_dtd/2.
-:- thread_local
-	registered_cleanup/0.
-:- volatile
-	registered_cleanup/0.
 
 :- multifile
 	dtd_alias/2.
@@ -222,17 +223,23 @@ dtd_alias(html,  DTD) :-
 %%	dtd(+Type, -DTD) is det.
 %
 %	DTD is a DTD object created from  the file dtd(Type). Loaded DTD
-%	objects are cached. Note that  DTD   objects  may  not be shared
-%	between threads. Therefore, dtd/2  maintains   the  pool  of DTD
-%	objects  using  a  thread_local  predicate.    DTD  objects  are
-%	destroyed if a thread terminates.
+%	objects are frozen using freeze_dtd/1 and cached. They are shared
+%	by all threads.  The DTDs for the HTML types get the matching
+%	HTML dialect before they are frozen.
+%
+%	If a DTD image <Base>.dtdc (see   save_dtd/2)  exists next to the
+%	file <Base>.dtd and is not older, the image is loaded instead.
 %
 %	@error existence_error(source_sink, dtd(Type))
 
 dtd(Type, DTD) :-
 	current_dtd(Type, DTD), !.
 dtd(Type, DTD) :-
-	new_dtd(Type, DTD),
+	with_mutex(sgml_dtd, shared_dtd(Type, DTD)).
+
+shared_dtd(Type, DTD) :-
+	current_dtd(Type, DTD), !.
+shared_dtd(Type, DTD) :-
 	(   dtd_alias(Type, Base)
 	->  true
 	;   Base = Type
@@ -241,10 +248,42 @@ dtd(Type, DTD) :-
 			   [ extensions([dtd]),
 			     access(read)
 			   ], DtdFile),
-	load_dtd(DTD, DtdFile),
-	register_cleanup,
+	load_dtd_file(Type, DtdFile, DTD),
+	set_dtd_dialect(Type, DTD),
+	freeze_dtd(DTD),
 	asserta(current_dtd(Type, DTD)).
 
+set_dtd_dialect(Type, DTD) :-
+	dtd_dialect(Type, Dialect), !,
+	setup_call_cleanup(
+	    new_sgml_parser(Parser, [dtd(DTD)]),
+	    set_sgml_parser(Parser, dialect(Dialect)),
+	    free_sgml_parser(Parser)).
+set_dtd_dialect(_, _).
+
+dtd_dialect(html4, html).
+dtd_dialect(html5, html5).
+dtd_dialect(html,  Dialect) :-
+	current_prolog_flag(html_dialect, Dialect0),
+	dtd_dialect(Dialect0, Dialect).
+
+load_dtd_file(Type, DtdFile, DTD) :-
+	file_name_extension(Base, dtd, DtdFile),
+	file_name_extension(Base, dtdc, ImageFile),
+	exists_file(ImageFile),
+	time_file(ImageFile, ImageTime),
+	time_file(DtdFile, DtdTime),
+	ImageTime >= DtdTime,
+	new_dtd(Type, DTD),
+	catch(load_dtd_image(DTD, ImageFile), E,
+	      ( print_message(warning, E),
+		free_dtd(DTD),
+		fail
+	      )), !.
+load_dtd_file(Type, DtdFile, DTD) :-
+	new_dtd(Type, DTD),
+	load_dtd(DTD, DtdFile).
+
 %%	load_dtd(+DTD, +DtdFile, +Options)
 %
 %	Load DtdFile into a DTD.  Defined options are:
@@ -279,28 +318,29 @@ split_dtd_options([H|T], TD, [H|S]) :-
 
 dtd_option(dialect(_)).
 
+%%	save_dtd(+DTD, +File) is det.
+%
+%	Save DTD as a binary image in   File.  The image can be loaded
+%	into a fresh DTD object using load_dtd_image/2, which is much
+%	faster than load_dtd/2. Images are not portable between machines
+%	with a different byte order.
 
-%%	destroy_dtds
+%%	load_dtd_image(+DTD, +File) is det.
 %
-%	Destroy  DTDs  cached  by  this  thread   as  they  will  become
-%	unreachable anyway.
+%	Load an image created by save_dtd/2 into DTD, which must be
+%	empty.
+%
+%	@error miscellaneous(dtd_image) if File is not a valid image.
 
-destroy_dtds :-
-	(   current_dtd(_Type, DTD),
-	    free_dtd(DTD),
-	    fail
-	;   true
-	).
 
-%%	register_cleanup
+%%	freeze_dtd(+DTD) is det.
 %
-%	Register cleanup of DTDs created for this thread.
-
-register_cleanup :-
-	registered_cleanup, !.
-register_cleanup :-
-	catch(thread_at_exit(destroy_dtds), _, true),
-	assert(registered_cleanup).
+%	Make DTD read-only, such that  it  can   be  used  by  parsers in
+%	multiple threads concurrently. A parser   that  must modify the
+%	DTD, for example due to the  dialect(Dialect) option or the
+%	<!DOCTYPE ...> declaration of the document, uses a private copy.
+%	Loading declarations into a frozen DTD using open_dtd/3 raises an
+%	exception.
 
 
 		 /*******************************
@@ -482,6 +522,7 @@ parser_option(encoding(_)).
 
 
 def_entity(entity(Name, Value), Parser) :-
+	set_sgml_parser(Parser, shared_dtd(false)),
 	get_sgml_parser(Parser, dtd(DTD)),
 	xml_quote_attribute(Value, QValue),
 	setup_call_cleanup(open_dtd(DTD, [], Stream),
@@ -760,6 +801,7 @@ call_params(decl,  decl(cdata,parser)).
 call_params(error, error(severity,message,parser)).
 call_params(xmlns, xmlns(namespace,url,parser)).
 call_params(urlns, urlns(url,url,parser)).
+call_params(events, events(list,parser)).
 
 		 /*******************************
 		 *	     SANDBOX		*
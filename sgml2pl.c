@@ -41,12 +41,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 #include <wctype.h>
 
 #define streq(s1, s2) (strcmp(s1, s2) == 0)
 
 #define MAX_ERRORS	50
 #define MAX_WARNINGS	50
+#define EVENT_BATCH	256		/* default # events per call(events) */
 
 #define ENDSNUL ((size_t)-1)
 
@@ -71,10 +73,15 @@ typedef enum
 } errormode;
 
 typedef struct _env
-{ term_t	tail;
-  struct _env *parent;
+{ term_t	element;		/* name, attributes, content */
+  int		children;		/* index of first child */
 } env;
 
+typedef struct _default_atom
+{ dtd_attr     *definition;		/* attribute with default */
+  atom_t	value;			/* atom for the default value */
+} default_atom;
+
 
 typedef struct _parser_data
 { int	      magic;			/* PD_MAGIC */
@@ -97,6 +104,7 @@ typedef struct _parser_data
   predicate_t on_urlns;			/* url --> namespace */
   predicate_t on_error;			/* errors */
   predicate_t on_decl;			/* declarations */
+  predicate_t on_events;		/* batches of events */
 
   stopat      stopat;			/* Where to stop */
   int	      stopped;			/* Environment is complete */
@@ -104,11 +112,26 @@ typedef struct _parser_data
   IOSTREAM*   source;			/* Where we are reading from */
 
   term_t      list;			/* output term (if any) */
-  term_t      tail;			/* tail of the list */
-  env	     *stack;			/* environment stack */
+  int	      list_failed;		/* list could not be unified */
+  env	     *stack;			/* open elements */
+  int	      stack_top;		/* # open elements */
+  int	      stack_size;		/* allocated size of stack */
+  term_t     *children;			/* completed nodes */
+  int	      children_top;		/* # completed nodes */
+  int	      children_size;		/* allocated size of children */
+
+  term_t      events;			/* event_batch refs for events */
+  int	      event_count;		/* # pending events */
+  int	      event_batch;		/* # events per call */
   int	      free_on_close;		/* sgml_free parser on close */
+
+  default_atom *default_atoms;		/* atoms of default values */
+  int	      default_atoms_size;	/* # slots (power of 2) */
+  int	      default_atoms_count;	/* # used slots */
 } parser_data;
 
+static void free_url_cache(dtd_parser *p);
+
 
 		 /*******************************
 		 *	      CONSTANTS		*
@@ -173,6 +196,11 @@ static functor_t FUNCTOR_qualify_attributes1;
 static functor_t FUNCTOR_encoding1;
 static functor_t FUNCTOR_xmlns1;
 static functor_t FUNCTOR_xmlns2;
+static functor_t FUNCTOR_shared_dtd1;
+static functor_t FUNCTOR_begin2;
+static functor_t FUNCTOR_end1;
+static functor_t FUNCTOR_text1;
+static functor_t FUNCTOR_event_batch1;
 
 static atom_t ATOM_true;
 static atom_t ATOM_false;
@@ -246,6 +274,11 @@ initConstants()
   FUNCTOR_encoding1	 = mkfunctor("encoding", 1);
   FUNCTOR_xmlns1	 = mkfunctor("xmlns", 1);
   FUNCTOR_xmlns2	 = mkfunctor("xmlns", 2);
+  FUNCTOR_shared_dtd1	 = mkfunctor("shared_dtd", 1);
+  FUNCTOR_begin2	 = mkfunctor("begin", 2);
+  FUNCTOR_end1		 = mkfunctor("end", 1);
+  FUNCTOR_text1		 = mkfunctor("text", 1);
+  FUNCTOR_event_batch1	 = mkfunctor("event_batch", 1);
   FUNCTOR_dstream_position4 = PL_new_functor(PL_new_atom("$stream_position"), 4);
 
   ATOM_true = PL_new_atom("true");
@@ -367,7 +400,8 @@ pl_free_sgml_parser(term_t parser)
 { dtd_parser *p;
 
   if ( get_parser(parser, &p) )
-  { free_dtd_parser(p);
+  { free_url_cache(p);
+    free_dtd_parser(p);
     return TRUE;
   }
 
@@ -404,6 +438,166 @@ pl_free_dtd(term_t t)
   return FALSE;
 }
 
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Element and attribute names are cached  as   atoms  in  the handle of
+their symbol. The local_handle holds the atom  for the local part of a
+name with a namespace prefix. The atoms  are unregistered when the symbol
+table is freed (see release_symbol()). The symbols  of a frozen DTD are
+shared by parsers in multiple threads. freeze_symbol_atoms() creates the
+atoms when the DTD is frozen and these symbols are never modified after
+that. Symbols in the overlay of a parser are not shared.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+release_symbol(dtd_symbol *s)
+{ if ( s->handle )
+    PL_unregister_atom((atom_t)s->handle);
+  if ( s->local_handle )
+    PL_unregister_atom((atom_t)s->local_handle);
+}
+
+
+static const ichar *
+local_name(dtd *dtd, const ichar *name)
+{ const ichar *s = wcschr(name, dtd->charfunc->func[CF_NS]);
+
+  return s ? s+1 : NULL;
+}
+
+
+static void
+freeze_symbol_atoms(dtd *dtd)
+{ dtd_symbol_table *t = dtd->symbols;
+  int i;
+
+  for(i=0; i<t->size; i++)
+  { dtd_symbol *s = t->entries[i].symbol;
+    const ichar *local;
+
+    if ( s )
+    { if ( !s->handle )
+	s->handle = PL_new_atom_wchars(wcslen(s->name), s->name);
+      if ( !s->local_handle && (local=local_name(dtd, s->name)) )
+	s->local_handle = PL_new_atom_wchars(wcslen(local), local);
+    }
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Default values of attributes that are a  single atom are shared by all
+elements of a type (see default_value_atom()). For a frozen DTD these
+atoms are created once by  freeze_default_atoms()   and  kept  in the
+handle of the attribute definition. They are unregistered when the DTD
+is freed (see release_attr()).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+is_default_atom(sgml_attribute *a)
+{ return ( (a->flags & SGML_AT_DEFAULT) && a->value.textW &&
+	   ( a->definition->type == AT_CDATA ||
+	     a->definition->type == AT_NUMBER ||
+	     !a->definition->islist ) );
+}
+
+
+static void
+release_attr(dtd_attr *a)
+{ PL_unregister_atom((atom_t)a->handle);
+}
+
+
+static void
+freeze_default_atoms(dtd *dtd)
+{ dtd_element *e;
+
+  for(e=dtd->elements; e; e=e->next)
+  { dtd_attr_index *ix = e->attr_index;
+    int i;
+
+    for(i=0; ix && i<ix->ndefaults; i++)
+    { sgml_attribute *a = &ix->default_values[i];
+
+      if ( !a->definition->handle && is_default_atom(a) )
+	a->definition->handle = PL_new_atom_wchars(a->value.number,
+						   a->value.textW);
+    }
+  }
+}
+
+
+static foreign_t
+pl_freeze_dtd(term_t t)
+{ dtd *dtd;
+
+  if ( get_dtd(t, &dtd) )
+  { if ( dtd->frozen )
+      return TRUE;
+    if ( !freeze_dtd(dtd) )
+      return FALSE;
+    freeze_symbol_atoms(dtd);
+    freeze_default_atoms(dtd);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+save_dtd(+DTD, +File) and load_dtd_image(+DTD, +File) save a compiled DTD
+as a binary image and load it back. See dtdimage.c.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+dtd_image_error(term_t file, int err, const char *action)
+{ char *fn;
+
+  if ( err == EINVAL )
+    return sgml2pl_error(ERR_MISC, "dtd_image",
+			 "Not a valid DTD image or DTD is not empty");
+  if ( !PL_get_chars(file, &fn, CVT_ATOM|CVT_STRING|REP_MB) )
+    fn = "?";
+
+  if ( err == ENOENT )
+    return sgml2pl_error(ERR_ERRNO, err, fn);
+  else
+    return sgml2pl_error(ERR_ERRNO, err, fn, action);
+}
+
+
+static foreign_t
+pl_save_dtd(term_t ref, term_t file)
+{ dtd *dtd;
+  ichar *fn;
+
+  if ( !get_dtd(ref, &dtd) ||
+       !PL_get_wchars(file, NULL, &fn, CVT_ATOM|CVT_STRING|CVT_EXCEPTION) )
+    return FALSE;
+
+  if ( !save_dtd_image(dtd, fn) )
+    return dtd_image_error(file, errno, "write");
+
+  return TRUE;
+}
+
+
+static foreign_t
+pl_load_dtd_image(term_t ref, term_t file)
+{ dtd *dtd;
+  ichar *fn;
+
+  if ( !get_dtd(ref, &dtd) ||
+       !PL_get_wchars(file, NULL, &fn, CVT_ATOM|CVT_STRING|CVT_EXCEPTION) )
+    return FALSE;
+
+  if ( !load_dtd_image(dtd, fn) )
+    return dtd_image_error(file, errno, "read");
+
+  return TRUE;
+}
+
 		 /*******************************
 		 *	   DATA EXCHANGE	*
 		 *******************************/
@@ -415,10 +609,44 @@ put_atom_wchars(term_t t, wchar_t const *s)
 }
 
 
+/* put_symbol_name() puts the name of a symbol, using the cached atom if
+   there is one (see freeze_symbol_atoms()).
+*/
+
+WUNUSED static int
+put_symbol_name(dtd_parser *p, term_t t, dtd_symbol *s, const ichar *name)
+{ uintptr_t *h = (name == s->name ? &s->handle : &s->local_handle);
+
+  if ( !*h )
+  { if ( p->dtd->frozen && dtd_find_symbol(p->dtd, s->name) == s )
+      return put_atom_wchars(t, name);	/* shared: do not modify */
+    if ( !(*h = PL_new_atom_wchars(wcslen(name), name)) )
+      return FALSE;
+  }
+
+  PL_put_atom(t, (atom_t)*h);
+  return TRUE;
+}
+
+
 		 /*******************************
 		 *	    PROPERTIES		*
 		 *******************************/
 
+/* writable_dtd() gives p a private copy of its DTD if the DTD is frozen
+   (see freeze_dtd()), such that an option can modify it.
+*/
+
+static int
+writable_dtd(dtd_parser *p)
+{ if ( unshare_dtd_parser(p) )
+    return TRUE;
+
+  return sgml2pl_error(ERR_MISC, "sgml",
+		       "Cannot modify a shared DTD after the document started");
+}
+
+
 static foreign_t
 pl_set_sgml_parser(term_t parser, term_t option)
 { dtd_parser *p;
@@ -434,7 +662,7 @@ pl_set_sgml_parser(term_t parser, term_t option)
     _PL_get_arg(1, option, a);
     if ( !PL_get_wchars(a, NULL, &file, CVT_ATOM|CVT_EXCEPTION) )
       return FALSE;
-    fs = dtd_add_symbol(p->dtd, file);	/* symbol will be freed */
+    fs = add_symbol_dtd_parser(p, file); /* symbol will be freed */
     set_file_dtd_parser(p, IN_FILE, fs->name);
   } else if ( PL_is_functor(option, FUNCTOR_line1) )
   { term_t a = PL_new_term_ref();
@@ -444,31 +672,38 @@ pl_set_sgml_parser(term_t parser, term_t option)
       return FALSE;
   } else if ( PL_is_functor(option, FUNCTOR_linepos1) )
   { term_t a = PL_new_term_ref();
+    int linepos;
 
     _PL_get_arg(1, option, a);
-    if ( !PL_get_integer_ex(a, &p->location.linepos) )
+    if ( !PL_get_integer_ex(a, &linepos) )
       return FALSE;
+    sgml_set_linepos(&p->location, linepos);
   } else if ( PL_is_functor(option, FUNCTOR_charpos1) )
   { term_t a = PL_new_term_ref();
+    int linepos = sgml_linepos(&p->location);
 
     _PL_get_arg(1, option, a);
     if ( !PL_get_long_ex(a, &p->location.charpos) )
       return FALSE;
+    sgml_set_linepos(&p->location, linepos);
   } else if ( PL_is_functor(option, FUNCTOR_position1) )
   { term_t a = PL_new_term_ref();
 
     _PL_get_arg(1, option, a);
     if ( PL_is_functor(a, FUNCTOR_dstream_position4) )
     { term_t arg = PL_new_term_ref();
+      int linepos;
 
       if ( !PL_get_arg(1,a,arg) || !PL_get_long_ex(arg, &p->location.charpos) ||
 	   !PL_get_arg(2,a,arg) || !PL_get_integer_ex(arg,  &p->location.line) ||
-	   !PL_get_arg(3,a,arg) || !PL_get_integer_ex(arg,  &p->location.linepos))
+	   !PL_get_arg(3,a,arg) || !PL_get_integer_ex(arg,  &linepos))
 	return FALSE;
+      sgml_set_linepos(&p->location, linepos);
     } else
       return PL_type_error("stream_position", a);
   } else if ( PL_is_functor(option, FUNCTOR_dialect1) )
   { term_t a = PL_new_term_ref();
+    dtd_dialect dialect;
     char *s;
 
     _PL_get_arg(1, option, a);
@@ -476,23 +711,30 @@ pl_set_sgml_parser(term_t parser, term_t option)
       return sgml2pl_error(ERR_TYPE, "atom", a);
 
     if ( streq(s, "xml") )
-      set_dialect_dtd(p->dtd, DL_XML);
+      dialect = DL_XML;
     else if ( streq(s, "xmlns") )
-      set_dialect_dtd(p->dtd, DL_XMLNS);
+      dialect = DL_XMLNS;
     else if ( streq(s, "sgml") )
-      set_dialect_dtd(p->dtd, DL_SGML);
+      dialect = DL_SGML;
     else if ( streq(s, "html") || streq(s, "html4") )
-      set_dialect_dtd(p->dtd, DL_HTML);
+      dialect = DL_HTML;
     else if ( streq(s, "html5") )
-      set_dialect_dtd(p->dtd, DL_HTML5);
+      dialect = DL_HTML5;
     else if ( streq(s, "xhtml") )
-      set_dialect_dtd(p->dtd, DL_XHTML);
+      dialect = DL_XHTML;
     else if ( streq(s, "xhtml5") )
-      set_dialect_dtd(p->dtd, DL_XHTML5);
+      dialect = DL_XHTML5;
     else
       return sgml2pl_error(ERR_DOMAIN, "sgml_dialect", a);
+
+    if ( !set_dialect_dtd(p->dtd, dialect) )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      set_dialect_dtd(p->dtd, dialect);
+    }
   } else if ( PL_is_functor(option, FUNCTOR_space1) )
   { term_t a = PL_new_term_ref();
+    dtd_space_mode m;
     char *s;
 
     _PL_get_arg(1, option, a);
@@ -500,16 +742,22 @@ pl_set_sgml_parser(term_t parser, term_t option)
       return sgml2pl_error(ERR_TYPE, "atom", a);
 
     if ( streq(s, "preserve") )
-      p->dtd->space_mode = SP_PRESERVE;
+      m = SP_PRESERVE;
     else if ( streq(s, "default") )
-      p->dtd->space_mode = SP_DEFAULT;
+      m = SP_DEFAULT;
     else if ( streq(s, "remove") )
-      p->dtd->space_mode = SP_REMOVE;
+      m = SP_REMOVE;
     else if ( streq(s, "sgml") )
-      p->dtd->space_mode = SP_SGML;
+      m = SP_SGML;
 
     else
       return sgml2pl_error(ERR_DOMAIN, "space", a);
+
+    if ( p->dtd->space_mode != m )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      p->dtd->space_mode = m;
+    }
   } else if ( PL_is_functor(option, FUNCTOR_defaults1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -534,6 +782,16 @@ pl_set_sgml_parser(term_t parser, term_t option)
       p->flags |= SGML_PARSER_QUALIFY_ATTS;
     else
       p->flags &= ~SGML_PARSER_QUALIFY_ATTS;
+  } else if ( PL_is_functor(option, FUNCTOR_shared_dtd1) )
+  { term_t a = PL_new_term_ref();
+    int val;
+
+    _PL_get_arg(1, option, a);
+    if ( !PL_get_bool(a, &val) )
+      return sgml2pl_error(ERR_TYPE, "boolean", a);
+
+    if ( !val && !writable_dtd(p) )
+      return FALSE;
   } else if ( PL_is_functor(option, FUNCTOR_shorttag1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -542,7 +800,11 @@ pl_set_sgml_parser(term_t parser, term_t option)
     if ( !PL_get_bool(a, &val) )
       return sgml2pl_error(ERR_TYPE, "boolean", a);
 
-    set_option_dtd(p->dtd, OPT_SHORTTAG, val);
+    if ( !set_option_dtd(p->dtd, OPT_SHORTTAG, val) )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      set_option_dtd(p->dtd, OPT_SHORTTAG, val);
+    }
   } else if ( PL_is_functor(option, FUNCTOR_case_sensitive_attributes1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -551,7 +813,11 @@ pl_set_sgml_parser(term_t parser, term_t option)
     if ( !PL_get_bool(a, &val) )
       return sgml2pl_error(ERR_TYPE, "boolean", a);
 
-    set_option_dtd(p->dtd, OPT_CASE_SENSITIVE_ATTRIBUTES, val);
+    if ( !set_option_dtd(p->dtd, OPT_CASE_SENSITIVE_ATTRIBUTES, val) )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      set_option_dtd(p->dtd, OPT_CASE_SENSITIVE_ATTRIBUTES, val);
+    }
   } else if ( PL_is_functor(option, FUNCTOR_case_preserving_attributes1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -560,7 +826,11 @@ pl_set_sgml_parser(term_t parser, term_t option)
     if ( !PL_get_bool(a, &val) )
       return sgml2pl_error(ERR_TYPE, "boolean", a);
 
-    set_option_dtd(p->dtd, OPT_CASE_PRESERVING_ATTRIBUTES, val);
+    if ( !set_option_dtd(p->dtd, OPT_CASE_PRESERVING_ATTRIBUTES, val) )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      set_option_dtd(p->dtd, OPT_CASE_PRESERVING_ATTRIBUTES, val);
+    }
   } else if ( PL_is_functor(option, FUNCTOR_system_entities1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -569,7 +839,11 @@ pl_set_sgml_parser(term_t parser, term_t option)
     if ( !PL_get_bool(a, &val) )
       return sgml2pl_error(ERR_TYPE, "boolean", a);
 
-    set_option_dtd(p->dtd, OPT_SYSTEM_ENTITIES, val);
+    if ( !set_option_dtd(p->dtd, OPT_SYSTEM_ENTITIES, val) )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      set_option_dtd(p->dtd, OPT_SYSTEM_ENTITIES, val);
+    }
   } else if ( PL_is_functor(option, FUNCTOR_max_memory1) )
   { term_t a = PL_new_term_ref();
     int val;
@@ -585,6 +859,7 @@ pl_set_sgml_parser(term_t parser, term_t option)
       p->cdata->limit = val;
   } else if ( PL_is_functor(option, FUNCTOR_number1) )
   { term_t a = PL_new_term_ref();
+    dtd_number_mode m;
     char *s;
 
     _PL_get_arg(1, option, a);
@@ -592,11 +867,17 @@ pl_set_sgml_parser(term_t parser, term_t option)
       return sgml2pl_error(ERR_TYPE, "atom", a);
 
     if ( streq(s, "token") )
-      p->dtd->number_mode = NU_TOKEN;
+      m = NU_TOKEN;
     else if ( streq(s, "integer") )
-      p->dtd->number_mode = NU_INTEGER;
+      m = NU_INTEGER;
     else
       return sgml2pl_error(ERR_DOMAIN, "number", a);
+
+    if ( p->dtd->number_mode != m )
+    { if ( !writable_dtd(p) )
+	return FALSE;
+      p->dtd->number_mode = m;
+    }
   } else if ( PL_is_functor(option, FUNCTOR_encoding1) )
   { term_t a = PL_new_term_ref();
     char *val;
@@ -617,7 +898,7 @@ pl_set_sgml_parser(term_t parser, term_t option)
     { if ( !PL_get_wchars(a, NULL, &s, CVT_ATOM) )
 	return sgml2pl_error(ERR_TYPE, "atom_or_variable", a);
 
-      p->enforce_outer_element = dtd_add_symbol(p->dtd, s);
+      p->enforce_outer_element = add_symbol_dtd_parser(p, s);
     }
   } else if ( PL_is_functor(option, FUNCTOR_xmlns1) )
   { term_t a = PL_new_term_ref();
@@ -764,8 +1045,8 @@ pl_get_sgml_parser(term_t parser, term_t option)
 
     if ( env )
     { for( ; env; env = env->parent)
-      { dtd_element *buf[256];		/* MAX_VISITED! */
-	int n = sizeof(buf)/sizeof(dtd_element *); /* not yet used! */
+      { dtd_element *buf[256];
+	int n = sizeof(buf)/sizeof(dtd_element *);
 	int i;
 
 	state_allows_for(env->state, buf, &n);
@@ -821,6 +1102,29 @@ pl_get_sgml_parser(term_t parser, term_t option)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+process_buffer_dtd_parser() runs over a block of input and only returns
+to us at its end. If a callback  raises   an  exception or decides the
+requested part of the input is complete we must tell the parser to stop
+using p->halted.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static term_t
+callback_exception(parser_data *pd)
+{ if ( (pd->exception = PL_exception(0)) )
+    pd->parser->halted = TRUE;
+
+  return pd->exception;
+}
+
+
+static void
+stop_parser(parser_data *pd)
+{ pd->stopped = TRUE;
+  pd->parser->halted = TRUE;
+}
+
+
 static int
 call_prolog(parser_data *pd, predicate_t pred, term_t av)
 { qid_t qid = PL_open_query(NULL, PL_Q_PASS_EXCEPTION, pred, av);
@@ -831,8 +1135,8 @@ call_prolog(parser_data *pd, predicate_t pred, term_t av)
   if ( rc )
   { pd->exception = FALSE;
   } else
-  { if ( (pd->exception = PL_exception(0)) )
-      pd->stopped = TRUE;
+  { if ( callback_exception(pd) )
+      stop_parser(pd);
   }
 
   return rc;
@@ -848,72 +1152,190 @@ end_frame(fid_t fid, term_t ex)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+call(events, Pred) collects begin(Tag, Attributes), end(Tag) and text(Text)
+terms in pd->events, a vector of  event_batch term-references, and calls
+Pred(Events, Parser) once for each  full   vector  and  for the remaining
+events at the end of sgml_parse/2. The events  are delivered after they
+have been parsed, so the handler cannot  parse   part  of the document
+using a recursive call to sgml_parse/2.
+
+As with call(end, Pred), failure of  Pred   is  ignored. An exception
+stops the parser and is passed to the   caller of sgml_parse/2. This is
+the case for a full vector in put_event() as well as for the final call
+of flush_events() in pl_sgml_parse().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+flush_events(parser_data *pd)
+{ int n = pd->event_count;
+  fid_t fid;
+  int rc = FALSE;
+
+  if ( n == 0 )
+    return TRUE;
+  pd->event_count = 0;
+
+  if ( (fid = PL_open_foreign_frame()) )
+  { term_t av = PL_new_term_refs(2);
+    int i;
+
+    rc = TRUE;
+    PL_put_nil(av+0);
+    for(i=n; rc && i-- > 0; )
+      rc = PL_cons_list(av+0, pd->events+i, av+0);
+
+    rc = ( rc &&
+	   unify_parser(av+1, pd->parser) &&
+	   call_prolog(pd, pd->on_events, av) );
+    end_frame(fid, pd->exception);
+  }
+
+  return rc;
+}
+
+
+static int
+put_event(parser_data *pd, functor_t f, term_t av)
+{ if ( pd->event_count == pd->event_batch &&
+       !flush_events(pd) && pd->exception )
+    return FALSE;
+
+  return PL_cons_functor_v(pd->events + pd->event_count++, f, av);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 put_url(dtd_parser *p, term_t t, const ichar *url)
     Store the url-part of a name-space qualifier in term.  We call
     xml:xmlns(-Canonical, +Full) trying to resolve the specified
     namespace to an internal canonical namespace.
 
-    We do a little caching as there will generally be only a very
-    small pool of urls in use.  We assume the url-pointers we get
-    life for the time of the parser.  It might be possible that
-    multiple url pointers point to the same url, but this only clobbers
-    the cache a little.
+    The result is cached in a hash-table of the parser that is kept
+    between documents and freed with the parser (see free_url_cache()).
+    The key is the URL pointer, which is the name of a symbol of the DTD
+    or the overlay of the parser and thus lives as long as the parser.
+    Multiple pointers for the same URL only cost a few extra entries.
+    The table is cleared if the urlns hook changes.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-#define URL_CACHE 4			/* # entries cached */
+#define URL_HASH(u) \
+	((unsigned int)(((uintptr_t)(u) >> 2) * 2654435761U))
 
 typedef struct
 { const ichar *url;			/* URL pointer */
-  atom_t canonical;
+  atom_t canonical;			/* atom to report for url */
+} url_entry;
+
+typedef struct
+{ predicate_t	hook;			/* urlns hook of the entries */
+  int		size;			/* # slots (power of 2) */
+  int		count;			/* # used slots */
+  url_entry    *entries;		/* the slots */
 } url_cache;
 
-static url_cache cache[URL_CACHE];
 
 static void
-reset_url_cache()
+clear_url_cache(url_cache *c)
 { int i;
-  url_cache *c = cache;
 
-  for(i=0; i<URL_CACHE; i++)
-  { c[i].url = NULL;
-    if ( c[i].canonical )
-      PL_unregister_atom(c[i].canonical);
-    c[i].canonical = 0;
+  for(i=0; i<c->size; i++)
+  { if ( c->entries[i].url )
+    { PL_unregister_atom(c->entries[i].canonical);
+      c->entries[i].url = NULL;
+    }
+  }
+  c->count = 0;
+}
+
+
+static void
+free_url_cache(dtd_parser *p)
+{ url_cache *c;
+
+  if ( (c = p->client_data) )
+  { clear_url_cache(c);
+    if ( c->entries )
+      sgml_free(c->entries);
+    sgml_free(c);
+    p->client_data = NULL;
   }
 }
 
 
+static url_entry *
+lookup_url(url_cache *c, const ichar *url)
+{ int k;
+  url_entry *e;
+
+  for(k=URL_HASH(url) & (c->size-1);
+      (e=&c->entries[k])->url;
+      k = (k+1) & (c->size-1))
+  { if ( e->url == url )
+      return e;
+  }
+
+  return e;				/* free slot */
+}
+
+
+static void
+add_url(url_cache *c, const ichar *url, atom_t canonical)
+{ url_entry *e;
+
+  if ( c->count*4 >= c->size*3 )
+  { int osize = c->size;
+    url_entry *old = c->entries;
+    int i;
+
+    c->size = (osize ? osize*2 : 16);
+    c->entries = sgml_calloc(c->size, sizeof(url_entry));
+    for(i=0; i<osize; i++)
+    { if ( old[i].url )
+	*lookup_url(c, old[i].url) = old[i];
+    }
+    if ( old )
+      sgml_free(old);
+  }
+
+  e = lookup_url(c, url);
+  e->url = url;
+  e->canonical = canonical;
+  c->count++;
+}
+
+
 WUNUSED static int
 put_url(dtd_parser *p, term_t t, const ichar *url)
 { parser_data *pd = p->closure;
+  url_cache *c;
   fid_t fid;
-  int i;
+  atom_t a;
 
-  if ( !pd->on_urlns )
-    return put_atom_wchars(t, url);
+  if ( !(c = p->client_data) )
+    p->client_data = c = sgml_calloc(1, sizeof(*c));
+  if ( c->hook != pd->on_urlns )
+  { clear_url_cache(c);
+    c->hook = pd->on_urlns;
+  }
 
-  for(i=0; i<URL_CACHE; i++)
-  { if ( cache[i].url == url )		/* cache hit */
-    { if ( cache[i].canonical )		/* and a canonical value */
-	return PL_put_atom(t, cache[i].canonical);
-      else
-	return put_atom_wchars(t, url);
-    }
+  if ( c->size )
+  { url_entry *e = lookup_url(c, url);
+
+    if ( e->url )			/* cache hit */
+      return PL_put_atom(t, e->canonical);
+  }
+
+  if ( !pd->on_urlns )
+  { if ( !(a = PL_new_atom_wchars(wcslen(url), url)) )
+      return FALSE;
+    add_url(c, url, a);
+    return PL_put_atom(t, a);
   }
-					/* shift the cache */
-  i = URL_CACHE-1;
-  if ( cache[i].canonical )
-    PL_unregister_atom(cache[i].canonical);
-  for(i=URL_CACHE-1; i>0; i--)
-    cache[i] = cache[i-1];
-  cache[0].url = url;
-  cache[0].canonical = 0;
 
   if ( (fid = PL_open_foreign_frame()) )
   { int rc;
     term_t av = PL_new_term_refs(3);
-    atom_t a;
 
     rc = (put_atom_wchars(av+0, url) &&
 	  unify_parser(av+2, p));
@@ -922,13 +1344,17 @@ put_url(dtd_parser *p, term_t t, const ichar *url)
 	 PL_call_predicate(NULL, PL_Q_NORMAL, pd->on_urlns, av) &&
 	 PL_get_atom(av+1, &a) )
     { PL_register_atom(a);
-      cache[0].canonical = a;
-      PL_put_atom(t, a);
     } else if ( rc )
-    { rc = put_atom_wchars(t, url);
+    { a = PL_new_atom_wchars(wcslen(url), url);
+      rc = (a != 0);
     }
     PL_discard_foreign_frame(fid);
 
+    if ( rc )
+    { add_url(c, url, a);
+      PL_put_atom(t, a);
+    }
+
     return rc;
   }
 
@@ -948,12 +1374,12 @@ put_attribute_name(dtd_parser *p, term_t t, dtd_symbol *nm)
 
       return ( (av=PL_new_term_refs(2)) &&
 	       put_url(p, av+0, url) &&
-	       put_atom_wchars(av+1, local) &&
+	       put_symbol_name(p, av+1, nm, local) &&
 	       PL_cons_functor_v(t, FUNCTOR_ns2, av) );
     } else
-      return put_atom_wchars(t, local);
+      return put_symbol_name(p, t, nm, local);
   } else
-    return put_atom_wchars(t, nm->name);
+    return put_symbol_name(p, t, nm, nm->name);
 }
 
 
@@ -970,12 +1396,12 @@ put_element_name(dtd_parser *p, term_t t, dtd_element *e)
 
       return ( (av=PL_new_term_refs(2)) &&
 	       put_url(p, av+0, url) &&
-	       put_atom_wchars(av+1, local) &&
+	       put_symbol_name(p, av+1, e->name, local) &&
 	       PL_cons_functor_v(t, FUNCTOR_ns2, av) );
     } else
-      return put_atom_wchars(t, local);
+      return put_symbol_name(p, t, e->name, local);
   } else
-    return put_atom_wchars(t, e->name->name);
+    return put_symbol_name(p, t, e->name, e->name->name);
 }
 
 
@@ -1023,9 +1449,66 @@ put_att_text(term_t t, sgml_attribute *a)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Default attribute values are shared by  all   elements  of a type. Those
+that are a single atom are created once  per parse and kept in the hash
+table pd->default_atoms, keyed by the attribute definition. The atoms
+of a frozen DTD are created when it is frozen (see freeze_default_atoms()).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define DEFAULT_ATOM_HASH(d) \
+	((unsigned int)(((uintptr_t)(d) >> 3) * 2654435761U))
+
+static atom_t
+default_value_atom(parser_data *pd, sgml_attribute *a)
+{ unsigned int k;
+  default_atom *da;
+
+  if ( a->definition->handle )		/* frozen DTD */
+    return (atom_t)a->definition->handle;
+
+  if ( pd->default_atoms_count*2 >= pd->default_atoms_size )
+  { int osize = pd->default_atoms_size;
+    default_atom *old = pd->default_atoms;
+    int i;
+
+    pd->default_atoms_size = (osize ? osize*2 : 32);
+    pd->default_atoms = sgml_calloc(pd->default_atoms_size,
+				    sizeof(default_atom));
+    for(i=0; i<osize; i++)
+    { if ( old[i].definition )
+      { for(k=DEFAULT_ATOM_HASH(old[i].definition)&(pd->default_atoms_size-1);
+	    pd->default_atoms[k].definition;
+	    k = (k+1) & (pd->default_atoms_size-1))
+	  ;
+	pd->default_atoms[k] = old[i];
+      }
+    }
+    if ( old )
+      sgml_free(old);
+  }
+
+  for(k=DEFAULT_ATOM_HASH(a->definition) & (pd->default_atoms_size-1);
+      (da=&pd->default_atoms[k])->definition;
+      k = (k+1) & (pd->default_atoms_size-1))
+  { if ( da->definition == a->definition )
+      return da->value;
+  }
+
+  da->definition = a->definition;
+  da->value = PL_new_atom_wchars(a->value.number, a->value.textW);
+  pd->default_atoms_count++;
+
+  return da->value;
+}
+
+
 static int
 put_attribute_value(dtd_parser *p, term_t t, sgml_attribute *a)
-{ switch(a->definition->type)
+{ if ( p->closure && is_default_atom(a) )
+    return PL_put_atom(t, default_value_atom(p->closure, a));
+
+  switch(a->definition->type)
   { case AT_CDATA:
       return put_att_text(t, a);
     case AT_NUMBER:
@@ -1124,6 +1607,110 @@ unify_attribute_list(dtd_parser *p, term_t alist,
   return FALSE;
 }
 
+		 /*******************************
+		 *	   DOM CONSTRUCTION	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The document(DOM) term is built  bottom-up.   Completed  nodes  are kept as
+term-references in pd->children. pd->stack  holds   a  vector  of  three
+term-references (name, attributes and  content)   for  each open element
+together with the index of  its  first   child.  Closing  an element
+conses its content list from the children in one pass, creates element/3
+and releases the term-references of the  children, leaving the element
+as a child of its parent.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+add_child(parser_data *pd, term_t t)
+{ if ( pd->children_top == pd->children_size )
+  { pd->children_size = (pd->children_size ? pd->children_size*2 : 64);
+    pd->children = sgml_realloc(pd->children,
+				pd->children_size*sizeof(term_t));
+  }
+
+  pd->children[pd->children_top++] = t;
+}
+
+
+static term_t
+new_child(parser_data *pd)
+{ term_t t;
+
+  if ( (t = PL_new_term_ref()) )
+    add_child(pd, t);
+
+  return t;
+}
+
+
+static int
+put_children(parser_data *pd, term_t list, int from)
+{ int i;
+
+  PL_put_nil(list);
+  for(i=pd->children_top; i-- > from; )
+  { if ( !PL_cons_list(list, pd->children[i], list) )
+      return FALSE;
+  }
+  pd->children_top = from;
+
+  return TRUE;
+}
+
+
+static void
+open_dom_element(parser_data *pd, term_t av)
+{ env *env;
+
+  if ( pd->stack_top == pd->stack_size )
+  { pd->stack_size = (pd->stack_size ? pd->stack_size*2 : 32);
+    pd->stack = sgml_realloc(pd->stack, pd->stack_size*sizeof(env));
+  }
+
+  env = &pd->stack[pd->stack_top++];
+  env->element  = av;
+  env->children = pd->children_top;
+}
+
+
+static int
+close_dom_element(parser_data *pd)
+{ env *env = &pd->stack[--pd->stack_top];
+  term_t av = env->element;
+
+  if ( !put_children(pd, av+2, env->children) ||
+       !PL_cons_functor_v(av, FUNCTOR_element3, av) )
+    return FALSE;
+
+  PL_reset_term_refs(av+1);		/* also frees the children */
+  add_child(pd, av);
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+unify_document() closes elements that are  still   open  (the  parse was
+stopped or did not complete the input) and unifies the document(DOM)
+argument with the list of toplevel nodes.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+unify_document(parser_data *pd)
+{ term_t list;
+
+  while( pd->stack_top > 0 )
+  { if ( !close_dom_element(pd) )
+      return FALSE;
+  }
+
+  return ( (list = PL_new_term_ref()) &&
+	   put_children(pd, list, 0) &&
+	   PL_unify(pd->list, list) );
+}
+
+
 static int
 on_begin(dtd_parser *p, dtd_element *e, int argc, sgml_attribute *argv)
 { parser_data *pd = p->closure;
@@ -1131,6 +1718,23 @@ on_begin(dtd_parser *p, dtd_element *e, int argc, sgml_attribute *argv)
   if ( pd->stopped )
     return TRUE;
 
+  if ( pd->on_events )
+  { fid_t fid;
+
+    if ( (fid = PL_open_foreign_frame()) )
+    { int rc;
+      term_t av = PL_new_term_refs(2);
+
+      rc = ( put_element_name(p, av+0, e) &&
+	     unify_attribute_list(p, av+1, argc, argv) &&
+	     put_event(pd, FUNCTOR_begin2, av) );
+
+      PL_close_foreign_frame(fid);
+      if ( !rc && callback_exception(pd) )
+	return FALSE;
+    }
+  }
+
   if ( pd->on_begin )
   { fid_t fid;
 
@@ -1149,44 +1753,21 @@ on_begin(dtd_parser *p, dtd_element *e, int argc, sgml_attribute *argv)
 	goto ok;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 ok:
-  if ( pd->tail )
-  { term_t content = PL_new_term_ref();	/* element content */
-    term_t alist   = PL_new_term_ref();	/* attribute list */
-    term_t et	   = PL_new_term_ref();	/* element structure */
-    term_t h       = PL_new_term_ref();
-
-    if ( !h ||
-	 !put_element_name(p, h, e) ||
-	 !unify_attribute_list(p, alist, argc, argv) ||
-	 !PL_unify_term(et,
-			PL_FUNCTOR, FUNCTOR_element3,
-			  PL_TERM, h,
-			  PL_TERM, alist,
-			  PL_TERM, content) )
-    { pd->exception = PL_exception(0);
-      return FALSE;
-    }
-
-    if ( PL_unify_list(pd->tail, h, pd->tail) &&
-	 PL_unify(h, et) )
-    { env *env = sgml_calloc(1, sizeof(*env));
+  if ( pd->list )
+  { term_t av;				/* name, attributes, content */
 
-      env->tail   = pd->tail;
-      env->parent = pd->stack;
-      pd->stack   = env;
-
-      pd->tail = content;
-      PL_reset_term_refs(alist);
-
-      return TRUE;
+    if ( !(av = PL_new_term_refs(3)) ||
+	 !put_element_name(p, av+0, e) ||
+	 !unify_attribute_list(p, av+1, argc, argv) )
+    { callback_exception(pd);
+      return FALSE;
     }
 
-    pd->exception = PL_exception(0);
-    return FALSE;
+    open_dom_element(pd, av);
   }
 
   return TRUE;
@@ -1199,6 +1780,22 @@ on_end(dtd_parser *p, dtd_element *e)
   if ( pd->stopped )
     return TRUE;
 
+  if ( pd->on_events )
+  { fid_t fid;
+
+    if ( (fid = PL_open_foreign_frame()) )
+    { int rc;
+      term_t av = PL_new_term_refs(1);
+
+      rc = ( put_element_name(p, av+0, e) &&
+	     put_event(pd, FUNCTOR_end1, av) );
+
+      PL_close_foreign_frame(fid);
+      if ( !rc && callback_exception(pd) )
+	return FALSE;
+    }
+  }
+
   if ( pd->on_end )
   { fid_t fid;
 
@@ -1216,30 +1813,33 @@ on_end(dtd_parser *p, dtd_element *e)
 	goto ok;
     }
 
-    if ( (pd->exception = PL_exception(0)) )
+    if ( callback_exception(pd) )
       return FALSE;
   }
 
 ok:
-  if ( pd->tail && !pd->stopped )
-  { if ( !PL_unify_nil(pd->tail) )
-      return FALSE;
-    PL_reset_term_refs(pd->tail);	/* ? */
+  if ( pd->list && !pd->stopped )
+  { int rc;
 
-    if ( pd->stack )
-    { env *parent = pd->stack->parent;
+    if ( pd->stack_top > 0 )
+    { rc = close_dom_element(pd);
+    } else				/* closes an element opened before */
+    { rc = unify_document(pd);		/* this call: the DOM is complete */
+      pd->list = 0;
+      if ( pd->stopat == SA_CONTENT )
+	stop_parser(pd);
+    }
 
-      pd->tail = pd->stack->tail;
-      sgml_free(pd->stack);
-      pd->stack = parent;
-    } else
-    { if ( pd->stopat == SA_CONTENT )
-	pd->stopped = TRUE;
+    if ( !rc )				/* sgml_parse/2 fails at the end */
+    { pd->list = 0;
+      pd->list_failed = TRUE;
+      if ( callback_exception(pd) )
+	return FALSE;
     }
   }
 
   if ( pd->stopat == SA_ELEMENT && !p->environments->parent )
-    pd->stopped = TRUE;
+    stop_parser(pd);
 
   return TRUE;
 }
@@ -1274,17 +1874,16 @@ on_entity(dtd_parser *p, dtd_entity *e, int chr)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
-  if ( pd->tail )
+  if ( pd->list )
   { int rc;
-    term_t h = PL_new_term_ref();
+    term_t h;
 
-    if ( !h ||
-	 !PL_unify_list(pd->tail, h, pd->tail) )
-    { pd->exception = PL_exception(0);
+    if ( !(h = new_child(pd)) )
+    { callback_exception(pd);
       return FALSE;
     }
 
@@ -1297,9 +1896,8 @@ on_entity(dtd_parser *p, dtd_entity *e, int chr)
 			 PL_FUNCTOR, FUNCTOR_entity1,
 			   PL_INT, chr);
 
-    PL_reset_term_refs(h);
     if ( !rc )
-      pd->exception = PL_exception(0);
+      callback_exception(pd);
 
     return rc;
   }
@@ -1308,10 +1906,41 @@ on_entity(dtd_parser *p, dtd_entity *e, int chr)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Character data arrives either as  UCS  or,   if  all  characters  fit, as
+ISO Latin-1. Exactly one of wdata and ldata is non-NULL.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static int
-on_data(dtd_parser *p, data_type type, int len, const wchar_t *data)
+unify_text(term_t t, int len, const wchar_t *wdata, const unsigned char *ldata)
+{ if ( ldata )
+    return PL_unify_chars(t, PL_ATOM|REP_ISO_LATIN_1, len, (const char*)ldata);
+
+  return PL_unify_wchars(t, PL_ATOM, len, wdata);
+}
+
+
+static int
+on_text(dtd_parser *p, data_type type, int len,
+	const wchar_t *wdata, const unsigned char *ldata)
 { parser_data *pd = p->closure;
 
+  if ( pd->on_events && !pd->stopped )
+  { fid_t fid;
+
+    if ( (fid = PL_open_foreign_frame()) )
+    { int rc;
+      term_t av = PL_new_term_refs(1);
+
+      rc = ( unify_text(av+0, len, wdata, ldata) &&
+	     put_event(pd, FUNCTOR_text1, av) );
+
+      PL_close_foreign_frame(fid);
+      if ( !rc && callback_exception(pd) )
+	return FALSE;
+    }
+  }
+
   if ( pd->on_cdata )
   { fid_t fid;
 
@@ -1319,7 +1948,7 @@ on_data(dtd_parser *p, data_type type, int len, const wchar_t *data)
     { int rc;
       term_t av = PL_new_term_refs(2);
 
-      rc = ( PL_unify_wchars(av+0, PL_ATOM, len, data) &&
+      rc = ( unify_text(av+0, len, wdata, ldata) &&
 	     unify_parser(av+1, p) &&
 	     call_prolog(pd, pd->on_cdata, av) );
 
@@ -1328,14 +1957,14 @@ on_data(dtd_parser *p, data_type type, int len, const wchar_t *data)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
-  if ( pd->tail && !pd->stopped )
-  { term_t h = PL_new_term_ref();
+  if ( pd->list && !pd->stopped )
+  { term_t h;
 
-    if ( PL_unify_list(pd->tail, h, pd->tail) )
+    if ( (h = new_child(pd)) )
     { int rval = TRUE;
       term_t a;
 
@@ -1363,13 +1992,12 @@ on_data(dtd_parser *p, data_type type, int len, const wchar_t *data)
       }
 
       if ( rval )
-	rval = PL_unify_wchars(a, PL_ATOM, len, data);
+	rval = unify_text(a, len, wdata, ldata);
 
       if ( rval )
-      { PL_reset_term_refs(h);
-	return TRUE;
+      { return TRUE;
       } else
-      { pd->exception = PL_exception(0);
+      { callback_exception(pd);
       }
     }
   }
@@ -1380,7 +2008,14 @@ on_data(dtd_parser *p, data_type type, int len, const wchar_t *data)
 
 static int
 on_cdata(dtd_parser *p, data_type type, int len, const wchar_t *data)
-{ return on_data(p, type, len, data);
+{ return on_text(p, type, len, data, NULL);
+}
+
+
+static int
+on_latin1_cdata(dtd_parser *p, data_type type, int len,
+		const unsigned char *data)
+{ return on_text(p, type, len, NULL, data);
 }
 
 
@@ -1412,7 +2047,7 @@ on_error(dtd_parser *p, dtd_error *error)
        can_end_omitted(p) )
   { end_document_dtd_parser(p);
     sgml_cplocation(&p->location, &p->startloc);
-    pd->stopped = TRUE;
+    stop_parser(pd);
     return TRUE;
   }
 
@@ -1428,7 +2063,8 @@ on_error(dtd_parser *p, dtd_error *error)
       break;
     case ERS_ERROR:
     default:				/* make compiler happy */
-      pd->errors++;
+      if ( ++pd->errors > pd->max_errors && pd->max_errors >= 0 )
+	p->halted = TRUE;
       severity = "error";
       break;
   }
@@ -1451,7 +2087,7 @@ on_error(dtd_parser *p, dtd_error *error)
       if ( rc )
 	return TRUE;
     }
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   } else if ( pd->error_mode != EM_QUIET )
   { fid_t fid;
@@ -1469,7 +2105,7 @@ on_error(dtd_parser *p, dtd_error *error)
 			     PL_FUNCTOR, FUNCTOR_file4,
 			       PL_NWCHARS, (size_t)-1, l->name.file,
 			       PL_INT,   l->line,
-			       PL_INT,   l->linepos,
+			       PL_INT,   sgml_linepos(l),
 			       PL_INT64, (int64_t)l->charpos);
 	if ( rc )
 	  rc = PL_unify_term(ex,
@@ -1518,7 +2154,7 @@ on_error(dtd_parser *p, dtd_error *error)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
@@ -1560,7 +2196,7 @@ on_xmlns(dtd_parser *p, dtd_symbol *ns, dtd_symbol *url)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
@@ -1592,27 +2228,24 @@ on_pi(dtd_parser *p, const ichar *pi)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
-  if ( pd->tail )
+  if ( pd->list )
   { term_t h;
 
-    if ( !(h = PL_new_term_ref()) ||
-	 !PL_unify_list(pd->tail, h, pd->tail) )
-    { pd->exception = PL_exception(0);
+    if ( !(h = new_child(pd)) )
+    { callback_exception(pd);
       return FALSE;
     }
 
     if ( !PL_unify_term(h,
 			PL_FUNCTOR, FUNCTOR_pi1,
 			  PL_NWCHARS, wcslen(pi), pi) )
-    { pd->exception = PL_exception(0);
+    { callback_exception(pd);
       return FALSE;
     }
-
-    PL_reset_term_refs(h);
   }
 
   return TRUE;
@@ -1644,12 +2277,12 @@ on_decl(dtd_parser *p, const ichar *decl)
 	return TRUE;
     }
 
-    pd->exception = PL_exception(0);
+    callback_exception(pd);
     return FALSE;
   }
 
   if ( pd->stopat == SA_DECL )
-    pd->stopped = TRUE;
+    stop_parser(pd);
 
   return TRUE;
 }
@@ -1658,8 +2291,6 @@ on_decl(dtd_parser *p, const ichar *decl)
 static int
 write_parser(void *h, char *buf, int len)
 { parser_data *pd = h;
-  unsigned char *s = (unsigned char *)buf;
-  unsigned char *e = s+len;
 
   if ( !pd->parser || pd->parser->magic != SGML_PARSER_MAGIC )
   { errno = EINVAL;
@@ -1671,42 +2302,58 @@ write_parser(void *h, char *buf, int len)
     return -1;
   }
 
-  for(; s<e; s++)
-  { putchar_dtd_parser(pd->parser, *s);
-    if ( pd->exception )
-      break;
-  }
+  pd->parser->halted = FALSE;
+  process_buffer_dtd_parser(pd->parser, buf, len);
 
   return len;
 }
 
 
+static void
+free_parser_data(parser_data *pd)
+{ int i;
+
+  if ( pd->stack )
+    sgml_free(pd->stack);
+  if ( pd->children )
+    sgml_free(pd->children);
+  for(i=0; i<pd->default_atoms_size; i++)
+  { if ( pd->default_atoms[i].definition )
+      PL_unregister_atom(pd->default_atoms[i].value);
+  }
+  if ( pd->default_atoms )
+    sgml_free(pd->default_atoms);
+
+  sgml_free(pd);
+}
+
+
 static int
 close_parser(void *h)
 { parser_data *pd = h;
   dtd_parser *p;
+  int rval = 0;
 
   if ( !(p=pd->parser) || p->magic != SGML_PARSER_MAGIC )
   { errno = EINVAL;
     return -1;
   }
 
-  if ( pd->tail )
-  { if ( !PL_unify_nil(pd->tail) )
-      return -1;			/* resource error */
-  }
+  if ( pd->list && !unify_document(pd) )
+    rval = -1;				/* resource error */
 
   if ( p->dmode == DM_DTD )
     p->dtd->implicit = FALSE;		/* assume we loaded a DTD */
 
   if ( pd->free_on_close )
+  { free_url_cache(p);
     free_dtd_parser(p);
-  else
+  } else
     p->closure = NULL;
 
-  sgml_free(pd);
+  free_parser_data(pd);
 
-  return 0;
+  return rval;
 }
 
 
@@ -1728,6 +2375,7 @@ new_parser_data(dtd_parser *p)
   pd->parser = p;
   pd->max_errors = MAX_ERRORS;
   pd->max_warnings = MAX_WARNINGS;
+  pd->event_batch = EVENT_BATCH;
   pd->error_mode = EM_PRINT;
   pd->exception = FALSE;
   p->closure = pd;
@@ -1747,6 +2395,8 @@ pl_open_dtd(term_t ref, term_t options, term_t stream)
 
   if ( !get_dtd(ref, &dtd) )
     return FALSE;
+  if ( dtd->frozen )
+    return sgml2pl_error(ERR_MISC, "sgml", "Cannot modify a frozen DTD");
   p = new_dtd_parser(dtd);
   p->dmode = DM_DTD;
   pd = new_parser_data(p);
@@ -1829,6 +2479,9 @@ set_callback_predicates(parser_data *pd, term_t option)
   } else if ( streq(fname, "decl") )
   { pp = &pd->on_decl;			/* decl, parser */
     arity = 2;
+  } else if ( streq(fname, "events") )
+  { pp = &pd->on_events;		/* events, parser */
+    arity = 2;
   } else
     return sgml2pl_error(ERR_DOMAIN, "sgml_callback", a);
 
@@ -1837,6 +2490,38 @@ set_callback_predicates(parser_data *pd, term_t option)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If the input is a binary stream,  pl_sgml_parse()   passes  the buffer of
+the stream to process_buffer_dtd_parser() as a whole, rather than reading
+it using Sgetcode(). The last byte of the buffer is left to the character
+loop, which knows whether it is the last   of the input. This is not
+possible if there are callbacks, as these may  call sgml_parse/2 on the
+same stream recursively.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+block_input(parser_data *pd, IOSTREAM *in)
+{ if ( in->encoding != ENC_OCTET )
+    return FALSE;
+
+  return !( pd->on_begin || pd->on_end || pd->on_cdata || pd->on_entity ||
+	    pd->on_pi || pd->on_xmlns || pd->on_urlns || pd->on_error ||
+	    pd->on_decl || pd->on_events );
+}
+
+
+static void
+skip_input(IOSTREAM *in, size_t n)
+{ if ( in->position )
+  { size_t i;
+
+    for(i=0; i<n; i++)
+      S__fupdatefilepos_getc(in, in->bufp[i]&0xff);
+  }
+  in->bufp += n;
+}
+
+
 static foreign_t
 pl_sgml_parse(term_t parser, term_t options)
 { dtd_parser *p;
@@ -1861,9 +2546,21 @@ pl_sgml_parse(term_t parser, term_t options)
     if ( oldpd->magic != PD_MAGIC || oldpd->parser != p )
       return sgml2pl_error(ERR_MISC, "sgml",
 			   "Parser associated with illegal data");
+    if ( !flush_events(oldpd) && oldpd->exception )
+      return FALSE;			/* keep the events in order */
 
     pd = sgml_calloc(1, sizeof(*pd));
     *pd = *oldpd;
+    pd->events = 0;			/* owned by oldpd */
+    pd->list = 0;			/* only for our own document(DOM) */
+    pd->list_failed = FALSE;
+    pd->stack = NULL;			/* owned by oldpd */
+    pd->stack_top = pd->stack_size = 0;
+    pd->children = NULL;		/* idem */
+    pd->children_top = pd->children_size = 0;
+    pd->default_atoms = NULL;		/* idem */
+    pd->default_atoms_size = 0;
+    pd->default_atoms_count = 0;
     p->closure = pd;
 
     in = pd->source;
@@ -1878,6 +2575,7 @@ pl_sgml_parse(term_t parser, term_t options)
     p->on_entity	= on_entity;
     p->on_pi		= on_pi;
     p->on_data          = on_cdata;
+    p->on_latin1_data   = on_latin1_cdata;
     p->on_error	        = on_error;
     p->on_xmlns		= on_xmlns;
     p->on_decl		= on_decl;
@@ -1889,8 +2587,6 @@ pl_sgml_parse(term_t parser, term_t options)
   { if ( PL_is_functor(head, FUNCTOR_document1) )
     { pd->list  = PL_new_term_ref();
       _PL_get_arg(1, head, pd->list);
-      pd->tail  = PL_copy_term_ref(pd->list);
-      pd->stack = NULL;
     } else if ( PL_is_functor(head, FUNCTOR_source1) )
     { term_t a = PL_new_term_ref();
 
@@ -1907,6 +2603,14 @@ pl_sgml_parse(term_t parser, term_t options)
     } else if ( PL_is_functor(head, FUNCTOR_call2) )
     { if ( !set_callback_predicates(pd, head) )
 	return FALSE;
+    } else if ( PL_is_functor(head, FUNCTOR_event_batch1) )
+    { term_t a = PL_new_term_ref();
+
+      _PL_get_arg(1, head, a);
+      if ( !PL_get_integer(a, &pd->event_batch) )
+	return sgml2pl_error(ERR_TYPE, "integer", a);
+      if ( pd->event_batch < 1 )
+	return sgml2pl_error(ERR_DOMAIN, "event_batch", a);
     } else if ( PL_is_functor(head, FUNCTOR_xml_no_ns1) )
     { term_t a = PL_new_term_ref();
       char *s;
@@ -1979,6 +2683,9 @@ pl_sgml_parse(term_t parser, term_t options)
   }
   if ( !PL_get_nil(tail) )
     return sgml2pl_error(ERR_TYPE, "list", tail);
+  if ( pd->on_events && !pd->events &&
+       !(pd->events = PL_new_term_refs(pd->event_batch)) )
+    return FALSE;
 
 					/* Parsing input from a stream */
 #define CHECKERROR \
@@ -1997,6 +2704,7 @@ pl_sgml_parse(term_t parser, term_t options)
 
   if ( in )
   { int eof = FALSE;
+    int blocks;
 
     if ( in->encoding == ENC_OCTET )
       p->encoded = TRUE;		/* parser must decode */
@@ -2004,15 +2712,40 @@ pl_sgml_parse(term_t parser, term_t options)
       p->encoded = FALSE;		/* already decoded */
 
     pd->stopped = FALSE;
+    p->halted = FALSE;
 
     if ( !recursive )
     { pd->source = in;
       begin_document_dtd_parser(p);
     }
+    blocks = block_input(pd, in);
 
     while(!eof)
     { int c, ateof;
 
+      if ( blocks )
+      { size_t n = in->limitp - in->bufp;
+
+	if ( has_content_length && (int64_t)n > content_length )
+	  n = (size_t)content_length;
+	if ( n > 1 )			/* last byte: see below */
+	{ size_t done;
+
+	  if ( PL_handle_signals() < 0 )
+	  { rc = FALSE;
+	    goto out;
+	  }
+	  done = process_buffer_dtd_parser(p, in->bufp, n-1);
+	  skip_input(in, done);
+	  if ( has_content_length )
+	    content_length -= done;
+	  CHECKERROR;
+	  if ( pd->stopped )
+	    goto stopped;
+	  continue;
+	}
+      }
+
       if ( (++count % 8192) == 0 && PL_handle_signals() < 0 )
       { rc = FALSE;
 	goto out;
@@ -2059,6 +2792,7 @@ pl_sgml_parse(term_t parser, term_t options)
       if ( pd->stopped )
       { stopped:
 	pd->stopped = FALSE;
+	p->halted = FALSE;
 	if ( pd->stopat != SA_CONTENT )
 	  reset_document_dtd_parser(p);	/* ensure a clean start */
 	goto out;
@@ -2070,11 +2804,12 @@ pl_sgml_parse(term_t parser, term_t options)
     CHECKERROR;
 
   out:
-    reset_url_cache();
-    if ( pd->tail )
-    { if ( !PL_unify_nil(pd->tail) )
-	return FALSE;
-    }
+    if ( rc && !flush_events(pd) && pd->exception )
+      rc = FALSE;
+    if ( pd->list && !unify_document(pd) )
+      rc = FALSE;
+    if ( pd->list_failed )
+      rc = FALSE;
 
     if ( recursive )
     { p->closure = oldpd;
@@ -2083,13 +2818,11 @@ pl_sgml_parse(term_t parser, term_t options)
     }
 
     pd->magic = 0;			/* invalidate */
-    sgml_free(pd);
+    free_parser_data(pd);
 
     return rc;
   }
 
-  reset_url_cache();
-
   return TRUE;
 }
 
@@ -2702,14 +3435,19 @@ install()
 { initConstants();
 
   init_ring();
+  dtd_release_symbol = release_symbol;
+  dtd_release_attr = release_attr;
 
   PL_register_foreign("new_dtd",	  2, pl_new_dtd,	  0);
   PL_register_foreign("free_dtd",	  1, pl_free_dtd,	  0);
+  PL_register_foreign("freeze_dtd",	  1, pl_freeze_dtd,	  0);
   PL_register_foreign("new_sgml_parser",  2, pl_new_sgml_parser,  0);
   PL_register_foreign("free_sgml_parser", 1, pl_free_sgml_parser, 0);
   PL_register_foreign("set_sgml_parser",  2, pl_set_sgml_parser,  0);
   PL_register_foreign("get_sgml_parser",  2, pl_get_sgml_parser,  0);
   PL_register_foreign("open_dtd",         3, pl_open_dtd,	  0);
+  PL_register_foreign("save_dtd",         2, pl_save_dtd,	  0);
+  PL_register_foreign("load_dtd_image",   2, pl_load_dtd_image,  0);
   PL_register_foreign("sgml_parse",       2, pl_sgml_parse,
 		      PL_FA_TRANSPARENT);
   PL_register_foreign("_sgml_register_catalog_file", 2,
@@ -60,12 +60,11 @@ typedef wchar_t ichar;			/* input character */
 
 #define INPUT_CHARSET_SIZE	256	/* for now */
 #define SYMBOLHASHSIZE		256
-#define MAXSTRINGLEN	       4096
-#define MAXNMLEN		256
-#define MAXDECL		      10240
+#define INLINE_NMLEN		 64	/* names copied on the C stack */
+#define INLINE_TEXT	       1024	/* declaration text on the C stack */
+#define INLINE_ATTRIBUTES	 16	/* attributes of a tag on the C stack */
 #define MAXATTELEM		256	/* #elements in one ATTLIST */
 #define MAXNAMEGROUP		256	/* #names in a (group) */
-#define MAXATTRIBUTES		256	/* attributes per element */
 #define MAXMAPLEN		 32	/* max sequence length for SHORTREF */
 #define SHORTENTITYFILE		100	/* short external entities in mem */
 
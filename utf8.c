@@ -66,6 +66,68 @@ sgml__utf8_get_char(const char *in, int *chr)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+sgml_utf8_sequence() validates and  decodes   the  UTF-8  sequence that
+starts at in, reading no further than  end.   Unlike  the above, it only
+accepts well-formed UTF-8 (RFC 3629):  no   overlong  forms, surrogates
+or code points beyond 0x10FFFF. Returns
+
+  - The length of the sequence if it is valid
+  - 0 if the sequence is a valid prefix that is truncated by end
+  - -N if it is invalid, where N is the length of the maximal invalid
+    prefix (at least 1)
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+int
+sgml_utf8_sequence(const unsigned char *in, const unsigned char *end, int *chr)
+{ int c = in[0];
+  int lo = 0x80, hi = 0xbf;		/* valid range of the 2nd byte */
+  int i, len;
+
+  if ( c < 0x80 )
+  { *chr = c;
+    return 1;
+  } else if ( c < 0xc2 )		/* continuation or overlong */
+  { return -1;
+  } else if ( c < 0xe0 )
+  { len = 2;
+    c &= 0x1f;
+  } else if ( c < 0xf0 )
+  { len = 3;
+    if ( c == 0xe0 )
+      lo = 0xa0;			/* overlong */
+    else if ( c == 0xed )
+      hi = 0x9f;			/* surrogates */
+    c &= 0x0f;
+  } else if ( c < 0xf5 )
+  { len = 4;
+    if ( c == 0xf0 )
+      lo = 0x90;			/* overlong */
+    else if ( c == 0xf4 )
+      hi = 0x8f;			/* > 0x10ffff */
+    c &= 0x07;
+  } else
+  { return -1;
+  }
+
+  for(i=1; i<len; i++)
+  { int b;
+
+    if ( in+i >= end )
+      return 0;
+    b = in[i];
+    if ( b < lo || b > hi )
+      return -i;
+    c = (c<<6)|(b&0x3f);
+    lo = 0x80;
+    hi = 0xbf;
+  }
+
+  *chr = c;
+  return len;
+}
+
+
 char *
 sgml_utf8_put_char(char *out, int chr)
 { if ( chr < 0x80 )
@@ -34,6 +34,9 @@
 extern char *sgml__utf8_get_char(const char *in, int *chr);
 #define utf8_get_uchar(in, chr) (unsigned char*)utf8_get_char((char*)(in), chr)
 
+extern int sgml_utf8_sequence(const unsigned char *in,
+			      const unsigned char *end, int *chr);
+
 extern char *sgml_utf8_put_char(char *out, int chr);
 #define utf8_put_char(out, chr) \
 	((chr) < 0x80 ? out[0]=(char)(chr), out+1 \
@@ -33,6 +33,7 @@
 #endif
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -44,6 +45,10 @@
 #include <fcntl.h>
 #include <assert.h>
 #include "utf8.h"
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define USE_MMAP 1
+#endif
 
 size_t
 istrlen(const ichar *s)
@@ -203,41 +208,34 @@ istrlower(ichar *s)
 }
 
 
-int
-istrhash(const ichar *t, int tsize)
-{ unsigned int value = 0;
-  unsigned int shift = 5;
-
-  while(*t)
-  { unsigned int c = *t++;
-
-    c -= 'a';
-    value ^= c << (shift & 0xf);
-    shift ^= c;
-  }
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+istrfoldhash() computes a case-insensitive hash for  the symbol table.
+ASCII is folded without calling towlower(). Each  character is mixed in
+using a 64-bit multiply, followed by a final avalanche step, so similar
+names spread well over a power-of-two table. The steps are available as
+FOLDHASH_INIT, FOLDHASH_ADD() and foldhash_value(),  such that the parser
+can hash a name while scanning it.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  value = value ^ (value >> 16);
+unsigned int
+foldhash_value(uint64_t value)
+{ value ^= value >> 32;
+  value *= FOLDHASH_MUL;
+  value ^= value >> 29;
 
-  return value % tsize;
+  return (unsigned int)value;
 }
 
 
-int
-istrcasehash(const ichar *t, int tsize)
-{ unsigned int value = 0;
-  unsigned int shift = 5;
-
-  while(*t)
-  { unsigned int c = towlower(*t++);	/* case insensitive */
-
-    c -= 'a';
-    value ^= c << (shift & 0xf);
-    shift ^= c;
-  }
+unsigned int
+istrfoldhash(const ichar *t)
+{ uint64_t value = FOLDHASH_INIT;
+  ichar c;
 
-  value = value ^ (value >> 16);
+  while( (c = *t++) )
+    FOLDHASH_ADD(value, c);
 
-  return value % tsize;
+  return foldhash_value(value);
 }
 
 
@@ -341,13 +339,17 @@ UCS. It starts life as ISO Latin-1 and   is upgraded to UCS as the first
 character that doesn't fit ISO Latin-1 is added to the buffer.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+#define char_size(buf) ((buf)->wide ? sizeof(wchar_t) : 1)
+#define is_localbuf(buf) ((void*)(buf)->data.t == (void*)(buf)->localbuf)
+
 ocharbuf *
 init_ocharbuf(ocharbuf *buf, size_t limit)
 { buf->size      = 0;
-  buf->allocated = sizeof(buf->localbuf)/sizeof(wchar_t);
+  buf->wide      = FALSE;
+  buf->allocated = sizeof(buf->localbuf);
   buf->limit     = limit;
   buf->limit_reached = FALSE;
-  buf->data.w    = buf->localbuf;
+  buf->data.t    = (unsigned char*)buf->localbuf;
 
   return buf;
 }
@@ -363,50 +365,137 @@ new_ocharbuf(size_t limit)
 
 void
 free_ocharbuf(ocharbuf *buf)
-{ if ( buf->data.w && buf->data.w != buf->localbuf )
-    sgml_free(buf->data.w);
+{ if ( buf->data.t && !is_localbuf(buf) )
+    sgml_free(buf->data.t);
 
   sgml_free(buf);
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Make sure the data of the buffer is malloc'ed and nul-terminated.
+discard_ocharbuf() releases the data of a buffer that was initialised
+using init_ocharbuf() on the C-stack.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-ocharbuf *
-malloc_ocharbuf(ocharbuf *buf)
-{ if ( buf->data.w == buf->localbuf )
-  { int bytes = (buf->size+1) * sizeof(wchar_t);
+void
+discard_ocharbuf(ocharbuf *buf)
+{ if ( !is_localbuf(buf) )
+    sgml_free(buf->data.t);
+
+  init_ocharbuf(buf, buf->limit);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+grow_ocharbuf() ensures there is room for  at least `need' characters in
+the current representation. Returns FALSE if  this would exceed the limit.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+grow_ocharbuf(ocharbuf *buf, size_t need)
+{ size_t sz = buf->allocated;
+  size_t csize = char_size(buf);
+
+  while ( sz < need )
+    sz *= 2;
+  if ( buf->limit && sz*csize > (size_t)buf->limit )
+    return FALSE;
 
-    buf->data.w = sgml_malloc(bytes);
-    memcpy(buf->data.w, buf->localbuf, bytes);
-    buf->data.w[buf->size] = 0;
+  if ( !is_localbuf(buf) )
+  { buf->data.t = sgml_realloc(buf->data.t, sz*csize);
   } else
-    terminate_ocharbuf(buf);
+  { buf->data.t = sgml_malloc(sz*csize);
+    memcpy(buf->data.t, buf->localbuf, buf->size*csize);
+  }
+  buf->allocated = (int)sz;
 
-  return buf;
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+wide_ocharbuf() upgrades the buffer  to  UCS.   The  conversion  runs
+backwards, so it can be done in place.  Note that the character just
+after the content is converted as well,  as   the  parser may have put a
+0-terminator there.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+wchar_t *
+wide_ocharbuf(ocharbuf *buf)
+{ if ( !buf->wide )
+  { size_t n = buf->size < buf->allocated ? buf->size+1 : buf->size;
+    size_t sz = buf->allocated/sizeof(wchar_t);
+    unsigned char *t;
+    wchar_t *w;
+
+    if ( sz < n )
+    { while ( sz < n )
+	sz *= 2;
+      if ( !is_localbuf(buf) )
+      { buf->data.t = sgml_realloc(buf->data.t, sz*sizeof(wchar_t));
+      } else
+      { buf->data.t = sgml_malloc(sz*sizeof(wchar_t));
+	memcpy(buf->data.t, buf->localbuf, n);
+      }
+    }
+
+    t = buf->data.t;
+    w = buf->data.w;
+    while ( n-- > 0 )
+      w[n] = t[n];
+
+    buf->allocated = (int)sz;
+    buf->wide      = TRUE;
+  }
+
+  return buf->data.w;
 }
 
 
 void
 add_ocharbuf(ocharbuf *buf, int chr)
-{ if ( buf->size == buf->allocated )
-  { size_t sz = buf->allocated * 2;
-    if ( buf->limit && sz*sizeof(wchar_t) > buf->limit )
-    { buf->limit_reached = TRUE;
-      return;
-    }
-    buf->allocated = sz;
+{ if ( chr > 0xff && !buf->wide )
+    wide_ocharbuf(buf);
 
-    if ( buf->data.w != (wchar_t*)buf->localbuf )
-    { buf->data.w = sgml_realloc(buf->data.w, buf->allocated*sizeof(wchar_t));
-    } else
-    { buf->data.w = sgml_malloc(buf->allocated*sizeof(wchar_t));
-      memcpy(buf->data.w, buf->localbuf, sizeof(buf->localbuf));
-    }
+  if ( buf->size == buf->allocated &&
+       !grow_ocharbuf(buf, buf->size+1) )
+  { buf->limit_reached = TRUE;
+    return;
   }
-  buf->data.w[buf->size++] = chr;
+
+  if ( buf->wide )
+    buf->data.w[buf->size++] = chr;
+  else
+    buf->data.t[buf->size++] = (unsigned char)chr;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+add_bytes_ocharbuf() appends a run  of   single-byte  characters in one
+step. If the run does not fit  within   the  limit  nothing is added and
+FALSE is returned, so the caller can fall back to add_ocharbuf().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+int
+add_bytes_ocharbuf(ocharbuf *buf, const unsigned char *s, size_t len)
+{ size_t need = buf->size+len;
+
+  if ( need > (size_t)buf->allocated &&
+       !grow_ocharbuf(buf, need) )
+    return FALSE;
+
+  if ( buf->wide )
+  { wchar_t *d;
+    const unsigned char *e;
+
+    for(d=buf->data.w+buf->size, e=s+len; s<e; )
+      *d++ = *s++;
+  } else
+  { memcpy(buf->data.t+buf->size, s, len);
+  }
+  buf->size = (int)need;
+
+  return TRUE;
 }
 
 
@@ -426,23 +515,160 @@ terminate_ocharbuf(ocharbuf *buf)
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 empty_ocharbuf() frees the associated buffer after   a big lump has been
-in it. Otherwise it simply sets  the  size   to  0.
+in it. Otherwise it simply sets  the  size   to  0.  A buffer that was
+upgraded to UCS returns to ISO Latin-1, reusing its memory.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 void
 empty_ocharbuf(ocharbuf *buf)
 { buf->size = 0;
 
-  if ( buf->allocated > 8192 )
-  { assert(buf->data.w != buf->localbuf);
-    sgml_free(buf->data.w);
+  if ( buf->wide )
+  { buf->allocated *= sizeof(wchar_t);
+    buf->wide = FALSE;
+  }
+
+  if ( buf->allocated > 8192*sizeof(wchar_t) )
+  { assert(!is_localbuf(buf));
+    sgml_free(buf->data.t);
 
-    buf->allocated = sizeof(buf->localbuf)/sizeof(wchar_t);
-    buf->data.w = buf->localbuf;
+    buf->allocated = sizeof(buf->localbuf);
+    buf->data.t = (unsigned char*)buf->localbuf;
   }
 }
 
 
+		 /*******************************
+		 *	      ARENAS		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+An arena is a bump allocator  for   objects  that  share their lifetime.
+Memory is taken from chunks of ARENA_CHUNKSIZE bytes; larger requests get
+a chunk of their own. Objects are never freed individually: empty_arena()
+releases all objects at once, keeping one chunk for reuse. Objects with
+a nested lifetime are freed using mark_arena() and release_arena().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define ARENA_CHUNKSIZE 8192
+#define ARENA_ALIGN(n) (((n)+sizeof(double)-1) & ~(sizeof(double)-1))
+
+void
+init_arena(sgml_arena *a)
+{ a->chunks = NULL;
+  a->top    = NULL;
+  a->limit  = NULL;
+}
+
+
+void *
+arena_alloc(sgml_arena *a, size_t bytes)
+{ void *mem;
+
+  bytes = ARENA_ALIGN(bytes);
+  if ( (size_t)(a->limit - a->top) < bytes )
+  { size_t hdr = ARENA_ALIGN(sizeof(arena_chunk));
+    size_t size = (bytes > ARENA_CHUNKSIZE-hdr ? bytes+hdr : ARENA_CHUNKSIZE);
+    arena_chunk *c = sgml_malloc(size);
+
+    c->next   = a->chunks;
+    c->size   = size;
+    a->chunks = c;
+    a->top    = (char*)c + hdr;
+    a->limit  = (char*)c + size;
+  }
+
+  mem = a->top;
+  a->top += bytes;
+
+  return mem;
+}
+
+
+void *
+arena_calloc(sgml_arena *a, size_t bytes)
+{ void *mem = arena_alloc(a, bytes);
+
+  memset(mem, 0, bytes);
+
+  return mem;
+}
+
+
+ichar *
+arena_istrndup(sgml_arena *a, const ichar *s, size_t len)
+{ ichar *dup = arena_alloc(a, (len+1)*sizeof(ichar));
+
+  memcpy(dup, s, len*sizeof(ichar));
+  dup[len] = 0;
+
+  return dup;
+}
+
+
+ichar *
+arena_istrdup(sgml_arena *a, const ichar *s)
+{ return arena_istrndup(a, s, istrlen(s));
+}
+
+
+void
+empty_arena(sgml_arena *a)
+{ arena_chunk *c, *next;
+
+  if ( !(c=a->chunks) )
+    return;
+
+  for(next=c->next; next; next=c->next)	/* keep the oldest chunk */
+  { sgml_free(c);
+    c = next;
+  }
+
+  a->chunks = c;
+  a->top    = (char*)c + ARENA_ALIGN(sizeof(arena_chunk));
+  a->limit  = (char*)c + c->size;
+}
+
+
+void
+mark_arena(sgml_arena *a, arena_mark *m)
+{ m->chunk = a->chunks;
+  m->top   = a->top;
+}
+
+
+void
+release_arena(sgml_arena *a, arena_mark *m)
+{ arena_chunk *c;
+
+  if ( !m->chunk )
+  { empty_arena(a);
+    return;
+  }
+
+  while( (c=a->chunks) != m->chunk )
+  { a->chunks = c->next;
+    sgml_free(c);
+  }
+
+  a->top   = m->top;
+  a->limit = (char*)c + c->size;
+}
+
+
+void
+free_arena(sgml_arena *a)
+{ arena_chunk *c, *next;
+
+  for(c=a->chunks; c; c=next)
+  { next = c->next;
+    sgml_free(c);
+  }
+
+  init_arena(a);
+}
+
+
 		 /*******************************
 		 *	   BUFFER RING		*
 		 *******************************/
@@ -668,74 +894,136 @@ wopen(const wchar_t *name, int flags)
 }
 
 
-ichar *
-load_sgml_file_to_charp(const ichar *file, int normalise_rsre, size_t *length)
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+open_file_buffer() makes the content of  a   file  available  as a byte
+array. Where possible the file is  mapped   into  memory, so the parser
+reads straight from the page cache.   Otherwise (no mmap(), empty files,
+special files) the file is read into allocated memory.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+read_file_buffer(int fd, file_buffer *fb, size_t len)
+{ char *r = sgml_malloc(len+1);
+  char *s = r;
+
+  while(len>0)
+  { int n;
+
+    if ( (n=(int)read(fd, s, (unsigned int)len)) < 0 )
+    { sgml_free(r);			/* I/O error */
+      return FALSE;
+    } else if ( n == 0 )
+      break;
+    len -= n;
+    s += n;
+  }
+
+  fb->data   = r;
+  fb->size   = s-r;
+  fb->mapped = FALSE;
+
+  return TRUE;
+}
+
+
+int
+open_file_buffer(const ichar *file, file_buffer *fb)
 { int fd;
+  int rc = FALSE;
 
   if ( (fd = wopen(file, O_RDONLY|O_BINARY)) >= 0 )
   { struct stat buf;
 
     if ( fstat(fd, &buf) == 0 )
     { size_t len = buf.st_size;
-      char *r = sgml_malloc(len+1);
-
-      if ( r )
-      { char *s = r;
-
-	while(len>0)
-	{ int n;
-
-	  if ( (n=(int)read(fd, s, (unsigned int)len)) < 0 )
-	  { close(fd);			/* I/O error */
-	    sgml_free(r);
-	    return NULL;
-	  } else if ( n == 0 )
-	    break;
-	  len -= n;
-	  s += n;
-	}
 
-	len = s-r;
-	*s = '\0';			/* ensure closing EOS */
-	close(fd);
-
-	{ int nl;
-	  int last_is_lf;
-	  ichar *r2, *t;
-
-	  if ( normalise_rsre )
-	  { last_is_lf = (len > 0 && s[-1] == '\n');
-	    for(s=r, nl=0; *s; s++)
-	    { if ( *s == '\n' && s>r && s[-1] != '\r' )
-		nl++;
-	    }
-	  } else
-	  { nl = 0;
-	    last_is_lf = 0;
-	  }
-
-	  r2 = sgml_malloc((len+nl+1)*sizeof(ichar));
-	  for(s=r, t=r2; *s; s++)
-	  { if ( *s == '\n' )
-	    { if ( s>r && s[-1] != '\r' )
-		*t++ = CR;
-	      *t++ = LF;
-	    } else
-	      *t++ = *s;
-	  }
-	  len = t-r2;
-	  *t = '\0';
-
-	  if ( last_is_lf )
-	    r2[--len] = '\0';		/* delete last LF */
-
-	  if ( length )
-	    *length = len;
-	  sgml_free(r);
-	  return r2;
+#ifdef USE_MMAP
+      if ( len > 0 && S_ISREG(buf.st_mode) )
+      { void *m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if ( m != MAP_FAILED )
+	{ fb->data   = m;
+	  fb->size   = len;
+	  fb->mapped = TRUE;
+	  close(fd);
+
+	  return TRUE;
 	}
       }
+#endif
+      rc = read_file_buffer(fd, fb, len);
+    }
+
+    close(fd);
+  }
+
+  return rc;
+}
+
+
+void
+close_file_buffer(file_buffer *fb)
+{
+#ifdef USE_MMAP
+  if ( fb->mapped )
+  { munmap((void*)fb->data, fb->size);
+    return;
+  }
+#endif
+  sgml_free((void*)fb->data);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+load_sgml_file_to_charp() converts the bytes   of  the file directly into
+the ichar result. If normalise_rsre is TRUE, a CR is inserted before
+each LF that is not preceded by one  and   a  LF  ending the file is
+deleted. As before, the content ends at the first 0-byte.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+ichar *
+load_sgml_file_to_charp(const ichar *file, int normalise_rsre, size_t *length)
+{ file_buffer fb;
+
+  if ( open_file_buffer(file, &fb) )
+  { const unsigned char *r = (const unsigned char *)fb.data;
+    const unsigned char *e, *s;
+    const unsigned char *z;
+    size_t len, nl = 0;
+    ichar *r2, *t;
+
+    if ( (z = memchr(r, 0, fb.size)) )
+      e = z;
+    else
+      e = r+fb.size;
+
+    if ( normalise_rsre )
+    { for(s=r; s<e; s++)
+      { if ( *s == '\n' && s>r && s[-1] != '\r' )
+	  nl++;
+      }
     }
+
+    r2 = sgml_malloc(((e-r)+nl+1)*sizeof(ichar));
+    for(s=r, t=r2; s<e; s++)
+    { if ( *s == '\n' && normalise_rsre )
+      { if ( s>r && s[-1] != '\r' )
+	  *t++ = CR;
+      }
+      *t++ = *s;
+    }
+    len = t-r2;
+    *t = '\0';
+
+    if ( normalise_rsre && e > r && e[-1] == '\n' )
+      r2[--len] = '\0';			/* delete last LF */
+
+    close_file_buffer(&fb);
+
+    if ( length )
+      *length = len;
+
+    return r2;
   }
 
   return NULL;
@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <wchar.h>
+#include <wctype.h>
+#include <stdint.h>
 
 #ifdef _WINDOWS				/* get size_t */
 #include <malloc.h>
@@ -47,12 +49,36 @@ typedef struct
   int size;
   int limit;
   int limit_reached;
+  int wide;				/* data.w is in use */
   union
   { wchar_t *w;				/* UCS */
+    unsigned char *t;			/* ISO Latin-1 */
   } data;
   wchar_t localbuf[256];		/* Initial local store */
 } ocharbuf;
 
+typedef struct _arena_chunk
+{ struct _arena_chunk *next;		/* next (older) chunk */
+  size_t      size;			/* size of the chunk in bytes */
+} arena_chunk;
+
+typedef struct
+{ arena_chunk *chunks;			/* chunks, newest first */
+  char	     *top;			/* first free byte */
+  char	     *limit;			/* end of current chunk */
+} sgml_arena;
+
+typedef struct
+{ arena_chunk *chunk;			/* chunk at the time of the mark */
+  char	     *top;			/* top at the time of the mark */
+} arena_mark;
+
+typedef struct
+{ const char *data;			/* content of the file */
+  size_t      size;			/* # bytes in data */
+  int	      mapped;			/* data is mmap()ed */
+} file_buffer;
+
 size_t		istrlen(const ichar *s);
 ichar *         istrdup(const ichar *s);
 ichar *         istrndup(const ichar *s, int len);
@@ -65,8 +91,8 @@ int             istrprefix(const ichar *pref, const ichar *s);
 int             istreq(const ichar *s1, const ichar *s2);
 int             istrcaseeq(const ichar *s1, const ichar *s2);
 int		istrncaseeq(const ichar *s1, const ichar *s2, int len);
-int             istrhash(const ichar *t, int tsize);
-int             istrcasehash(const ichar *t, int tsize);
+unsigned int	istrfoldhash(const ichar *t);
+unsigned int	foldhash_value(uint64_t h);
 ichar *		istrchr(const ichar *s, int c);
 int		istrtol(const ichar *s, long *val);
 void *		sgml_malloc(size_t size);
@@ -75,6 +101,15 @@ void		sgml_free(void *mem);
 void *		sgml_realloc(void *old, size_t size);
 void		sgml_nomem(void);
 
+/* istrfoldhash() in steps, such that names can be hashed while scanning */
+#define FOLDCHAR(c) \
+	((c) < 0x80 ? ((c) >= 'A' && (c) <= 'Z' ? (c)+('a'-'A') : (c)) \
+		    : (ichar)towlower(c))
+#define FOLDHASH_INIT	0x2545F4914F6CDD1DULL
+#define FOLDHASH_MUL	0x9E3779B97F4A7C15ULL
+#define FOLDHASH_ADD(h, c) \
+	((h) = ((h) ^ (uint64_t)FOLDCHAR(c)) * FOLDHASH_MUL)
+
 #define add_icharbuf(buf, chr) \
 	do { if ( buf->size < buf->allocated && chr < 128 ) \
 	       buf->data[buf->size++] = chr; \
@@ -92,16 +127,33 @@ void		empty_icharbuf(icharbuf *buf);
 ocharbuf *	init_ocharbuf(ocharbuf *buf, size_t limit);
 ocharbuf *	new_ocharbuf(size_t limit);
 void		free_ocharbuf(ocharbuf *buf);
-ocharbuf *	malloc_ocharbuf(ocharbuf *buf);
+void		discard_ocharbuf(ocharbuf *buf);
 void		add_ocharbuf(ocharbuf *buf, int chr);
+int		add_bytes_ocharbuf(ocharbuf *buf,
+				   const unsigned char *s, size_t len);
 void		del_ocharbuf(ocharbuf *buf);
 void		terminate_ocharbuf(ocharbuf *buf);
 void		empty_ocharbuf(ocharbuf *buf);
-#define fetch_ocharbuf(buf, at) ((wint_t)buf->data.w[at])
+wchar_t *	wide_ocharbuf(ocharbuf *buf);
+#define fetch_ocharbuf(buf, at) \
+	((buf)->wide ? (wint_t)(buf)->data.w[at] : (wint_t)(buf)->data.t[at])
 #define poke_ocharbuf(buf, at, chr) \
-	{ buf->data.w[at] = chr; \
+	{ if ( (buf)->wide ) \
+	    (buf)->data.w[at] = chr; \
+	  else \
+	    (buf)->data.t[at] = (unsigned char)(chr); \
 	}
 
+void		init_arena(sgml_arena *a);
+void *		arena_alloc(sgml_arena *a, size_t bytes);
+void *		arena_calloc(sgml_arena *a, size_t bytes);
+ichar *		arena_istrdup(sgml_arena *a, const ichar *s);
+ichar *		arena_istrndup(sgml_arena *a, const ichar *s, size_t len);
+void		mark_arena(sgml_arena *a, arena_mark *m);
+void		release_arena(sgml_arena *a, arena_mark *m);
+void		empty_arena(sgml_arena *a);
+void		free_arena(sgml_arena *a);
+
 void		init_ring(void);
 void		stop_ring(void);
 const wchar_t *	str_summary(const wchar_t *s, int len);
@@ -111,6 +163,8 @@ wchar_t * 	utf8towcs(const char *in);
 char *		wcstoutf8(const wchar_t *in);
 ichar *		load_sgml_file_to_charp(const ichar *file, int normalise_rsre,
 					size_t *len);
+int		open_file_buffer(const ichar *file, file_buffer *fb);
+void		close_file_buffer(file_buffer *fb);
 FILE *		wfopen(const wchar_t *name, const char *mode);
 
 #if defined(USE_STRING_FUNCTIONS) && !defined(UTIL_H_IMPLEMENTATION)
@@ -29,6 +29,9 @@
     the GNU General Public License.
 */
 
+#include <string.h>
+#include <assert.h>
+#include "xml_unicode.h"
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 XML character classification.
@@ -1256,3 +1259,62 @@ xml_extender(int c)
   }
 }
 
+
+
+		 /*******************************
+		 *	 CLASSIFICATION TABLE	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+xml_char_class() (see xml_unicode.h) classifies a character using a two
+level table. The high byte of a  character   in  the BMP selects a page
+holding the XML_* class of each of its 256 characters. Characters above
+the BMP are not XML 1.0 name characters.   Most pages are equal, so only
+the distinct pages are stored; page 0 is the empty page.
+
+init_xml_char_classes() builds the table  from   the  functions  above. It
+must be called before xml_char_class()  is   used  and  may not run
+concurrently with itself.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define XML_MAX_CLASS_PAGES 64
+
+unsigned char xml_class_index[256];
+unsigned char xml_class_pages[XML_MAX_CLASS_PAGES][256];
+static int xml_class_pages_done = 0;
+
+void
+init_xml_char_classes(void)
+{ int npages = 1;			/* page 0: no class */
+  int p;
+
+  if ( xml_class_pages_done )
+    return;
+
+  for(p=0; p<256; p++)
+  { unsigned char page[256];
+    int i;
+
+    for(i=0; i<256; i++)
+    { int c = p*256+i;
+
+      page[i] = ( (xml_basechar(c)	 ? XML_BASECHAR	      : 0) |
+		  (xml_ideographic(c)	 ? XML_IDEOGRAPHIC    : 0) |
+		  (xml_combining_char(c) ? XML_COMBINING_CHAR : 0) |
+		  (xml_digit(c)		 ? XML_DIGIT	      : 0) |
+		  (xml_extender(c)	 ? XML_EXTENDER	      : 0) );
+    }
+
+    for(i=0; i<npages; i++)
+    { if ( memcmp(xml_class_pages[i], page, sizeof(page)) == 0 )
+	break;
+    }
+    if ( i == npages )
+    { assert(npages < XML_MAX_CLASS_PAGES);
+      memcpy(xml_class_pages[npages++], page, sizeof(page));
+    }
+    xml_class_index[p] = (unsigned char)i;
+  }
+
+  xml_class_pages_done = 1;
+}
@@ -38,4 +38,23 @@ int	xml_combining_char(int c);
 int	xml_digit(int c);
 int	xml_extender(int c);
 
+#define XML_BASECHAR		0x01
+#define XML_IDEOGRAPHIC		0x02
+#define XML_COMBINING_CHAR	0x04
+#define XML_DIGIT		0x08
+#define XML_EXTENDER		0x10
+
+#define XML_NMSTART_CHAR	(XML_BASECHAR|XML_IDEOGRAPHIC)
+#define XML_NAME_CHAR		(XML_NMSTART_CHAR|XML_COMBINING_CHAR| \
+				 XML_DIGIT|XML_EXTENDER)
+
+extern unsigned char xml_class_index[256];
+extern unsigned char xml_class_pages[][256];
+
+void	init_xml_char_classes(void);
+
+#define xml_char_class(c) \
+	((unsigned int)(c) <= 0xffff \
+		? xml_class_pages[xml_class_index[(c)>>8]][(c)&0xff] : 0)
+
 #endif /*XML_UNICODE_H_INCLUDED*/
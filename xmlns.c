@@ -32,9 +32,16 @@
 xmlns *
 xmlns_push(dtd_parser *p, const ichar *ns, const ichar *url)
 { sgml_environment *env = p->environments;
-  dtd_symbol *n = (*ns ? dtd_add_symbol(p->dtd, ns) : (dtd_symbol *)NULL);
-  dtd_symbol *u = dtd_add_symbol(p->dtd, url); /* TBD: ochar/ichar */
-  xmlns *x = sgml_malloc(sizeof(*x));
+  dtd_symbol *n = (*ns ? add_symbol_dtd_parser(p, ns) : (dtd_symbol *)NULL);
+  dtd_symbol *u = add_symbol_dtd_parser(p, url); /* TBD: ochar/ichar */
+  xmlns *x;
+
+  if ( !env )
+    x = sgml_malloc(sizeof(*x));
+  else if ( (x=p->free_xmlns) )
+    p->free_xmlns = x->next;
+  else
+    x = arena_alloc(&p->arena, sizeof(*x));
 
   x->name = n;
   x->url  = u;
@@ -66,6 +73,24 @@ xmlns_free(xmlns *n)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+xmlns_release() returns the declarations   of  an environment, allocated
+from the parser's arena, to the free-list.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+void
+xmlns_release(dtd_parser *p, xmlns *n)
+{ xmlns *next;
+
+  for(; n; n = next)
+  { next = n->next;
+
+    n->next = p->free_xmlns;
+    p->free_xmlns = n;
+  }
+}
+
+
 xmlns *
 xmlns_find(dtd_parser *p, dtd_symbol *ns)
 { sgml_environment *env = p->environments;
@@ -105,7 +130,7 @@ update_xmlns(dtd_parser *p, dtd_element *e, int natts, sgml_attribute *atts)
 { dtd_attr_list *al;
   int nschr = p->dtd->charfunc->func[CF_NS]; /* : */
 
-  for(al=e->attributes; al; al=al->next)
+  for(al=dtd_default_attributes(p->dtd, e); al; al=al->next)
   { dtd_attr *a = al->attribute;
     const ichar *name = a->name->name;
 
@@ -141,8 +166,6 @@ xmlns_resolve_attribute(dtd_parser *p, dtd_symbol *id,
 			const ichar **local, const ichar **url)
 { dtd *dtd = p->dtd;
   int nschr = dtd->charfunc->func[CF_NS]; /* : */
-  ichar buf[MAXNMLEN];
-  ichar *o = buf;
   const ichar *s;
   xmlns *ns;
 
@@ -150,11 +173,10 @@ xmlns_resolve_attribute(dtd_parser *p, dtd_symbol *id,
   { if ( *s == nschr )
     { dtd_symbol *n;
 
-      *o = '\0';
       *local = s+1;
-      n = dtd_add_symbol(dtd, buf);
+      n = add_nsymbol_dtd_parser(p, id->name, s-id->name);
 
-      if ( istrprefix(L"xml", buf) )	/* XML reserved namespaces */
+      if ( istrprefix(L"xml", n->name) ) /* XML reserved namespaces */
       { *url = n->name;
         return TRUE;
       } else if ( (ns = xmlns_find(p, n)) )
@@ -171,7 +193,6 @@ xmlns_resolve_attribute(dtd_parser *p, dtd_symbol *id,
 	return FALSE;
       }
     }
-    *o++ = *s;
   }
 
   *local = id->name;
@@ -200,8 +221,6 @@ xmlns_resolve_element(dtd_parser *p, const ichar **local, const ichar **url)
   { dtd_symbol *id = e->element->name;
     dtd *dtd = p->dtd;
     int nschr = dtd->charfunc->func[CF_NS]; /* : */
-    ichar buf[MAXNMLEN];
-    ichar *o = buf;
     const ichar *s;
     xmlns *ns;
 
@@ -209,9 +228,8 @@ xmlns_resolve_element(dtd_parser *p, const ichar **local, const ichar **url)
     { if ( *s == nschr )		/* explicit namespace */
       { dtd_symbol *n;
 
-	*o = '\0';
 	*local = s+1;
-	n = dtd_add_symbol(dtd, buf);
+	n = add_nsymbol_dtd_parser(p, id->name, s-id->name);
 
 	if ( (ns = xmlns_find(p, n)) )
 	{ if ( ns->url->name[0] )
@@ -229,7 +247,6 @@ xmlns_resolve_element(dtd_parser *p, const ichar **local, const ichar **url)
 	  return FALSE;
 	}
       }
-      *o++ = *s;
     }
 
     *local = id->name;
@@ -32,6 +32,7 @@ typedef struct _xmlns
 } xmlns;
 
 void		xmlns_free(xmlns *list);
+void		xmlns_release(dtd_parser *p, xmlns *list);
 xmlns*		xmlns_find(dtd_parser *p, dtd_symbol *ns);
 xmlns *		xmlns_push(dtd_parser *p, const ichar *ns, const ichar *url);
 void		update_xmlns(dtd_parser *p, dtd_element *e,